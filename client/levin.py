@@ -24,6 +24,13 @@ import socket
 
 VERSION = 0.4
 
+# LEVX flags
+LEV_DFA = 1
+LEV_TOPK = 2
+LEV_STREAM = 4
+LEV_KEYS = 8
+LEV_PARALLEL = 16
+
 try:
     xrange
 except NameError:
@@ -49,6 +56,8 @@ class Request:
                 self.stream.append((data >> s) & 0xFF)
         elif isinstance(data, str):
             self.stream.extend((ord(c) for c in data))
+        elif isinstance(data, (bytes, bytearray)):
+            self.stream.extend(data)
 
     def write_string(self, s):
         self.write(len(s), bit = 32)
@@ -103,9 +112,18 @@ class Response:
                 return False
 
             self.kind = self.read_u8()
-            self.len = 5 + self.read_u32()
             self.header = True
 
+            if self.kind == 2:
+                # streamed: chunks (u32 length + data), 0 and u32 count
+                self.chunks = bytearray()
+                self.count = None
+            else:
+                self.len = 5 + self.read_u32()
+
+        if self.kind == 2:
+            return self.read_chunks()
+
         if currentlen > self.len:
             raise ValueError("received %s byte but expected %s byte", 
                     len(self.data),
@@ -114,28 +132,54 @@ class Response:
         return currentlen == self.len
 
 
-    def parse(self):
+    def read_chunks(self):
+        if self.count is not None:
+            return True
+
+        while len(self.data) >= self.cursor + 4:
+            n = Response.decode_u32(self.data[self.cursor:])
+
+            if n == 0:
+                if len(self.data) < self.cursor + 8:
+                    return False
+
+                self.cursor += 4
+                self.count = self.read_u32()
+
+                if self.cursor != len(self.data):
+                    raise ValueError("data after the end of stream")
+
+                return True
+
+            if len(self.data) < self.cursor + 4 + n:
+                return False
+
+            self.cursor += 4
+            self.chunks.extend(self.data[self.cursor:self.cursor + n])
+            self.cursor += n
+
+        return False
+
+
+    def parse(self, read_list = None):
         assert self.is_complete()
            
         if self.kind == 0:
             return self.data[5:]
 
         elif self.kind == 1:
-            result = []
-            
-            n = self.read_u32()
+            return (read_list or Response.read_lev_list)(self)
 
-            for i in xrange(n):
-                dist = self.read_u8()
-                suffix = self.read_u8()
-                word = self.read_string()
-                data = self.read_string()
+        elif self.kind == 2:
+            # same list of kind 1: the count and the chunks
+            r = Response()
+            r.add(self.data[self.cursor - 4:self.cursor])
+            r.add(self.chunks)
+            result = (read_list or Response.read_lev_list)(r)
 
-                result.append({
-                    'lev': dist,
-                    'word': word,
-                    'data': data,
-                    'suffix': suffix})
+            if r.cursor != len(r.data):
+                raise ValueError("streamed results don't match count %s" %
+                                 self.count)
 
             return result
 
@@ -143,6 +187,50 @@ class Response:
             raise Exception("unexpected message kind = %s" % self.kind)
 
 
+    @staticmethod
+    def decode_u32(data):
+        n = 0
+        for i in xrange(4):
+            n += data[i] << ((3 - i) * 8)
+        return n
+
+
+    def read_lev_record(self, values = True):
+        dist = self.read_u8()
+        suffix = self.read_u8()
+        word = self.read_string()
+        data = self.read_string() if values else None
+
+        return {
+            'lev': dist,
+            'word': word,
+            'data': data,
+            'suffix': suffix}
+
+
+    def read_lev_list(self, values = True):
+        n = self.read_u32()
+
+        return [self.read_lev_record(values) for i in xrange(n)]
+
+
+    def read_scan_list(self, values):
+        result = []
+
+        n = self.read_u32()
+
+        for i in xrange(n):
+            key = self.read_string()
+            if values:
+                result.append((key, self.read_string()))
+            else:
+                result.append(key)
+
+        token = self.read_string()
+
+        return result, token
+
+
 
 class Client:
     recvsize = 1024
@@ -191,7 +279,7 @@ class Client:
         self.sock = None
 
 
-    def read_response(self):
+    def read_response(self, read_list = None):
         r = Response()
 
         while True:
@@ -206,7 +294,7 @@ class Client:
                 break;
 
         try:
-            msg = r.parse()
+            msg = r.parse(read_list)
         except Exception as e:
             self.sock.close()
             self.sock = None
@@ -215,7 +303,7 @@ class Client:
         return msg 
 
 
-    def send_request(self, request):
+    def send_request(self, request, read_list = None):
         msg = request.stream
   
         nsend = 0 
@@ -227,7 +315,7 @@ class Client:
             if nsend >= total:
                 break
 
-        return self.read_response()
+        return self.read_response(read_list)
             
 
     def set(self, key, value, kind = None):
@@ -255,20 +343,198 @@ class Client:
             raise Exception("unexpected get-response")
 
 
-    def lev(self, key, cost, maxsuffixlen = 0):
+    def lev(self, key, cost, maxsuffixlen = 0, dfa = False, top = None,
+            stream = True, values = True, parallel = False):
+        """
+        Return the keys within edit distance `cost` of `key`; with
+        dfa = True the server intersects the trie with a Levenshtein
+        automaton (same results). With `top` return only the `top`
+        closest keys, sorted by distance. With stream = True the server
+        sends the results while it finds them. With values = False
+        the results have only keys and distances ('data' is None).
+        With parallel = True the search is split across the server
+        threads (a big search is parallel anyway).
+        """
+        r = self.lev_request(key, cost, maxsuffixlen, dfa, top, stream,
+                             values, parallel)
+
+        return self.send_request(r,
+                None if values else lambda res: res.read_lev_list(False))
+
+
+    def lev_iter(self, key, cost, maxsuffixlen = 0, dfa = False,
+                 top = None, values = True, parallel = False):
+        """
+        Like lev but yield the results as they arrive (the generator
+        must be consumed to the end before the next request).
+        """
+        r = self.lev_request(key, cost, maxsuffixlen, dfa, top, True,
+                             values, parallel)
+
+        self.sock.sendall(r.stream)
+
+        if self.recv_exact(1)[0] != 2:
+            raise Exception("unexpected lev response")
+
+        while True:
+            n = Response.decode_u32(self.recv_exact(4))
+
+            if n == 0:
+                break
+
+            chunk = Response()
+            chunk.add(self.recv_exact(n))
+
+            while chunk.cursor < n:
+                yield chunk.read_lev_record(values)
+
+        # results count
+        self.recv_exact(4)
+
+
+    def recv_exact(self, n):
+        data = bytearray()
+
+        while len(data) < n:
+            d = self.sock.recv(n - len(data))
+
+            if not d:
+                raise IOError("connection socket closed")
+
+            data.extend(d)
+
+        return data
+
+
+    def lev_request(self, key, cost, maxsuffixlen, dfa, top, stream,
+                    values = True, parallel = False):
         if cost > 255:
             raise Exception("lev cost cannot be > 255")
 
         if maxsuffixlen > 255:
             raise Exception("lev suffix cannot be > 255")
 
-        r = Request(3)
+        flags = 0
+
+        if dfa:
+            flags |= LEV_DFA
+
+        if top is not None:
+            if top > 65535:
+                raise Exception("lev top cannot be > 65535")
+
+            flags |= LEV_TOPK
+
+        if stream:
+            flags |= LEV_STREAM
+
+        if not values:
+            flags |= LEV_KEYS
+
+        if parallel:
+            flags |= LEV_PARALLEL
+
+        if flags:
+            # LEVX: LEV with flags
+            r = Request(10)
+            r.write(flags, bit = 8)
+        else:
+            r = Request(3)
+
         r.write_string(key)
         # write cost + (maxsuffixlen << 8),  bit = 16
         r.write(maxsuffixlen, bit = 8)
         r.write(cost, bit = 8)
 
-        return self.send_request(r)
+        if top is not None:
+            r.write(top, bit = 16)
+
+        return r
+
+
+    def scan(self, start = '', end = '', limit = 0, values = False,
+             prefix = False, token = ''):
+        """
+        Return a page of keys (or (key, value) pairs) in [start, end)
+        (or starting with `start` if prefix is True) and the token for
+        the next page ('' means no more keys).
+        """
+        if limit > 65535:
+            raise Exception("scan limit cannot be > 65535")
+
+        r = Request(4)
+        r.write((1 if values else 0) | (2 if prefix else 0), bit = 8)
+        r.write_string(start)
+        r.write_string(end)
+        r.write(limit, bit = 16)
+        r.write_string(token)
+
+        return self.send_request(r,
+                lambda res: res.read_scan_list(values))
+
+
+    def count(self, prefix = ''):
+        """ number of keys starting with prefix (all keys if empty) """
+        r = Request(5)
+        r.write_string(prefix)
+
+        return Response.decode_u32(self.send_request(r))
+
+
+    def rank(self, key):
+        """ number of keys lower than key """
+        r = Request(6)
+        r.write_string(key)
+
+        return Response.decode_u32(self.send_request(r))
+
+
+    def select(self, prefix, n):
+        """ n-th (from 0) key starting with prefix: (found, key, value) """
+        r = Request(7)
+        r.write_string(prefix)
+        r.write(n, bit = 32)
+
+        res = self.send_request(r)
+
+        if res[0] == ord('!'):
+            return False, None, res[1:]
+
+        res = Response.decode_u32(res[1:5]), res[5:]
+        return True, res[1][:res[0]], res[1][res[0]:]
+
+
+    def defrag(self):
+        """ start a defragmentation pass (done by the server when idle) """
+        return self.send_request(Request(8))
+
+
+    def flushall(self):
+        """ remove every key """
+        return self.send_request(Request(9))
+
+
+    def stats(self):
+        """ counters of the LEV cache """
+        res = self.send_request(Request(11))
+        names = ('hits', 'misses', 'evicts', 'entries', 'bytes')
+
+        return dict((k, (Response.decode_u32(res[i * 8:]) << 32) +
+                        Response.decode_u32(res[i * 8 + 4:]))
+                    for i, k in enumerate(names))
+
+
+    def scan_all(self, start = '', end = '', limit = 0, values = False,
+                 prefix = False):
+        token = ''
+        while True:
+            page, token = self.scan(start, end, limit, values, prefix,
+                                    token)
+            for item in page:
+                yield item
+
+            if not token:
+                break
 
 
 
@@ -309,6 +575,21 @@ if __name__ == '__main__':
             'p': "key [max-cost [max-prefix-len]]", 
             'd': "search all word within a Levensthein distance max-cost"
         },
+        'levdfa': {
+            'p': "key [max-cost [max-prefix-len]]",
+            'd': "lev with the Levenshtein automaton engine"
+        },
+        'scan': {
+            'p': "[prefix [limit]]",
+            'd': "list keys (and values) with prefix in order"
+        },
+        'count': {
+            'p': "[prefix]",
+            'd': "count keys with prefix"
+        },
+        'defrag': "relayout the trie in memory (in background)",
+        'flushall': "remove every key",
+        'stats': "show the LEV cache counters",
         'load': {
             'p': "filename",
             'd': "load keys and values from filename",
@@ -387,14 +668,58 @@ if __name__ == '__main__':
             response = client.set(k, v)
 
         # LEV key [cost] [maxsuffix]
-        elif cm == 'lev':
+        elif cm == 'lev' or cm == 'levdfa':
             k, args = fetcharg(args, 'k');
             cost, args = fetcharg(args, 'i', default = 2)
             maxsufflen, args = fetcharg(args, 'i', default = 0)
             
             fetcharg(args, None);
                             
-            response = client.lev(k, cost, maxsufflen)
+            response = client.lev(k, cost, maxsufflen,
+                                  dfa = (cm == 'levdfa'))
+
+        # SCAN [prefix] [limit]
+        elif cm == 'scan':
+            p, args = fetcharg(args, 'k', default = '')
+            limit, args = fetcharg(args, 'i', default = 20)
+
+            fetcharg(args, None);
+
+            page, token = client.scan(p, limit = limit, values = True,
+                                      prefix = True)
+
+            response = 'nresult = %s%s\n' % (len(page),
+                                             ' (more...)' if token else '')
+            for k, v in page:
+                response += '    %s: %s\n' % (k.decode('latin1'),
+                                              repr(str(v)))
+
+        # COUNT [prefix]
+        elif cm == 'count':
+            p, args = fetcharg(args, 'k', default = '')
+
+            fetcharg(args, None);
+
+            response = str(client.count(p))
+
+        # DEFRAG
+        elif cm == 'defrag':
+            fetcharg(args, None);
+
+            response = client.defrag()
+
+        # FLUSHALL
+        elif cm == 'flushall':
+            fetcharg(args, None);
+
+            response = client.flushall()
+
+        # STATS
+        elif cm == 'stats':
+            fetcharg(args, None);
+
+            response = ' '.join('%s = %s' % kv for kv in
+                                sorted(client.stats().items()))
 
         elif cm == 'load':
             filename, args = fetcharg(args, 'D')
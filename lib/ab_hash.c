@@ -0,0 +1,229 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Fabio Sassi <fabio dot s81 at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "ab_hash.h"
+
+
+#define AB_HASH_MINSIZE 64
+
+
+static uint64_t ab_hashMix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+
+/* hash 8 bytes for step (keys can be long) */
+static uint64_t ab_hashKey(const char *key, int len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+	uint64_t w;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, key + i, 8);
+		h = (h ^ ab_hashMix(w)) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	if (i < len) {
+		w = 0;
+		memcpy(&w, key + i, len - i);
+		h = (h ^ ab_hashMix(w)) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	return ab_hashMix(h);
+}
+
+
+/* slot of the key or of the empty slot where it would be inserted */
+static uint32_t ab_hashSlot(ab_Hash *h, uint64_t hash, const char *key,
+                            int len)
+{
+	uint32_t mask = h->size - 1;
+	uint32_t i = hash & mask;
+
+	for (;;) {
+		ab_HashItem *item = h->items + i;
+
+		if (!item->key)
+			return i;
+
+		if ((item->hash == hash) && (item->len == len) &&
+		    !memcmp(item->key, key, len))
+			return i;
+
+		i = (i + 1) & mask;
+	}
+}
+
+
+static void ab_hashResize(ab_Hash *h, uint32_t size)
+{
+	ab_HashItem *old = h->items;
+	uint32_t oldsize = h->size;
+	uint32_t i;
+
+	h->items = ea_allocArray(ab_HashItem, size);
+	memset(h->items, 0, size * sizeof(ab_HashItem));
+	h->size = size;
+
+	for (i = 0; i < oldsize; i++) {
+		ab_HashItem *item = old + i;
+
+		if (item->key) {
+			uint32_t j = ab_hashSlot(h, item->hash, item->key,
+			                         item->len);
+			h->items[j] = *item;
+		}
+	}
+
+	if (old)
+		ea_freeArray(ab_HashItem, oldsize, old);
+}
+
+
+ab_Hash* ab_hashNew()
+{
+	ab_Hash *h = ea_alloc(ab_Hash);
+
+	h->items = NULL;
+	h->size = 0;
+	h->count = 0;
+
+	ab_hashResize(h, AB_HASH_MINSIZE);
+
+	return h;
+}
+
+
+void ab_hashFree(ab_Hash *h)
+{
+	uint32_t pos = 0;
+
+	while (ab_hashFreeStep(h, &pos, h->size));
+}
+
+
+/*
+ * Free a table in slices: free the keys of at most `n` slots from `*pos`
+ * (0 for the first call) and return true, or free the table and return
+ * false when every slot is done.
+ */
+int ab_hashFreeStep(ab_Hash *h, uint32_t *pos, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = *pos; (i < h->size) && (i - *pos < n); i++) {
+		ab_HashItem *item = h->items + i;
+
+		if (item->key)
+			ea_freeMem(item->len + 1, item->key);
+	}
+
+	*pos = i;
+
+	if (i < h->size)
+		return true;
+
+	ea_freeArray(ab_HashItem, h->size, h->items);
+	ea_free(ab_Hash, h);
+
+	return false;
+}
+
+
+/* the value slot of `key` or NULL if the key is not in the table */
+void** ab_hashGet(ab_Hash *h, const char *key, int len)
+{
+	uint64_t hash = ab_hashKey(key, len);
+	ab_HashItem *item = h->items + ab_hashSlot(h, hash, key, len);
+
+	return (item->key) ? &item->value : NULL;
+}
+
+
+/* add `key` or replace its value */
+void ab_hashPut(ab_Hash *h, const char *key, int len, void *value)
+{
+	uint64_t hash = ab_hashKey(key, len);
+	ab_HashItem *item;
+
+	/* keep load factor <= 3/4 */
+	if ((h->count + 1) * 4 > h->size * 3)
+		ab_hashResize(h, h->size * 2);
+
+	item = h->items + ab_hashSlot(h, hash, key, len);
+
+	if (!item->key) {
+		item->hash = hash;
+		item->key = ea_allocMem(len + 1);
+		item->len = len;
+		memcpy(item->key, key, len);
+		h->count++;
+	}
+
+	item->value = value;
+}
+
+
+/*
+ * Remove `key` (return false if it's not in the table). The items that
+ * follow are shifted back so lookups never need tombstones.
+ */
+int ab_hashDel(ab_Hash *h, const char *key, int len)
+{
+	uint64_t hash = ab_hashKey(key, len);
+	uint32_t mask = h->size - 1;
+	uint32_t i = ab_hashSlot(h, hash, key, len);
+	uint32_t j;
+
+	if (!h->items[i].key)
+		return false;
+
+	ea_freeMem(h->items[i].len + 1, h->items[i].key);
+	h->count--;
+
+	for (j = (i + 1) & mask; h->items[j].key; j = (j + 1) & mask) {
+		uint32_t home = h->items[j].hash & mask;
+
+		/* the item can't move before its home slot */
+		if (((j > i) && ((home <= i) || (home > j))) ||
+		    ((j < i) && ((home <= i) && (home > j)))) {
+			h->items[i] = h->items[j];
+			i = j;
+		}
+	}
+
+	h->items[i].key = NULL;
+
+	return true;
+}
@@ -0,0 +1,62 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Fabio Sassi <fabio dot s81 at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __ABHASH_H__
+#define __ABHASH_H__
+
+#include <stdint.h>
+#include "ea.h"
+
+
+/*
+ * Exact match index: open addressing hash table (linear probing) from a
+ * key to a value. The table own a copy of every key.
+ */
+
+typedef struct {
+	uint64_t hash;
+	/* NULL = empty slot */
+	char *key;
+	int len;
+	void *value;
+} ab_HashItem;
+
+
+typedef struct {
+	ab_HashItem *items;
+	/* size is a power of 2 */
+	uint32_t size;
+	uint32_t count;
+} ab_Hash;
+
+
+ab_Hash* ab_hashNew();
+void ab_hashFree(ab_Hash *h);
+int ab_hashFreeStep(ab_Hash *h, uint32_t *pos, uint32_t n);
+
+void** ab_hashGet(ab_Hash *h, const char *key, int len);
+void ab_hashPut(ab_Hash *h, const char *key, int len, void *value);
+int ab_hashDel(ab_Hash *h, const char *key, int len);
+
+
+#endif
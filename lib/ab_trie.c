@@ -25,9 +25,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ab_trie.h"
 
+#if AB_SIMD >= 2
+	#include <immintrin.h>
+#elif AB_SIMD >= 1
+	#include <emmintrin.h>
+#endif
+
+
+#if defined(__GNUC__)
+	#define AB_PREFETCH(p) __builtin_prefetch(p)
+#else
+	#define AB_PREFETCH(p) ((void)(p))
+#endif
+
 
 #define ab_kind(w) ab_getKind((w), __LINE__)
 
@@ -49,1885 +67,4369 @@ static int ab_getKind(ab_Wood *w, int line)
 }
 
 
-static int ab_nodeFrom(ab_Node *node)
-{
-	assert(node->size > 0);
-	return node->items[0].letter;
-}
+/*
+ *     NODE KINDS  #SECTION
+ */
+
 
-static int ab_nodeTo(ab_Node *node)
+static int ab_nodeCapacity(int kind)
 {
-	assert(node->size > 0);
-	return node->items[0].letter + node->size - 1;
+	switch(kind) {
+	case AB_NODE4: return 4;
+	case AB_NODE16: return 16;
+	case AB_NODE48: return 48;
+	case AB_NODE256: return 256;
+	}
+
+	ea_fatal("ab_nodeCapacity: unexpected node kind %d", kind);
+	return 0;
 }
 
-static ab_NodeItem* ab_nodeGet(ab_Node *node, int c)
+
+static size_t ab_nodeBytes(int kind)
 {
-	int i, from;
+	switch(kind) {
+	case AB_NODE4: return sizeof(ab_Node4);
+	case AB_NODE16: return sizeof(ab_Node16);
+	case AB_NODE48: return sizeof(ab_Node48);
+	case AB_NODE256: return sizeof(ab_Node256);
+	}
 
-	if (!node->items)
-		return NULL;
+	ea_fatal("ab_nodeBytes: unexpected node kind %d", kind);
+	return 0;
+}
 
-	from = ab_nodeFrom(node);
 
-	if (c < from)
-		return NULL;
+static uint8_t* ab_nodeFlags(ab_Node *node)
+{
+	switch(node->kind) {
+	case AB_NODE4: return ((ab_Node4*)node)->flags;
+	case AB_NODE16: return ((ab_Node16*)node)->flags;
+	case AB_NODE48: return ((ab_Node48*)node)->flags;
+	case AB_NODE256: return ((ab_Node256*)node)->flags;
+	case AB_NODEF: return ((ab_NodeF*)node)->keys + node->size;
+	}
 
-	i = c - from;
+	ea_fatal("ab_nodeFlags: unexpected node kind %d", node->kind);
+	return NULL;
+}
 
-	if (i >= node->size)
-		return NULL;
 
-	return node->items + i;
+static ab_NodeItem* ab_nodeItems(ab_Node *node)
+{
+	switch(node->kind) {
+	case AB_NODE4: return ((ab_Node4*)node)->items;
+	case AB_NODE16: return ((ab_Node16*)node)->items;
+	case AB_NODE48: return ((ab_Node48*)node)->items;
+	case AB_NODE256: return ((ab_Node256*)node)->items;
+	}
+
+	ea_fatal("ab_nodeItems: unexpected node kind %d", node->kind);
+	return NULL;
 }
 
 
-static const char* ab_kindName(ab_Wood *w)
+/* letters of items (there is no `keys` in AB_NODE256: slot = letter) */
+static uint8_t* ab_nodeKeys(ab_Node *node)
 {
-	switch(ab_kind(w)) {
-	case AB_NODE: return   "NODE";
-	case AB_BRANCH: return "BRANCH";
+	switch(node->kind) {
+	case AB_NODE4: return ((ab_Node4*)node)->keys;
+	case AB_NODE16: return ((ab_Node16*)node)->keys;
+	case AB_NODE48: return ((ab_Node48*)node)->keys;
+	case AB_NODEF: return ((ab_NodeF*)node)->keys;
 	}
-	return "WOOD????";
+
+	return NULL;
 }
 
 
+/* sub offsets of a frozen node (value offsets follow) */
+static uint32_t* ab_nodeRefs(ab_Node *node)
+{
+	size_t off = sizeof(ab_Node) + 2 * node->size;
+
+	return (uint32_t*)((char*)node + ((off + 3) & ~(size_t)3));
+}
 
-#define AB_CASE(f) case f: return #f
 
-static const char *ab_loStatusName(int status)
+/* snapshot offsets (8 bytes units) are relative to the referencing wood */
+static ab_Wood* ab_refWood(void *from, uint32_t ref)
 {
-	switch(status) {
-	AB_CASE(AB_LKUP_INIT);
-	AB_CASE(AB_LKUP_UNSYNC);
-	AB_CASE(AB_LKUP_EMPTY);
-	AB_CASE(AB_LKUP_FOUND);
-	AB_CASE(AB_LKUP_NOVAL);
-	AB_CASE(AB_LKUP_BRANCH_OVER);
-	AB_CASE(AB_LKUP_BRANCH_INTO);
-	AB_CASE(AB_LKUP_BRANCH_DIFF);
-	AB_CASE(AB_LKUP_NODE_NOITEM);
-	AB_CASE(AB_LKUP_NODE_NOSUB);
-	default:
-		return "AB_LKUP_STATUS???";
-	}
+	return (ref) ? (ab_Wood*)((char*)from + (size_t)ref * 8) : NULL;
 }
 
-#undef AB_CASE
 
+static void* ab_refValue(void *from, uint32_t ref)
+{
+	if (!ref)
+		return NULL;
 
-/*
- *     DEBUG PRINT  #SECTION
- */
+	return (void*)((uintptr_t)((char*)from + (size_t)ref * 8) | AB_SNAP_TAG);
+}
 
 
-static void ab_printIndent(int indent)
+static ab_Wood* ab_nodeSub(ab_Node *node, int slot)
 {
-	while(indent-- > 0)
-		printf(" ");
+	if (node->kind == AB_NODEF)
+		return ab_refWood(node, ab_nodeRefs(node)[slot]);
 
-	fflush(stdout);
+	return ab_nodeItems(node)[slot].sub;
 }
 
-static void ab_printNodeItem(ab_NodeItem *item, int indent)
+
+static void* ab_nodeValue(ab_Node *node, int slot)
 {
-	if (indent > 0)
-		ab_printIndent(indent);
+	if (node->kind == AB_NODEF)
+		return ab_refValue(node, ab_nodeRefs(node)[node->size + slot]);
 
-	printf("flag=");
+	return ab_nodeItems(node)[slot].value;
+}
 
-	if (item->flag == AB_ITEM_OFF)
-		printf("#OFF ");
 
-	if (item->flag & AB_ITEM_ON)
-		printf("#ON ");
+static int ab_nodeLetter(ab_Node *node, int slot)
+{
+	assert(slot >= 0);
 
-	if (item->flag & AB_ITEM_VAL)
-		printf("#V ");
+	if (node->kind == AB_NODE256)
+		return slot;
 
-	if (item->flag & AB_ITEM_SUB)
-		printf("#N ");
+	return ab_nodeKeys(node)[slot];
+}
 
-	if ((item->flag & AB_ITEM_MASK) != item->flag)
-		printf("??? ");
 
-	printf("l=`%c` ", item->letter);
-	printf("n=%d ", item->n);
-	printf("v=%d", item->v);
-	printf((indent >= 0) ? "\n" : " ");
+/* keys stored under a wood (0 for NULL) */
+static uint32_t ab_woodCount(ab_Wood *w)
+{
+	if (!w)
+		return 0;
+
+	if (ab_kind(w) == AB_NODE)
+		return ((ab_Node*)w)->count;
+
+	return ((ab_Branch*)w)->count;
 }
 
 
-static void ab_printBranch(ab_Branch *b, int indent, int recursive)
+static void ab_woodAddCount(ab_Wood *w, int delta)
 {
-	ab_printIndent(indent);
+	if (ab_kind(w) == AB_NODE)
+		((ab_Node*)w)->count += delta;
+	else
+		((ab_Branch*)w)->count += delta;
+}
 
-	printf("{branch@%zx ", (size_t)b);
 
+/* keys stored under a node item (its value included) */
+static uint32_t ab_itemCount(ab_Node *node, int slot)
+{
+	int flag = ab_nodeFlags(node)[slot];
+	uint32_t n = (flag & AB_ITEM_VAL) ? 1 : 0;
 
-	assert(b->flag & AB_BRANCH);
-	assert((b->flag & (AB_BRANCH | AB_BRANCH_VAL)) == b->flag);
+	if (flag & AB_ITEM_SUB)
+		n += ab_woodCount(ab_nodeSub(node, slot));
 
-	printf("'%.*s'", b->len, b->kdata);
+	return n;
+}
 
-#if 1
-	if (b->flag & AB_BRANCH_VAL)
-		printf(" #V");
-#else
-	if (b->flag & AB_BRANCH_VAL)
-		printf(" v='%s'", (char*)b->value);
-#endif
 
-	printf("}");
+static char* ab_branchKey(ab_Branch *b)
+{
+	if (b->flag & AB_FROZEN)
+		return ((ab_BranchF*)b)->key;
 
-	if (b->sub) {
-		if (recursive) {
-			printf(" ->\n");
-			ab_printWood((ab_Wood*)b->sub, indent + 2, recursive);
-		} else {
-			printf(" -> %s\n", ab_kindName(b->sub));
-		}
-	} else {
-		printf("\n");
-	}
+	return (b->len <= AB_BRANCH_INLINE) ? b->key.data : b->key.ptr;
 }
 
 
-static void ab_printNode(ab_Node *node, int indent, int recursive)
+static ab_Wood* ab_branchSub(ab_Branch *b)
 {
-	int i;
-	ab_printIndent(indent);
+	if (b->flag & AB_FROZEN)
+		return ab_refWood(b, ((ab_BranchF*)b)->sub);
 
-	printf("{node@%zx ", (size_t)node);
-	printf("%d-%d (s=%d) sn=%d sv=%d", ab_nodeFrom(node), ab_nodeTo(node),
-	       node->size, node->nsize, node->vsize);
-	printf("}\n");
-
-	for (i = 0; i < node->size; i++) {
-		ab_NodeItem *item = node->items + i;
-		char c = (char)(ab_nodeFrom(node) + i);
+	return b->sub;
+}
 
-#if 0
-		/* print only active items */
-		if ((item->flag & AB_ITEM_ON) == 0)
-			continue;
-#endif
 
-		ab_printIndent(indent + 2);
+static void* ab_branchValue(ab_Branch *b)
+{
+	if (b->flag & AB_FROZEN)
+		return ab_refValue(b, ((ab_BranchF*)b)->value);
 
-		if (c >= 32 && c <= 126)
-			printf("[%c] ", c);
-		else
-			printf("[ 0x%.2X ] ", (unsigned)c);
+	return b->value;
+}
 
-		ab_printNodeItem(item, -1);
 
-		if (item->flag & AB_ITEM_VAL) {
-			assert(item->v < node->vsize);
-			printf("value = %s", (char*)node->values[item->v]);
-		}
+/*
+ *     SCAN KERNELS  #SECTION
+ *
+ * A node is scanned through its 256 byte arrays (AB_NODE48 index,
+ * AB_NODE256 flags) or its 16 sorted keys (AB_NODE16). With AB_SIMD
+ * these arrays are compared by chunks of 16 (SSE2) or 32 (AVX2) bytes
+ * and the result is reduced to a bitmask of live letters.
+ */
 
-		if (item->flag & AB_ITEM_SUB) {
-			assert(item->n < node->nsize);
-			ab_Wood *sub = node->subs[item->n];
 
-			assert(sub);
-			if (recursive) {
-				printf("\n");
-				ab_printWood(sub, indent + 4, true);
-			} else {
-				printf("-> %s\n", ab_kindName(sub));
-			}
-		} else {
-			printf("\n");
-		}
+static int ab_ctz64(uint64_t x)
+{
+	assert(x);
 
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	int n = 0;
 
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
 	}
+
+	return n;
+#endif
 }
 
-static void ab_printCursor(ab_Cursor *c, int indent)
-{
-	assert(c->wood);
 
-	ab_printIndent(indent);
-	printf("cursor.w : \n");
-	ab_printWood(c->wood, indent+2, false);
+/* write the letters of a 256 bitmap in `out` (sorted) and return count */
+static int ab_mapLetters(const uint64_t *map, uint8_t *out)
+{
+	int w, n = 0;
 
-	ab_printIndent(indent);
-	printf("cursor.at: ");
+	for (w = 0; w < 4; w++) {
+		uint64_t m = map[w];
 
-	switch(ab_kind(c->wood)) {
+		while (m) {
+			out[n++] = w * 64 + ab_ctz64(m);
+			m &= m - 1;
+		}
+	}
 
-	case AB_NODE:
-		if (c->at.item)
-			ab_printNodeItem(c->at.item, indent+2);
-		else
-			printf("NULL");
+	return n;
+}
 
-		break;
 
-	case AB_BRANCH:
-			printf("%d", c->at.brpos);
-		break;
+/*
+ * Length of the common prefix of `a` and `b` (at most `n` bytes),
+ * compared 8 bytes at a time.
+ */
+static int ab_matchLen(const char *a, const char *b, int n)
+{
+	int i = 0;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	for (; i + 8 <= n; i += 8) {
+		uint64_t x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y)
+			return i + ab_ctz64(x ^ y) / 8;
 	}
+#endif
 
-	printf("\n");
+	while (i < n && a[i] == b[i])
+		i++;
+
+	return i;
 }
 
 
-static void ab_printBranchKey(ab_Branch *b, int indent)
+#if AB_SIMD
+
+#if AB_SIMD >= 2
+	#define AB_CHUNK 32
+#else
+	#define AB_CHUNK 16
+#endif
+
+
+static int ab_msb32(uint32_t x)
 {
-	int i;
-	ab_printIndent(indent);
+	assert(x);
 
-	for (i = 0; i < b->len; i++)
-		printf("%c", b->kdata[i]);
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(x);
+#else
+	int n = 31;
 
-	printf((b->flag & AB_BRANCH_VAL) ? "$\n" : "\n");
+	while (!(x & 0x80000000u)) {
+		x <<= 1;
+		n--;
+	}
 
-	if (b->sub)
-		ab_printKeys(b->sub, indent + b->len);
+	return n;
+#endif
 }
 
 
-
-static void ab_printNodeKeys(ab_Node *node, int indent)
+/* bit i is set if a[i] != 0 (for i in 0..AB_CHUNK-1) */
+static uint32_t ab_chunkMask(const uint8_t *a)
 {
-	int i;
+#if AB_SIMD >= 2
+	__m256i v = _mm256_loadu_si256((const __m256i*)a);
+	__m256i z = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
 
-	for (i = 0; i < node->size; i++) {
-		ab_NodeItem *item = node->items + i;
+	return ~(uint32_t)_mm256_movemask_epi8(z);
+#else
+	__m128i v = _mm_loadu_si128((const __m128i*)a);
+	__m128i z = _mm_cmpeq_epi8(v, _mm_setzero_si128());
 
-		if (item->flag & AB_ITEM_ON) {
+	return ~(uint32_t)_mm_movemask_epi8(z) & 0xFFFF;
+#endif
+}
 
-			ab_printIndent(indent);
 
-			if (item->flag & AB_ITEM_VAL)
-				printf("#%c$", item->letter);
-			else
-				printf("#%c ", item->letter);
+/* first index >= `from` of a non zero byte in a 256 byte array or -1 */
+static int ab_byteScan(const uint8_t *a, int from)
+{
+	int base = from & ~(AB_CHUNK - 1);
+	uint32_t m = ab_chunkMask(a + base) & (~0u << (from - base));
 
-			printf("\n");
+	while (!m) {
+		base += AB_CHUNK;
 
-			if (item->flag & AB_ITEM_SUB) {
-				ab_printKeys(node->subs[item->n], indent + 2);
-			}
-		}
+		if (base >= 256)
+			return -1;
+
+		m = ab_chunkMask(a + base);
 	}
+
+	return base + ab_ctz64(m);
 }
 
 
+/* last index <= `from` of a non zero byte in a 256 byte array or -1 */
+static int ab_byteScanBack(const uint8_t *a, int from)
+{
+	int base = from & ~(AB_CHUNK - 1);
+	/* keep bits 0..(from - base): (2 << 31) - 1 wrap to all bits */
+	uint32_t m = ab_chunkMask(a + base) & ((2u << (from - base)) - 1);
 
+	while (!m) {
+		base -= AB_CHUNK;
 
+		if (base < 0)
+			return -1;
 
-/*
- *     LOOKUP  #SECTION
- */
+		m = ab_chunkMask(a + base);
+	}
 
+	return base + ab_msb32(m);
+}
 
 
-static ab_Cursor *ab_loCurrent(ab_Look *lo)
+/* bitmap of non zero bytes in a 256 byte array */
+static void ab_byteMap(const uint8_t *a, uint64_t *map)
 {
-	return lo->path + lo->ipath;
+	int i;
+
+	map[0] = map[1] = map[2] = map[3] = 0;
+
+	for (i = 0; i < 256; i += AB_CHUNK)
+		map[i / 64] |= (uint64_t)ab_chunkMask(a + i) << (i % 64);
 }
 
 
-/*
- * push wood in search path (3 slot) stack (keep last three wood)
- * A . .  +B
- * A B .  +C
- * A B C  +D
- * B C D
- */
-static void ab_loStep(ab_Look *lo, ab_Wood *w)
+/* slot of `c` in the 16 sorted keys of an AB_NODE16 or -1 */
+static int ab_keyFind16(const uint8_t *keys, int size, int c)
 {
-	ab_Cursor *last;
-	AB_D printf("luNext - %zx ipath=%d\n", (size_t)w, lo->ipath);
-	AB_D ab_printWood(w, 4, false);
-	lo->bpos = 0;
+	__m128i v = _mm_loadu_si128((const __m128i*)keys);
+	__m128i x = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)c));
+	uint32_t m = _mm_movemask_epi8(x) & ((1u << size) - 1);
 
-	switch(lo->ipath) {
+	return (m) ? ab_ctz64(m) : -1;
+}
 
-	case 0:
-		lo->ipath = 1;
-		break;
+#else /* scalar */
 
-	case 1:
-		/*lo->path[0].wood = lo->path[1].wood;
-		lo->path[0].at.item = lo->path[1].at.item;*/
-		lo->ipath = 2;
-		break;
 
-	case 2:
-		lo->path[0].wood = lo->path[1].wood;
-		lo->path[0].at.item = lo->path[1].at.item;
-		lo->path[1].wood = lo->path[2].wood;
-		lo->path[1].at.item = lo->path[2].at.item;
-		break;
-	}
+static int ab_byteScan(const uint8_t *a, int from)
+{
+	for (; from < 256; from++)
+		if (a[from])
+			return from;
 
-	AB_D printf("luNext - ipath++ = %d\n", lo->ipath);
+	return -1;
+}
 
 
-	last = lo->path + lo->ipath;
-	last->wood = w;
-	last->at.item = NULL;
+static int ab_byteScanBack(const uint8_t *a, int from)
+{
+	for (; from >= 0; from--)
+		if (a[from])
+			return from;
 
+	return -1;
 }
 
 
-static int ab_loNode(ab_Look *lo)
+static void ab_byteMap(const uint8_t *a, uint64_t *map)
 {
-	ab_Cursor *current = ab_loCurrent(lo);
-	ab_Node *node = (ab_Node*)(current->wood);
-	ab_NodeItem *item = ab_nodeGet(node, lo->key[lo->ipos]);
+	int i;
 
-	current->at.item = item;
+	map[0] = map[1] = map[2] = map[3] = 0;
 
-	AB_D printf("lu-n: item%s exists\n", (item) ? "" : " don't");
+	for (i = 0; i < 256; i++)
+		if (a[i])
+			map[i / 64] |= (uint64_t)1 << (i % 64);
+}
 
-	AB_D if (item) ab_printNodeItem(item, 4);
 
-	if (!item) {
-		lo->status = AB_LKUP_NODE_NOITEM;
-		return false;
-	}
+static int ab_keyFind16(const uint8_t *keys, int size, int c)
+{
+	int i;
 
-	if (!(item->flag & AB_ITEM_ON)) {
-		lo->status = AB_LKUP_NODE_NOITEM;
-		return false;
+	for (i = 0; i < size; i++) {
+		if (keys[i] == c)
+			return i;
+
+		if (keys[i] > c)
+			break;
 	}
 
-	if (lo->ipos == lo->len - 1) {
-		if (item->flag & AB_ITEM_VAL)
-			lo->status = AB_LKUP_FOUND;
-		else
-			lo->status = AB_LKUP_NOVAL;
+	return -1;
+}
 
-		return false;
-	}
+#endif
 
-	if (item->flag & AB_ITEM_SUB) {
-		/* found - go on */
-		ab_loStep(lo, node->subs[item->n]);
-		return true;
 
-	} else {
-		lo->status = AB_LKUP_NODE_NOSUB;
-		return false;
-	}
-}
 
 
-static int ab_loBranch(ab_Look *lo)
+static int ab_indexSlot(ab_Node48 *node, int letter)
 {
-	ab_Cursor *current = ab_loCurrent(lo);
-	ab_Branch *b = (ab_Branch*)(current->wood);
+	return (letter == -1) ? -1 : node->index[letter] - 1;
+}
 
-	AB_D printf("lu-b: i=%d b=%d\n", lo->ipos, lo->bpos);
 
-	AB_D ab_printBranch(b, 4, true);
+/* first position of sorted `keys` with a letter >= c (size if none) */
+static int ab_keyLower(const uint8_t *keys, int size, int c)
+{
+	int lo = 0, hi = size;
 
-	if (lo->bpos >= b->len) {
-		AB_D printf("lu-b: no more char\n");
-		ab_Wood *next = b->sub;
-		/* one step over: ipos must be decremented to be a valid
-		   position inside this branch */
-		lo->ipos--;
-		if (!next) {
-			/*  branch = abc, lookup = abcdef */
-			lo->status = AB_LKUP_BRANCH_OVER;
-			return false;
-		}
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
 
-		ab_loStep(lo, next);
-		return true;
+		if (keys[mid] < c)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	AB_D printf("lu-b: d='%c' vs b='%c'\n",
-	            lo->key[lo->ipos],
-	            b->kdata[lo->bpos]);
-
-	if (lo->key[lo->ipos] != b->kdata[lo->bpos]) {
-		/*  branch = abcdef, data = abcxyz */
-		lo->status = AB_LKUP_BRANCH_DIFF;
-		AB_D printf("lu-b: different char\n");
-		return false;
-	}
+	return lo;
+}
 
-	if (lo->ipos == lo->len - 1) {
-		if (lo->bpos == (b->len - 1)) {
-			/*  branch = abc, data = abc */
-			if (b->flag & AB_BRANCH_VAL)
-				lo->status = AB_LKUP_FOUND;
-			else
-				lo->status = AB_LKUP_NOVAL;
-		} else {
-			/*  branch = abcdef, lookup = abc */
-			lo->status = AB_LKUP_BRANCH_INTO;
-		}
-		return false;
-	}
 
-	AB_D printf("lu-b: go on\n");
-	lo->bpos++;
+/* return the slot of letter `c` or -1 if the node has no item for it */
+static int ab_nodeGet(ab_Node *node, int c)
+{
+	c = (uint8_t)c;
 
-	return true;
+	switch(node->kind) {
 
-}
+	case AB_NODE4: {
+		uint8_t *keys = ((ab_Node4*)node)->keys;
+		int i;
 
+		for (i = 0; i < node->size; i++) {
+			if (keys[i] == c)
+				return i;
 
+			if (keys[i] > c)
+				break;
+		}
 
-/*
- *  INSTANCE WOOD #SECTION
- */
+		return -1;
+	}
 
-static ab_NodeItem *ab_nodeItemsNew(int size)
-{
-	ab_NodeItem *items = ea_allocArray(ab_NodeItem, size);
-	memset(items, 0, size*sizeof(ab_NodeItem));
+	case AB_NODE16:
+		return ab_keyFind16(((ab_Node16*)node)->keys, node->size, c);
 
-	return items;
-}
+	case AB_NODE48:
+		return ((ab_Node48*)node)->index[c] - 1;
 
+	case AB_NODE256:
+		return (((ab_Node256*)node)->flags[c]) ? c : -1;
 
-static ab_Node* ab_nodeNew(int size)
-{
-	ab_Node *result = ea_alloc(ab_Node);
-	result->flag = AB_NODE;
-	result->size = size;
-	result->nsize = 0;
-	result->vsize = 0;
-	result->subs = NULL;
-	result->values = NULL;
-	result->items = NULL;
+	case AB_NODEF: {
+		uint8_t *keys = ((ab_NodeF*)node)->keys;
+		int i = ab_keyLower(keys, node->size, c);
 
-	if (size)
-		result->items = ab_nodeItemsNew(size);
+		return (i < node->size && keys[i] == c) ? i : -1;
+	}
+	}
 
-	return result;
+	return -1;
 }
 
 
-static ab_Branch* ab_branchNew(char *src, int len)
+/* write the (sorted) letters of node items in `out` and return count */
+static int ab_nodeLetters(ab_Node *node, uint8_t *out)
 {
-	ab_Branch *result = ea_alloc(ab_Branch);
-	assert(len < (1 << 24));
+	uint64_t map[4];
 
-	result->flag = AB_BRANCH;
-	result->len = len;
-	result->kdata = ea_allocMem(len);
-	result->sub = NULL;
-	result->value = NULL;
+	switch(node->kind) {
 
-	memcpy(result->kdata, src, len);
+	case AB_NODE4:
+	case AB_NODE16:
+	case AB_NODEF:
+		memcpy(out, ab_nodeKeys(node), node->size);
+		return node->size;
 
-	AB_D {
-		printf("HERE - branchNew: ");
-		ab_printWood((ab_Wood*)result, 4, false);
+	case AB_NODE48:
+		ab_byteMap(((ab_Node48*)node)->index, map);
+		break;
+
+	case AB_NODE256:
+		ab_byteMap(((ab_Node256*)node)->flags, map);
+		break;
 	}
 
-	return result;
+	return ab_mapLetters(map, out);
 }
 
-static void ab_branchFree(ab_Branch* b)
+
+/* slot of the item with the lowest letter */
+static int ab_nodeFirst(ab_Node *node)
 {
-	AB_D {
-		printf("HERE - branchFree: ");
-		ab_printWood((ab_Wood*)b, 4, false);
-	}
+	switch(node->kind) {
 
-	b->sub = NULL;
-	b->value = NULL;
-	ea_freeMem(b->len, b->kdata);
-	ea_free(ab_Branch, b);
-}
+	case AB_NODE4:
+	case AB_NODE16:
+	case AB_NODEF:
+		return (node->size) ? 0 : -1;
 
-static void ab_nodeFree(ab_Node *node)
-{
-	assert(node->nsize == 0);
-	assert(node->vsize == 0);
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+		return ab_indexSlot(n48, ab_byteScan(n48->index, 0));
+	}
 
-	if (node->size)
-		ea_freeArray(ab_NodeItem, node->size, node->items);
+	case AB_NODE256:
+		return ab_byteScan(((ab_Node256*)node)->flags, 0);
+	}
 
-	ea_free(ab_Node, node);
+	return -1;
 }
 
 
+/* slot of the item with the highest letter */
+static int ab_nodeLast(ab_Node *node)
+{
+	switch(node->kind) {
 
+	case AB_NODE4:
+	case AB_NODE16:
+	case AB_NODEF:
+		return node->size - 1;
 
-/*
- *     ADD KEYS  #SECTION
- */
-
-static void* ab_nodeSetValue(ab_Node *node, ab_NodeItem *item, void *val)
-{
-	void *r = NULL;
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+		return ab_indexSlot(n48, ab_byteScanBack(n48->index, 255));
+	}
 
-	if (item->flag & AB_ITEM_VAL) {
-		r = node->values[item->v];
-		node->values[item->v] = val;
-	} else {
-		int last = node->vsize;
-		node->vsize++;
-		node->values = ea_resizeArray(void*, node->vsize, node->values);
-		node->values[last] = val;
-		item->flag |= AB_ITEM_VAL;
-		item->v = last;
+	case AB_NODE256:
+		return ab_byteScanBack(((ab_Node256*)node)->flags, 255);
 	}
 
-	return r;
+	return -1;
 }
 
 
-static void* ab_branchSetValue(ab_Branch *b, void *value)
+/* slot of the item that follow (in letter order) `slot` or -1 */
+static int ab_nodeNext(ab_Node *node, int slot)
 {
-	void *r = b->value;
-	b->flag |= AB_BRANCH_VAL;
-	b->value = value;
-	return r;
-}
+	int letter;
 
+	switch(node->kind) {
 
-static void ab_nodeGrow(ab_Node *node, int from, int to)
-{
-	int offset = ab_nodeFrom(node) - from;
-	int size0 = node->size;
-	ab_NodeItem *src = node->items;
+	case AB_NODE4:
+	case AB_NODE16:
+	case AB_NODEF:
+		return (slot + 1 < node->size) ? slot + 1 : -1;
 
-	node->size = to - from + 1;
-	AB_D printf("ab_nodeGrow: size from %d to %d\n", size0, node->size);
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+		letter = n48->keys[slot] + 1;
 
-	// TODO
-	// node->items = ab_nodeItemsNewFrom(node->size, src, offset, size0);
+		if (letter > 255)
+			return -1;
 
-	node->items = ab_nodeItemsNew(node->size);
-	memcpy(node->items + offset, src, size0 * sizeof(ab_NodeItem));
+		return ab_indexSlot(n48, ab_byteScan(n48->index, letter));
+	}
 
-	ea_freeArray(ab_NodeItem, size0, src);
-}
+	case AB_NODE256:
+		if (slot >= 255)
+			return -1;
 
+		return ab_byteScan(((ab_Node256*)node)->flags, slot + 1);
+	}
 
-static void ab_nodeAddSub(ab_Node *node, ab_Wood *sub, ab_NodeItem *item)
-{
-	int last = node->nsize;
-	node->nsize++;
-	node->subs = ea_resizeArray(ab_Wood*, node->nsize, node->subs);
-	node->subs[last] = sub;
-	item->flag |= AB_ITEM_SUB;
-	item->n = last;
+	return -1;
 }
 
 
-static void ab_setCurrentParent(ab_Look *lo, ab_Wood *w)
+/* slot of the first item with letter >= c (-1 if none) */
+static int ab_nodeFrom(ab_Node *node, int c)
 {
-	ab_Cursor *parent;
+	switch(node->kind) {
 
-	AB_D printf("setParent: ipath = %d\n", lo->ipath);
+	case AB_NODE4:
+	case AB_NODE16: {
+		uint8_t *keys = ab_nodeKeys(node);
+		int i;
 
-	if (lo->ipath == 0) {
-		lo->trie->root = w;
-		return;
-	}
+		for (i = 0; i < node->size; i++)
+			if (keys[i] >= c)
+				return i;
 
-	parent = lo->path + lo->ipath - 1;
+		return -1;
+	}
 
-	AB_D printf("parent: %zx\n", (size_t)parent->wood);
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+		return ab_indexSlot(n48, ab_byteScan(n48->index, c));
+	}
 
-	switch (ab_kind(parent->wood)) {
+	case AB_NODE256:
+		return ab_byteScan(((ab_Node256*)node)->flags, c);
 
-	case AB_NODE:
-		AB_D printf("setParent: node \n");
-		assert(parent->at.item);
-		((ab_Node*)parent->wood)->subs[parent->at.item->n] = w;
-		break;
+	case AB_NODEF: {
+		int i = ab_keyLower(((ab_NodeF*)node)->keys, node->size, c);
 
-	case AB_BRANCH:
-		AB_D printf("setParent: branch \n");
-		((ab_Branch*)parent->wood)->sub = w;
-		break;
+		return (i < node->size) ? i : -1;
 	}
+	}
+
+	return -1;
 }
 
 
-static void ab_addItem(ab_Node *node, int c, ab_Wood *sub, int haveval,
-                                                             void *val)
+static const char* ab_kindName(ab_Wood *w)
 {
-	ab_NodeItem *item;
-
-	AB_D printf("nodeIns: char=%d'%c' size0 = %d\n", c, c, node->size);
-
-	if (node->items == NULL) {
-		node->size = 1;
-		node->items = ab_nodeItemsNew(1);
-		item = node->items;
-	} else {
-		int from = ab_nodeFrom(node);
-		int to = ab_nodeTo(node);
-
-		AB_D printf("nodeIns: range0 %d'%c' - %d'%c'\n", from, from,
-		            to, to);
-
-		if (c < from) {
-			ab_nodeGrow(node, c, to);
-			from = c;
-		} else if (c > to) {
-			ab_nodeGrow(node, from, c);
-			to = c;
-		}
-
-		AB_D printf("nodeIns: range %d'%c' - %d'%c'\n", from, from,
-		            to, to);
-		item = node->items + (c - from);
+	switch(ab_kind(w)) {
+	case AB_NODE: return   "NODE";
+	case AB_BRANCH: return "BRANCH";
 	}
-	AB_D printf("nodeIns: size = %d\n", node->size);
-
-	item->flag = AB_ITEM_ON;
-	item->letter = c;
-
-	if (sub)
-		ab_nodeAddSub(node, sub, item);
-
-	if (haveval)
-		ab_nodeSetValue(node, item, val);
+	return "WOOD????";
 }
 
 
 
+#define AB_CASE(f) case f: return #f
 
-static ab_Branch *ab_branchCut(ab_Branch *src, int pos)
+static const char *ab_loStatusName(int status)
 {
-	ab_Branch *head, *tail;
-
-	assert(src->len > 0);
-	assert(pos > 0);
-	assert(pos <= src->len-1);
-
-	head = ab_branchNew(src->kdata, pos);
-	tail = ab_branchNew(src->kdata + pos, src->len - pos);
-	head->sub = tail;
-	tail->sub = src->sub;
-	ab_branchSetValue(tail, src->value);
-	tail->value =  src->value;
-
-	return head;
+	switch(status) {
+	AB_CASE(AB_LKUP_INIT);
+	AB_CASE(AB_LKUP_UNSYNC);
+	AB_CASE(AB_LKUP_EMPTY);
+	AB_CASE(AB_LKUP_FOUND);
+	AB_CASE(AB_LKUP_NOVAL);
+	AB_CASE(AB_LKUP_BRANCH_OVER);
+	AB_CASE(AB_LKUP_BRANCH_INTO);
+	AB_CASE(AB_LKUP_BRANCH_DIFF);
+	AB_CASE(AB_LKUP_NODE_NOITEM);
+	AB_CASE(AB_LKUP_NODE_NOSUB);
+	default:
+		return "AB_LKUP_STATUS???";
+	}
 }
 
+#undef AB_CASE
+
 
 /*
- * Split a branch in 2 or 3 woods and return the first.
- *
- * if pos = 0: the head doesn't exists, return an ab_Node linked
- * to tail branch:
- *
- * pos = 0: node{src[0]} -> tail{src[1:end]}
- *
- * if pos = end: the tail branch doesn't exists, return an ab_Branch head
- * linked to a terminal ab_Node
- *
- * pos = end: head{src[0:end-1]} -> node{src[end]}
- *
- * Otherwise return an head ab_Branch linked to an ab_Node
- * linked to tail ab_Branch:
- *
- * 0 < pos < end: head{src[0:pos-1]} -> node{src[pos]} -> tail{src[pos+1:end]}
+ *     DEBUG PRINT  #SECTION
  */
-static ab_Wood *ab_branchFork(ab_Branch *src, int pos, ab_Node **ins)
-{
-	ab_Node *node = ab_nodeNew(0);
-	ab_Branch *head = NULL;
-
-	assert(src->len > 0);
-	assert(pos <= src->len-1);
 
-	if (pos > 0) {
-		head = ab_branchNew(src->kdata, pos);
-		head->sub = node;
-	}
 
-	AB_D {
-		printf("branchFork: src=");
-		ab_printWood((ab_Wood*)src, 4, true);
-		printf("branchFork: pos=%d src.len=%d\n", pos, src->len);
-	}
+static void ab_printIndent(int indent)
+{
+	while(indent-- > 0)
+		printf(" ");
 
-	if (pos == src->len - 1) {
-		/* head -> node (or single node when len = 1)*/
-		int v = src->flag & AB_BRANCH_VAL;
+	fflush(stdout);
+}
 
-		AB_D printf("branchFork: head->sub\n");
+static void ab_printNodeItem(ab_Node *node, int slot, int indent)
+{
+	int flag = ab_nodeFlags(node)[slot];
 
-		ab_addItem(node, src->kdata[pos], src->sub, v, src->value);
+	if (indent > 0)
+		ab_printIndent(indent);
 
-		//ab_printWood((ab_Wood*)head, 4, true);
-	} else {
-		/* head -> node -> tail */
-		ab_Branch *tail;
+	printf("flag=");
 
-		AB_D printf("branchFork: head->sub->tail\n");
+	if (flag == AB_ITEM_OFF)
+		printf("#OFF ");
 
-		tail = ab_branchNew(src->kdata+pos+1, src->len-(pos+1));
+	if (flag & AB_ITEM_ON)
+		printf("#ON ");
 
-		ab_addItem(node, src->kdata[pos], (ab_Wood*)tail, false, NULL);
-		tail->sub = src->sub;
+	if (flag & AB_ITEM_VAL)
+		printf("#V ");
 
-		if (src->flag & AB_BRANCH_VAL)
-			ab_branchSetValue(tail, src->value);
-	}
+	if (flag & AB_ITEM_SUB)
+		printf("#N ");
 
-	*ins = node;
+	if ((flag & AB_ITEM_MASK) != flag)
+		printf("??? ");
 
-	return (head) ? ((ab_Wood*)head) : ((ab_Wood*)node);
+	printf("l=`%c` ", ab_nodeLetter(node, slot));
+	printf("slot=%d", slot);
+	printf((indent >= 0) ? "\n" : " ");
 }
 
 
-static void ab_addOnNode(ab_Look *lo, ab_Node *node, void *value)
+static void ab_printBranch(ab_Branch *b, int indent, int recursive)
 {
-	int c = lo->key[lo->ipos];
+	ab_printIndent(indent);
+
+	printf("{branch@%zx ", (size_t)b);
+
+
+	assert(b->flag & AB_BRANCH);
+	assert((b->flag & (AB_BRANCH | AB_BRANCH_VAL | AB_FROZEN)) == b->flag);
+
+	printf("'%.*s'", b->len, ab_branchKey(b));
+
+#if 1
+	if (b->flag & AB_BRANCH_VAL)
+		printf(" #V");
+#else
+	if (b->flag & AB_BRANCH_VAL)
+		printf(" v='%s'", (char*)ab_branchValue(b));
+#endif
+
+	printf("}");
+
+	if (ab_branchSub(b)) {
+		if (recursive) {
+			printf(" ->\n");
+			ab_printWood(ab_branchSub(b), indent + 2, recursive);
+		} else {
+			printf(" -> %s\n", ab_kindName(ab_branchSub(b)));
+		}
+	} else {
+		printf("\n");
+	}
+}
+
+
+static const char* ab_nodeKindName(ab_Node *node)
+{
+	switch(node->kind) {
+	case AB_NODE4: return "N4";
+	case AB_NODE16: return "N16";
+	case AB_NODE48: return "N48";
+	case AB_NODE256: return "N256";
+	case AB_NODEF: return "NF";
+	}
+	return "N????";
+}
+
+
+static void ab_printNode(ab_Node *node, int indent, int recursive)
+{
+	int i;
+	ab_printIndent(indent);
+
+	printf("{node@%zx ", (size_t)node);
+	printf("%s (s=%d)", ab_nodeKindName(node), node->size);
+	printf("}\n");
+
+	for (i = ab_nodeFirst(node); i != -1; i = ab_nodeNext(node, i)) {
+		int flag = ab_nodeFlags(node)[i];
+		int c = ab_nodeLetter(node, i);
+
+		ab_printIndent(indent + 2);
+
+		if (c >= 32 && c <= 126)
+			printf("[%c] ", c);
+		else
+			printf("[ 0x%.2X ] ", (unsigned)c);
+
+		ab_printNodeItem(node, i, -1);
+
+		if (flag & AB_ITEM_VAL)
+			printf("value = %s", (char*)ab_nodeValue(node, i));
+
+		if (flag & AB_ITEM_SUB) {
+			ab_Wood *sub = ab_nodeSub(node, i);
+
+			assert(sub);
+			if (recursive) {
+				printf("\n");
+				ab_printWood(sub, indent + 4, true);
+			} else {
+				printf("-> %s\n", ab_kindName(sub));
+			}
+		} else {
+			printf("\n");
+		}
+
+
+	}
+}
+
+static void ab_printCursor(ab_Cursor *c, int indent)
+{
+	assert(c->wood);
+
+	ab_printIndent(indent);
+	printf("cursor.w : \n");
+	ab_printWood(c->wood, indent+2, false);
+
+	ab_printIndent(indent);
+	printf("cursor.at: ");
+
+	switch(ab_kind(c->wood)) {
+
+	case AB_NODE:
+		if (c->at != -1)
+			ab_printNodeItem((ab_Node*)c->wood, c->at, indent+2);
+		else
+			printf("NULL");
+
+		break;
+
+	case AB_BRANCH:
+			printf("%d", c->at);
+		break;
+	}
+
+	printf("\n");
+}
+
+
+static void ab_printBranchKey(ab_Branch *b, int indent)
+{
+	int i;
+	ab_printIndent(indent);
+
+	for (i = 0; i < b->len; i++)
+		printf("%c", ab_branchKey(b)[i]);
+
+	printf((b->flag & AB_BRANCH_VAL) ? "$\n" : "\n");
+
+	if (ab_branchSub(b))
+		ab_printKeys(ab_branchSub(b), indent + b->len);
+}
+
+
+
+static void ab_printNodeKeys(ab_Node *node, int indent)
+{
+	int i;
+
+	for (i = ab_nodeFirst(node); i != -1; i = ab_nodeNext(node, i)) {
+		int flag = ab_nodeFlags(node)[i];
+		int c = ab_nodeLetter(node, i);
+
+		ab_printIndent(indent);
+
+		if (flag & AB_ITEM_VAL)
+			printf("#%c$", c);
+		else
+			printf("#%c ", c);
+
+		printf("\n");
+
+		if (flag & AB_ITEM_SUB)
+			ab_printKeys(ab_nodeSub(node, i), indent + 2);
+	}
+}
+
+
+
+
+
+/*
+ *     LOOKUP  #SECTION
+ */
+
+
+
+static ab_Cursor *ab_loCurrent(ab_Look *lo)
+{
+	return lo->path + lo->ipath;
+}
+
+
+/*
+ * push wood in search path (3 slot) stack (keep last three wood)
+ * A . .  +B
+ * A B .  +C
+ * A B C  +D
+ * B C D
+ */
+static void ab_loStep(ab_Look *lo, ab_Wood *w)
+{
+	ab_Cursor *last;
+	AB_D printf("luNext - %zx ipath=%d\n", (size_t)w, lo->ipath);
+	AB_D ab_printWood(w, 4, false);
+	lo->bpos = 0;
+
+	switch(lo->ipath) {
+
+	case 0:
+		lo->ipath = 1;
+		break;
+
+	case 1:
+		lo->ipath = 2;
+		break;
+
+	case 2:
+		lo->path[0] = lo->path[1];
+		lo->path[1] = lo->path[2];
+		break;
+	}
+
+	AB_D printf("luNext - ipath++ = %d\n", lo->ipath);
+
+
+	last = lo->path + lo->ipath;
+	last->wood = w;
+	last->at = -1;
+
+}
+
+
+static int ab_loNode(ab_Look *lo)
+{
+	ab_Cursor *current = ab_loCurrent(lo);
+	ab_Node *node = (ab_Node*)(current->wood);
+	int slot = ab_nodeGet(node, lo->key[lo->ipos]);
+	int flag;
+
+	current->at = slot;
+
+	AB_D printf("lu-n: item%s exists\n", (slot != -1) ? "" : " don't");
+
+	if (slot == -1) {
+		lo->status = AB_LKUP_NODE_NOITEM;
+		return false;
+	}
+
+	AB_D ab_printNodeItem(node, slot, 4);
+
+	flag = ab_nodeFlags(node)[slot];
+
+	if (lo->ipos == lo->len - 1) {
+		if (flag & AB_ITEM_VAL)
+			lo->status = AB_LKUP_FOUND;
+		else
+			lo->status = AB_LKUP_NOVAL;
+
+		return false;
+	}
+
+	if (flag & AB_ITEM_SUB) {
+		/* found - go on */
+		ab_loStep(lo, ab_nodeSub(node, slot));
+		return true;
+
+	} else {
+		lo->status = AB_LKUP_NODE_NOSUB;
+		return false;
+	}
+}
+
+
+static int ab_loBranch(ab_Look *lo)
+{
+	ab_Cursor *current = ab_loCurrent(lo);
+	ab_Branch *b = (ab_Branch*)(current->wood);
+	int n, match;
+
+	AB_D printf("lu-b: i=%d b=%d\n", lo->ipos, lo->bpos);
+
+	AB_D ab_printBranch(b, 4, true);
+
+	if (lo->bpos >= b->len) {
+		AB_D printf("lu-b: no more char\n");
+		ab_Wood *next = ab_branchSub(b);
+		/* one step over: ipos must be decremented to be a valid
+		   position inside this branch */
+		lo->ipos--;
+		if (!next) {
+			/*  branch = abc, lookup = abcdef */
+			lo->status = AB_LKUP_BRANCH_OVER;
+			return false;
+		}
+
+		ab_loStep(lo, next);
+		return true;
+	}
+
+	/* compare the rest of the branch with the rest of the key */
+	n = AB_MIN(b->len - lo->bpos, lo->len - lo->ipos);
+	match = ab_matchLen(lo->key + lo->ipos, ab_branchKey(b) + lo->bpos, n);
+
+	AB_D printf("lu-b: matched %d of %d chars\n", match, n);
+
+	if (match < n) {
+		/*  branch = abcdef, data = abcxyz */
+		lo->ipos += match;
+		lo->bpos += match;
+		lo->status = AB_LKUP_BRANCH_DIFF;
+		AB_D printf("lu-b: different char\n");
+		return false;
+	}
+
+	/* stand on the last matched char */
+	lo->ipos += n - 1;
+	lo->bpos += n - 1;
+
+	if (lo->ipos == lo->len - 1) {
+		if (lo->bpos == (b->len - 1)) {
+			/*  branch = abc, data = abc */
+			if (b->flag & AB_BRANCH_VAL)
+				lo->status = AB_LKUP_FOUND;
+			else
+				lo->status = AB_LKUP_NOVAL;
+		} else {
+			/*  branch = abcdef, lookup = abc */
+			lo->status = AB_LKUP_BRANCH_INTO;
+		}
+		return false;
+	}
+
+	AB_D printf("lu-b: go on\n");
+	lo->bpos++;
+
+	return true;
+
+}
+
+
+
+/*
+ *  INSTANCE WOOD #SECTION
+ */
+
+static ab_Node* ab_nodeNew(int kind)
+{
+	ab_Node *result = ea_allocMem(ab_nodeBytes(kind));
+
+	/* an empty node have all flags (and AB_NODE48 index) to 0 */
+	memset(result, 0, ab_nodeBytes(kind));
+
+	result->flag = AB_NODE;
+	result->kind = kind;
+	result->size = 0;
+
+	return result;
+}
+
+
+static ab_Branch* ab_branchNew(char *src, int len)
+{
+	ab_Branch *result = ea_alloc(ab_Branch);
+	assert(len < (1 << 24));
+
+	result->flag = AB_BRANCH;
+	result->len = len;
+	result->count = 0;
+	result->sub = NULL;
+	result->value = NULL;
+
+	if (len > AB_BRANCH_INLINE)
+		result->key.ptr = ea_allocMem(len);
+
+	memcpy(ab_branchKey(result), src, len);
+
+	AB_D {
+		printf("HERE - branchNew: ");
+		ab_printWood((ab_Wood*)result, 4, false);
+	}
+
+	return result;
+}
+
+/* append `len` chars to the branch key, moving it out of line if needed */
+static void ab_branchAppend(ab_Branch *b, char *src, int len)
+{
+	int total = b->len + len;
+	char *kdata = b->key.data;
+
+	assert(total < (1 << 24));
+
+	if (b->len > AB_BRANCH_INLINE) {
+		kdata = ea_reallocMem(b->key.ptr, b->len, total);
+	} else if (total > AB_BRANCH_INLINE) {
+		kdata = ea_allocMem(total);
+		memcpy(kdata, b->key.data, b->len);
+	}
+
+	if (total > AB_BRANCH_INLINE)
+		b->key.ptr = kdata;
+
+	memcpy(kdata + b->len, src, len);
+	b->len = total;
+}
+
+static void ab_branchFree(ab_Branch* b)
+{
+	AB_D {
+		printf("HERE - branchFree: ");
+		ab_printWood((ab_Wood*)b, 4, false);
+	}
+
+	b->sub = NULL;
+	b->value = NULL;
+	if (b->len > AB_BRANCH_INLINE)
+		ea_freeMem(b->len, b->key.ptr);
+	ea_free(ab_Branch, b);
+}
+
+static void ab_nodeFree(ab_Node *node)
+{
+	ea_freeMem(ab_nodeBytes(node->kind), node);
+}
+
+
+static void ab_woodFree(void *w)
+{
+	if (ab_kind((ab_Wood*)w) == AB_NODE)
+		ab_nodeFree((ab_Node*)w);
+	else
+		ab_branchFree((ab_Branch*)w);
+}
+
+
+/* free a wood that readers of a shared trie can still reach */
+static void ab_woodDrop(ab_Trie *trie, ab_Wood *w)
+{
+	ab_retire(trie, ab_woodFree, w);
+}
+
+
+/*
+ * Add an item for letter `c` (that must not exists) in a node with at
+ * least one free slot and return its slot.
+ */
+static int ab_nodePut(ab_Node *node, int c)
+{
+	uint8_t *flags = ab_nodeFlags(node);
+	ab_NodeItem *items = ab_nodeItems(node);
+	int i = 0;
+
+	c = (uint8_t)c;
+
+	assert(node->size < ab_nodeCapacity(node->kind));
+	assert(ab_nodeGet(node, c) == -1);
+
+	switch(node->kind) {
+
+	case AB_NODE4:
+	case AB_NODE16: {
+		/* keep letters sorted */
+		uint8_t *keys = ab_nodeKeys(node);
+		int n = node->size;
+
+		while ((i < n) && (keys[i] < c))
+			i++;
+
+		memmove(keys + i + 1, keys + i, n - i);
+		memmove(flags + i + 1, flags + i, n - i);
+		memmove(items + i + 1, items + i, (n - i) * sizeof(ab_NodeItem));
+
+		keys[i] = c;
+		break;
+	}
+
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+
+		/* first free slot */
+		while (flags[i])
+			i++;
+
+		n48->keys[i] = c;
+		n48->index[c] = i + 1;
+		break;
+	}
+
+	case AB_NODE256:
+		i = c;
+		break;
+	}
+
+	flags[i] = AB_ITEM_ON;
+	items[i].sub = NULL;
+	items[i].value = NULL;
+	node->size++;
+
+	return i;
+}
+
+
+/* remove the item at `slot` */
+static void ab_nodeCut(ab_Node *node, int slot)
+{
+	uint8_t *flags = ab_nodeFlags(node);
+	ab_NodeItem *items = ab_nodeItems(node);
+
+	assert(node->size > 0);
+
+	switch(node->kind) {
+
+	case AB_NODE4:
+	case AB_NODE16: {
+		uint8_t *keys = ab_nodeKeys(node);
+		int n = node->size - (slot + 1);
+
+		memmove(keys + slot, keys + slot + 1, n);
+		memmove(flags + slot, flags + slot + 1, n);
+		memmove(items + slot, items + slot + 1, n * sizeof(ab_NodeItem));
+		break;
+	}
+
+	case AB_NODE48: {
+		ab_Node48 *n48 = (ab_Node48*)node;
+		n48->index[n48->keys[slot]] = 0;
+		flags[slot] = AB_ITEM_OFF;
+		break;
+	}
+
+	case AB_NODE256:
+		flags[slot] = AB_ITEM_OFF;
+		break;
+	}
+
+	node->size--;
+}
+
+
+/* copy all items of `src` in a new node of kind `kind` and free `src` */
+static ab_Node* ab_nodeResize(ab_Node *src, int kind)
+{
+	ab_Node *dest = ab_nodeNew(kind);
+	uint8_t *flags = ab_nodeFlags(src);
+	ab_NodeItem *items = ab_nodeItems(src);
+	int i;
+
+	AB_D printf("ab_nodeResize: %s -> kind %d\n", ab_nodeKindName(src),
+	            kind);
+
+	assert(src->size <= ab_nodeCapacity(kind));
+
+	for (i = ab_nodeFirst(src); i != -1; i = ab_nodeNext(src, i)) {
+		int j = ab_nodePut(dest, ab_nodeLetter(src, i));
+
+		ab_nodeFlags(dest)[j] = flags[i];
+		ab_nodeItems(dest)[j] = items[i];
+	}
+
+	dest->count = src->count;
+
+	ab_nodeFree(src);
+
+	return dest;
+}
+
+
+/*
+ * Return a node of the smallest kind suitable for the items of `node`.
+ * A node is moved to a smaller kind only when it fill 3/4 of it, to avoid
+ * continuous resize on a set/del sequence at the kind boundary.
+ */
+static ab_Node* ab_nodeFit(ab_Node *node)
+{
+	int kind = node->kind;
+
+	if (kind == AB_NODE4)
+		return node;
+
+	if (node->size > ab_nodeCapacity(kind - 1) * 3 / 4)
+		return node;
+
+	return ab_nodeResize(node, kind - 1);
+}
+
+
+
+
+/*
+ *     ADD KEYS  #SECTION
+ */
+
+static void* ab_nodeSetValue(ab_Node *node, int slot, void *val)
+{
+	uint8_t *flag = ab_nodeFlags(node) + slot;
+	ab_NodeItem *item = ab_nodeItems(node) + slot;
+	void *r = (*flag & AB_ITEM_VAL) ? item->value : NULL;
+
+	*flag |= AB_ITEM_VAL;
+	item->value = val;
+
+	return r;
+}
+
+
+static void* ab_branchSetValue(ab_Branch *b, void *value)
+{
+	void *r = b->value;
+	b->flag |= AB_BRANCH_VAL;
+	b->value = value;
+	return r;
+}
+
+
+static void ab_nodeAddSub(ab_Node *node, int slot, ab_Wood *sub)
+{
+	ab_nodeFlags(node)[slot] |= AB_ITEM_SUB;
+	ab_nodeItems(node)[slot].sub = sub;
+}
+
+
+static void ab_setCurrentParent(ab_Look *lo, ab_Wood *w)
+{
+	ab_Cursor *parent;
+
+	AB_D printf("setParent: ipath = %d\n", lo->ipath);
+
+	if (lo->ipath == 0) {
+		lo->trie->root = w;
+		return;
+	}
+
+	parent = lo->path + lo->ipath - 1;
+
+	AB_D printf("parent: %zx\n", (size_t)parent->wood);
+
+	switch (ab_kind(parent->wood)) {
+
+	case AB_NODE:
+		AB_D printf("setParent: node \n");
+		assert(parent->at != -1);
+		ab_nodeItems((ab_Node*)parent->wood)[parent->at].sub = w;
+		break;
+
+	case AB_BRANCH:
+		AB_D printf("setParent: branch \n");
+		((ab_Branch*)parent->wood)->sub = w;
+		break;
+	}
+}
+
+
+/*
+ * Add an item for letter `c` to `node` and return the node: when `node`
+ * is full it's replaced (and freed) by a node of a bigger kind.
+ */
+static ab_Node* ab_addItem(ab_Node *node, int c, ab_Wood *sub, int haveval,
+                                                               void *val)
+{
+	int slot;
+
+	AB_D printf("nodeIns: char=%d'%c' size0 = %d\n", c, c, node->size);
+
+	if (node->size == ab_nodeCapacity(node->kind))
+		node = ab_nodeResize(node, node->kind + 1);
+
+	slot = ab_nodePut(node, c);
+
+	AB_D printf("nodeIns: size = %d\n", node->size);
+
+	if (sub)
+		ab_nodeAddSub(node, slot, sub);
+
+	if (haveval)
+		ab_nodeSetValue(node, slot, val);
+
+	return node;
+}
+
+
+
+
+static ab_Branch *ab_branchCut(ab_Branch *src, int pos)
+{
+	ab_Branch *head, *tail;
+
+	assert(src->len > 0);
+	assert(pos > 0);
+	assert(pos <= src->len-1);
+
+	head = ab_branchNew(ab_branchKey(src), pos);
+	tail = ab_branchNew(ab_branchKey(src) + pos, src->len - pos);
+	head->count = tail->count = src->count;
+	head->sub = tail;
+	tail->sub = src->sub;
+	if (src->flag & AB_BRANCH_VAL)
+		ab_branchSetValue(tail, src->value);
+
+	return head;
+}
+
+
+/*
+ * Split a branch in 2 or 3 woods and return the first.
+ *
+ * if pos = 0: the head doesn't exists, return an ab_Node linked
+ * to tail branch:
+ *
+ * pos = 0: node{src[0]} -> tail{src[1:end]}
+ *
+ * if pos = end: the tail branch doesn't exists, return an ab_Branch head
+ * linked to a terminal ab_Node
+ *
+ * pos = end: head{src[0:end-1]} -> node{src[end]}
+ *
+ * Otherwise return an head ab_Branch linked to an ab_Node
+ * linked to tail ab_Branch:
+ *
+ * 0 < pos < end: head{src[0:pos-1]} -> node{src[pos]} -> tail{src[pos+1:end]}
+ */
+static ab_Wood *ab_branchFork(ab_Branch *src, int pos, ab_Node **ins)
+{
+	ab_Node *node = ab_nodeNew(AB_NODE4);
+	ab_Branch *head = NULL;
+
+	assert(src->len > 0);
+	assert(pos <= src->len-1);
+
+	/* all keys under src stay under the new woods */
+	node->count = src->count;
+
+	if (pos > 0) {
+		head = ab_branchNew(ab_branchKey(src), pos);
+		head->count = src->count;
+	}
+
+	AB_D {
+		printf("branchFork: src=");
+		ab_printWood((ab_Wood*)src, 4, true);
+		printf("branchFork: pos=%d src.len=%d\n", pos, src->len);
+	}
+
+	if (pos == src->len - 1) {
+		/* head -> node (or single node when len = 1)*/
+		int v = src->flag & AB_BRANCH_VAL;
+
+		AB_D printf("branchFork: head->sub\n");
+
+		node = ab_addItem(node, ab_branchKey(src)[pos], src->sub, v,
+		                  src->value);
+
+		//ab_printWood((ab_Wood*)head, 4, true);
+	} else {
+		/* head -> node -> tail */
+		ab_Branch *tail;
+
+		AB_D printf("branchFork: head->sub->tail\n");
+
+		tail = ab_branchNew(ab_branchKey(src)+pos+1, src->len-(pos+1));
+		tail->count = src->count;
+
+		node = ab_addItem(node, ab_branchKey(src)[pos], (ab_Wood*)tail, false,
+		                  NULL);
+		tail->sub = src->sub;
+
+		if (src->flag & AB_BRANCH_VAL)
+			ab_branchSetValue(tail, src->value);
+	}
+
+	if (head)
+		head->sub = node;
+
+	*ins = node;
+
+	return (head) ? ((ab_Wood*)head) : ((ab_Wood*)node);
+}
+
+
+static void ab_addOnNode(ab_Look *lo, ab_Node *node, void *value)
+{
+	int c = lo->key[lo->ipos];
+	ab_Node *dest = node;
+
+	AB_D printf("nodeAdd '%c'\n", c);
+
+	assert(ab_kind((ab_Wood*)node) == AB_NODE);
+
+	if (lo->ipos < (lo->len - 1)) {
+		/* there are more than one letter => tail branch */
+		int off = lo->ipos+1;
+		ab_Branch *tail;
+		AB_D printf("nodeAdd node->suffix\n");
+		tail = ab_branchNew(lo->key + off, lo->len - off);
+
+		ab_branchSetValue(tail, value);
+		AB_D ab_printWood((ab_Wood*)tail, 4, true);
+
+		switch(lo->status) {
+
+		case AB_LKUP_NODE_NOITEM:
+			dest = ab_addItem(node, c, (ab_Wood*)tail, false, NULL);
+			break;
+
+		case AB_LKUP_NODE_NOSUB:
+			ab_nodeAddSub(node, ab_loCurrent(lo)->at, (ab_Wood*)tail);
+			break;
+
+		default:
+			ea_fatal("nodeAdd: (suf) unexpected status %d = %s",
+			         lo->status,
+			         ab_loStatusName(lo->status));
+		}
+	} else {
+		/* only one letter => add new item */
+		assert(lo->status == AB_LKUP_NODE_NOITEM);
+		dest = ab_addItem(node, c, NULL, true, value);
+	}
+
+	if (dest != node) {
+		/* node has been replaced by a bigger one: it can only be the
+		   current lookup wood (a forked node never grow) */
+		assert(ab_loCurrent(lo)->wood == (ab_Wood*)node);
+		ab_setCurrentParent(lo, (ab_Wood*)dest);
+	}
+}
+
+
+static void ab_addOnBranch(ab_Look *lo, void *value)
+{
+	ab_Cursor *last = ab_loCurrent(lo);
+	ab_Branch *b = (ab_Branch*)last->wood;
+
+	AB_D printf("branchAdd: i=%d b=%d\n", lo->ipos, lo->bpos);
+	AB_D printf("branchAdd: len=%d b.len=%d\n", lo->len, b->len);
+	assert(ab_kind((ab_Wood*)b) == AB_BRANCH);
+
+	switch(lo->status) {
+
+	case AB_LKUP_BRANCH_OVER: {
+		/* bpos over branch length: abc + abcdef */
+		int off = lo->ipos + 1;
+
+		AB_D printf("branchAdd: abc + abcdef\n");
+		ab_Branch *b2 = ab_branchNew(lo->key + off,
+		                             lo->len - off);
+		ab_branchSetValue(b2, value);
+		b->sub = b2;
+		return;
+	}
+
+	case AB_LKUP_BRANCH_INTO: {
+		/* abcdef + abc */
+		ab_Branch *head;
+		AB_D printf("branchAdd: abcdef + abc\n");
+		head = ab_branchCut(b, lo->bpos+1);
+		ab_setCurrentParent(lo, (ab_Wood*)head);
+		ab_branchSetValue(head, value);
+		break;
+	}
+
+	case AB_LKUP_BRANCH_DIFF: {
+		/* abcdef + abcxyz */
+		ab_Node *node;
+		ab_Wood *head;
+
+		AB_D printf("branchAdd: abcdef + abcxyz\n");
+		AB_D ab_printWood(last->wood, 4, true);
+
+		head = ab_branchFork(b, lo->bpos, &node);
+		ab_setCurrentParent(lo, head);
+
+		//ab_loCurrent(lo)->wood = head; TODO ??
+
+		/* overwrite lu status to node NOITEM because fork work
+		 * on two different char and other char doesn't exists
+		 * in node
+		 */
+		lo->status = AB_LKUP_NODE_NOITEM;
+		ab_addOnNode(lo, node, value);
+		break;
+	}
+
+	default:
+		ea_fatal("ab_addOnBranch: unexpected lo status %d = %s",
+		         lo->status, ab_loStatusName(lo->status));
+	}
+
+	/* the src branch can be free only after update parent to avoid
+	   leak reference (e.g. in lo->path) */
+	ab_branchFree(b);
+}
+
+
+static void ab_setValue(ab_Look *lo, void *value)
+{
+	ab_Cursor *f = ab_loCurrent(lo);
+
+	AB_D printf("setValue...\n");
+
+	switch(ab_kind(f->wood)) {
+
+	case AB_NODE:
+		ab_nodeSetValue((ab_Node*)f->wood, f->at, value);
+		break;
+
+	case AB_BRANCH:
+		ab_branchSetValue((ab_Branch*)f->wood, value);
+		break;
+
+	default:
+		ea_fatal("ab_setValue: unexpected kind");
+	}
+}
+
+
+//l+ampone
+static void ab_addOn(ab_Look *lo, void *value)
+{
+	ab_Cursor *last = ab_loCurrent(lo);
+
+	AB_D printf("addWood '%s' len=%d\n", lo->key, lo->len);
+
+	switch(ab_kind(last->wood)) {
+
+	case AB_NODE:
+		AB_D printf("addWood: on node\n");
+		ab_addOnNode(lo, (ab_Node*)last->wood, value);
+		break;
+
+	case AB_BRANCH:
+		AB_D printf("addWood: on branch\n");
+		ab_addOnBranch(lo, value);
+		break;
+	}
+}
+
+
+
+
+
+
+/*
+ *     REMOVE KEYS  #SECTION
+ */
+
+
+static void ab_branchDelValue(ab_Branch *b)
+{
+	b->flag = AB_BRANCH;
+	b->value = NULL;
+}
+
+static void ab_nodeDelSub(ab_Node *node, int slot)
+{
+	uint8_t *flag = ab_nodeFlags(node) + slot;
+
+	assert(*flag & AB_ITEM_ON);
+	assert(*flag & AB_ITEM_SUB);
+
+	AB_D printf("nodeDelSub...\n");
+
+	ab_nodeItems(node)[slot].sub = NULL;
+	*flag &= ~AB_ITEM_SUB;
+}
+
+
+static void ab_nodeDelVal(ab_Node *node, int slot)
+{
+	uint8_t *flag = ab_nodeFlags(node) + slot;
+
+	assert(*flag & AB_ITEM_ON);
+	assert(*flag & AB_ITEM_VAL);
+
+	AB_D printf("nodeDelVal...\n");
+
+	ab_nodeItems(node)[slot].value = NULL;
+	*flag &= ~AB_ITEM_VAL;
+}
+
+
+
+
+static int ab_mergeBranch(ab_Trie *trie, ab_Branch *b)
+{
+	ab_Branch *b2;
+
+	AB_D printf("mergeBranch...\n");
+
+	AB_D ab_printWood((ab_Wood*)b, 4, true);
+
+	if (!b->sub)
+		return false;
+
+	if (b->flag & AB_BRANCH_VAL)
+		return false;
+
+	if (ab_kind(b->sub) != AB_BRANCH)
+		return false;
+
+	b2 = (ab_Branch*)b->sub;
+
+	AB_D {
+		printf("mergeBranch...merging A+B\n");
+		printf("mergeBranch: A = ");
+		ab_printWood((ab_Wood*)b, 0, false);
+		printf("mergeBranch: B = ");
+		ab_printWood((ab_Wood*)b2, 0, true);
+	}
+
+
+	ab_branchAppend(b, ab_branchKey(b2), b2->len);
+
+	if (b2->flag & AB_BRANCH_VAL)
+		ab_branchSetValue(b, b2->value);
+	b->sub = b2->sub;
+
+	/* b2 is not in the lookup path: in a shared trie it's not a copy */
+	ab_woodDrop(trie, (ab_Wood*)b2);
+	return true;
+}
+
+
+
+
+
+static ab_Branch *ab_newBranchFrom(ab_Node *node)
+{
+	int slot = ab_nodeFirst(node);
+	int flag = ab_nodeFlags(node)[slot];
+	ab_NodeItem *item = ab_nodeItems(node) + slot;
+	char letter = ab_nodeLetter(node, slot);
+	ab_Branch *b;
+
+	assert(node->size == 1);
+
+	AB_D printf("node2branch...\n");
+
+	b = ab_branchNew(&letter, 1);
+	b->count = node->count;
+
+	if (flag & AB_ITEM_SUB)
+		b->sub = item->sub;
+
+	if (flag & AB_ITEM_VAL)
+		ab_branchSetValue(b, item->value);
+
+	return b;
+}
+
+
+static void ab_nodeToBranch(ab_Look *lo, ab_Node *node)
+{
+	ab_Branch *b = ab_newBranchFrom(node);
+
+	AB_D printf("node2branch: new (replace) branch\n");
+	AB_D ab_printBranch(b, 4, true);
+
+	ab_nodeFree(node);
+
+	ab_setCurrentParent(lo, (ab_Wood*)b);
+
+	if (lo->ipath > 0) {
+		ab_Cursor *parent = lo->path + lo->ipath - 1;
+
+		if (ab_kind(parent->wood) == AB_BRANCH) {
+			AB_D printf("nodeUpd: merge parent...\n");
+			if (ab_mergeBranch(lo->trie, (ab_Branch*)parent->wood)) {
+				AB_D printf("nodeUpd: parent merged\n");
+				b = (ab_Branch*)parent->wood;
+			}
+		}
+	}
+
+	if (!b->sub)
+		return;
+
+	AB_D printf("nodeUpd: merge sub\n");
+	ab_mergeBranch(lo->trie, b);
+}
+
+
+/*
+ * remove the current item (that have no value and no sub) from the current
+ * node: a node with a single item left become a branch otherwise it's
+ * fitted to the smallest node kind
+ */
+static void ab_nodeUpdateCurrent(ab_Look *lo)
+{
+	ab_Cursor *last = lo->path + lo->ipath;
+	ab_Node *fit, *node = (ab_Node*)last->wood;
+
+	assert(ab_nodeFlags(node)[last->at] == AB_ITEM_ON);
+
+	AB_D printf("nodeUpd: cut\n");
+	ab_nodeCut(node, last->at);
+	last->at = -1;
+
+	AB_D ab_printWood((ab_Wood*)node, 4, true);
+
+	if (node->size == 1) {
+		ab_nodeToBranch(lo, node);
+		return;
+	}
+
+	fit = ab_nodeFit(node);
+
+	if (fit != node) {
+		ab_setCurrentParent(lo, (ab_Wood*)fit);
+		last->wood = (ab_Wood*)fit;
+	}
+}
+
+static void ab_delFromNode(ab_Look *lo)
+{
+	ab_Cursor *last = lo->path + lo->ipath;
+	ab_Node *node = (ab_Node*)last->wood;
+
+	AB_D printf("delFromNode...\n");
+
+	AB_D ab_printWood((ab_Wood*)node, 4, true);
+	ab_nodeDelVal(node, last->at);
+	AB_D ab_printWood((ab_Wood*)node, 4, true);
+
+	if (ab_nodeFlags(node)[last->at] & AB_ITEM_SUB)
+		/* non terminal node */
+		return;
+
+	ab_nodeUpdateCurrent(lo);
+}
+
+
+static void ab_delFromBranch(ab_Look *lo)
+{
+	ab_Cursor *prev, *last = lo->path + lo->ipath;
+	ab_Branch *b = (ab_Branch*)last->wood;
+
+	AB_D printf("delFromBranch...\n");
+
+	if (b->sub) {
+		/* non-terminal branch */
+		AB_D printf("delFromBranch: inside\n");
+		ab_branchDelValue(b);
+		ab_mergeBranch(lo->trie, b);
+		return;
+	}
+
+	if (lo->ipath == 0) {
+	/* only one wood (branch) in trie - empties trie */
+		AB_D printf("delFromBranch: root-parent\n");
+		lo->trie->root = NULL;
+		ab_branchFree(b);
+		return;
+	}
+
+	/* terminal branch */
+	prev = lo->path + (--lo->ipath);
+
+	AB_D printf("delFromBranch: terminal branch\n");
+
+	switch(ab_kind(prev->wood)) {
+
+	case AB_NODE: {
+		ab_Node *node = (ab_Node*)prev->wood;
+
+		AB_D printf("delFromBranch: sub=node\n");
+		ab_nodeDelSub(node, prev->at);
+
+		if (ab_nodeFlags(node)[prev->at] & AB_ITEM_VAL)
+			break;
+
+		ab_nodeUpdateCurrent(lo);
+		break;
+	}
+
+	case AB_BRANCH:
+		AB_D printf("delFromBranch: sub=branch\n");
+		((ab_Branch*)(prev->wood))->sub = NULL;
+		break;
+
+	default:
+		ea_fatal("delFromBranch: unexpected kind");
+	}
+
+	ab_branchFree(b);
+}
+
+
+
+/*
+ *     SUBTREE COUNTS  #SECTION
+ *
+ * ab_set and ab_del keep the counts with one more walk from the root:
+ * an insertion add 1 to every wood on the key path after the key is in
+ * place, a removal subtract 1 before the key is removed. Woods created
+ * by a split or a merge take the count of the wood they replace.
+ */
+
+/* add `delta` to the count of every wood on the path of `key` */
+static void ab_countKey(ab_Trie *trie, char *key, int len, int delta)
+{
+	ab_Wood *w = trie->root;
+	int i = 0;
+
+	while (w) {
+		ab_woodAddCount(w, delta);
+
+		if (ab_kind(w) == AB_NODE) {
+			ab_Node *node = (ab_Node*)w;
+			int slot;
+
+			if (i == len - 1)
+				return;
+
+			slot = ab_nodeGet(node, key[i++]);
+			assert(slot != -1);
+
+			if (!(ab_nodeFlags(node)[slot] & AB_ITEM_SUB))
+				return;
+
+			w = ab_nodeSub(node, slot);
+		} else {
+			ab_Branch *b = (ab_Branch*)w;
+
+			i += b->len;
+
+			if (i >= len)
+				return;
+
+			w = ab_branchSub(b);
+		}
+	}
+}
+
+
+/* same as ab_countKey for the key reached by ab_first */
+static void ab_countEdge(ab_Trie *trie, int bottom, int delta)
+{
+	ab_Wood *w = trie->root;
+
+	while (w) {
+		ab_woodAddCount(w, delta);
+
+		if (ab_kind(w) == AB_NODE) {
+			ab_Node *node = (ab_Node*)w;
+			int slot = (bottom) ? ab_nodeLast(node) :
+			                      ab_nodeFirst(node);
+
+			if (!(ab_nodeFlags(node)[slot] & AB_ITEM_SUB))
+				return;
+
+			w = ab_nodeSub(node, slot);
+		} else {
+			w = ab_branchSub((ab_Branch*)w);
+		}
+	}
+}
+
+
+/*
+ * Locate the end of `prefix` (len > 0): a node item or a char inside a
+ * branch. Return false if no key start with `prefix`.
+ */
+static int ab_prefixCursor(ab_Trie *trie, char *prefix, int len,
+                           ab_Cursor *c)
+{
+	ab_Wood *w = trie->root;
+	int i = 0;
+
+	while (w) {
+		if (ab_kind(w) == AB_NODE) {
+			ab_Node *node = (ab_Node*)w;
+			int slot = ab_nodeGet(node, prefix[i]);
+
+			if (slot == -1)
+				return false;
+
+			c->wood = w;
+			c->at = slot;
+
+			if (++i == len)
+				return true;
+
+			if (!(ab_nodeFlags(node)[slot] & AB_ITEM_SUB))
+				return false;
+
+			w = ab_nodeSub(node, slot);
+		} else {
+			ab_Branch *b = (ab_Branch*)w;
+			int n = AB_MIN(b->len, len - i);
+
+			if (ab_matchLen(prefix + i, ab_branchKey(b), n) < n)
+				return false;
+
+			i += n;
+
+			if (i == len) {
+				c->wood = w;
+				c->at = n - 1;
+				return true;
+			}
+
+			w = ab_branchSub(b);
+		}
+	}
+
+	return false;
+}
+
+
+/* copy `n` chars at `pos` in a buffer of size `buflen` (truncate) */
+static int ab_keyPut(char *buf, int buflen, int pos, char *src, int n)
+{
+	if (pos < buflen)
+		memcpy(buf + pos, src, AB_MIN(n, buflen - pos));
+
+	return pos + n;
+}
+
+
+uint32_t ab_count(ab_Trie *trie)
+{
+	return ab_woodCount(trie->root);
+}
+
+
+/* number of keys starting with `prefix` */
+uint32_t ab_countPrefix(ab_Trie *trie, char *prefix, int len)
+{
+	ab_Cursor c;
+
+	if (len == 0)
+		return ab_count(trie);
+
+	if (!ab_prefixCursor(trie, prefix, len, &c))
+		return 0;
+
+	if (ab_kind(c.wood) == AB_NODE)
+		return ab_itemCount((ab_Node*)c.wood, c.at);
+
+	return ((ab_Branch*)c.wood)->count;
+}
+
+
+/* number of keys lower than `key` */
+uint32_t ab_rank(ab_Trie *trie, char *key, int len)
+{
+	ab_Wood *w = trie->root;
+	uint32_t r = 0;
+	int i = 0;
+
+	while (w && (i < len)) {
+		if (ab_kind(w) == AB_NODE) {
+			ab_Node *node = (ab_Node*)w;
+			int c = (uint8_t)key[i];
+			int slot = ab_nodeFirst(node);
+
+			while ((slot != -1) && (ab_nodeLetter(node, slot) < c)) {
+				r += ab_itemCount(node, slot);
+				slot = ab_nodeNext(node, slot);
+			}
+
+			if ((slot == -1) || (ab_nodeLetter(node, slot) != c))
+				return r;
+
+			if (++i == len)
+				return r;
+
+			if (ab_nodeFlags(node)[slot] & AB_ITEM_VAL)
+				r++;
+
+			w = (ab_nodeFlags(node)[slot] & AB_ITEM_SUB) ?
+			    ab_nodeSub(node, slot) : NULL;
+		} else {
+			ab_Branch *b = (ab_Branch*)w;
+			char *k = ab_branchKey(b);
+			int n = AB_MIN(b->len, len - i);
+			int m = ab_matchLen(key + i, k, n);
+
+			if (m < n) {
+				if ((uint8_t)k[m] < (uint8_t)key[i + m])
+					r += b->count;
+				return r;
+			}
+
+			i += n;
+
+			/* key end inside (or at the end of) the branch */
+			if (i == len)
+				return r;
+
+			if (b->flag & AB_BRANCH_VAL)
+				r++;
+
+			w = ab_branchSub(b);
+		}
+	}
+
+	return r;
+}
+
+
+/*
+ * Find the `n`-th (from 0) key starting with `prefix` in lexicographic
+ * order. The key is stored in `buf` (truncated to `buflen`) and its value
+ * in `value` (if not NULL).
+ *
+ * Return the key length or -1 if there are not enough keys.
+ */
+int ab_select(ab_Trie *trie, char *prefix, int plen, uint32_t n,
+              char *buf, int buflen, void **value)
+{
+	ab_Wood *w = trie->root;
+	ab_Cursor c;
+	int len;
+
+	if (n >= ab_countPrefix(trie, prefix, plen))
+		return -1;
+
+	len = ab_keyPut(buf, buflen, 0, prefix, plen);
+
+	if (plen > 0) {
+		ab_prefixCursor(trie, prefix, plen, &c);
+
+		if (ab_kind(c.wood) == AB_NODE) {
+			ab_Node *node = (ab_Node*)c.wood;
+			int flag = ab_nodeFlags(node)[c.at];
+
+			if (flag & AB_ITEM_VAL) {
+				if (n == 0) {
+					if (value)
+						*value = ab_nodeValue(node, c.at);
+					return len;
+				}
+				n--;
+			}
+
+			w = ab_nodeSub(node, c.at);
+		} else {
+			ab_Branch *b = (ab_Branch*)c.wood;
+
+			len = ab_keyPut(buf, buflen, len,
+			                ab_branchKey(b) + c.at + 1,
+			                b->len - (c.at + 1));
+
+			if (b->flag & AB_BRANCH_VAL) {
+				if (n == 0) {
+					if (value)
+						*value = ab_branchValue(b);
+					return len;
+				}
+				n--;
+			}
+
+			w = ab_branchSub(b);
+		}
+	}
+
+	for (;;) {
+		assert(w && (n < ab_woodCount(w)));
+
+		if (ab_kind(w) == AB_NODE) {
+			ab_Node *node = (ab_Node*)w;
+			int slot = ab_nodeFirst(node);
+			char letter;
+
+			while (n >= ab_itemCount(node, slot)) {
+				n -= ab_itemCount(node, slot);
+				slot = ab_nodeNext(node, slot);
+			}
+
+			letter = ab_nodeLetter(node, slot);
+			len = ab_keyPut(buf, buflen, len, &letter, 1);
+
+			if (ab_nodeFlags(node)[slot] & AB_ITEM_VAL) {
+				if (n == 0) {
+					if (value)
+						*value = ab_nodeValue(node, slot);
+					return len;
+				}
+				n--;
+			}
+
+			w = ab_nodeSub(node, slot);
+		} else {
+			ab_Branch *b = (ab_Branch*)w;
+
+			len = ab_keyPut(buf, buflen, len, ab_branchKey(b), b->len);
+
+			if (b->flag & AB_BRANCH_VAL) {
+				if (n == 0) {
+					if (value)
+						*value = ab_branchValue(b);
+					return len;
+				}
+				n--;
+			}
+
+			w = ab_branchSub(b);
+		}
+	}
+}
+
+
+
+/*
+ *     SHARED READERS  #SECTION
+ */
+
+/* retired entries freed together (amortize the readers scan) */
+#define AB_RECLAIM_BATCH 64
+
+
+static ab_Wood* ab_woodClone(ab_Wood *w)
+{
+	if (ab_kind(w) == AB_NODE) {
+		size_t n = ab_nodeBytes(((ab_Node*)w)->kind);
+		ab_Node *node = ea_allocMem(n);
+
+		memcpy(node, w, n);
+		return (ab_Wood*)node;
+
+	} else {
+		ab_Branch *src = (ab_Branch*)w;
+		ab_Branch *b = ea_alloc(ab_Branch);
+
+		*b = *src;
+
+		if (b->len > AB_BRANCH_INLINE) {
+			b->key.ptr = ea_allocMem(b->len);
+			memcpy(b->key.ptr, src->key.ptr, b->len);
+		}
+
+		return (ab_Wood*)b;
+	}
+}
+
+
+/*
+ * Replace every wood from the root to the last wood of the lookup with a
+ * private copy (the originals are retired), so that ab_set and ab_del can
+ * change them in place. `lo->path` is moved to the copies.
+ */
+static void ab_cowPath(ab_Look *lo)
+{
+	ab_Trie *trie = lo->trie;
+	ab_Wood *last = lo->path[lo->ipath].wood;
+	ab_Wood *w = trie->root, *parent = NULL;
+	int i = 0, slot = -1;
+
+	for (;;) {
+		ab_Wood *copy = ab_woodClone(w);
+		int j;
+
+		if (!parent)
+			trie->root = copy;
+		else if (ab_kind(parent) == AB_NODE)
+			ab_nodeItems((ab_Node*)parent)[slot].sub = copy;
+		else
+			((ab_Branch*)parent)->sub = copy;
+
+		for (j = 0; j <= lo->ipath; j++)
+			if (lo->path[j].wood == w)
+				lo->path[j].wood = copy;
+
+		ab_woodDrop(trie, w);
+
+		if (w == last)
+			return;
+
+		parent = copy;
+
+		if (ab_kind(copy) == AB_NODE) {
+			ab_Node *node = (ab_Node*)copy;
+
+			if (lo->edge == 2)
+				slot = ab_nodeLast(node);
+			else if (lo->edge)
+				slot = ab_nodeFirst(node);
+			else
+				slot = ab_nodeGet(node, lo->key[i++]);
+
+			assert(slot != -1);
+			w = ab_nodeItems(node)[slot].sub;
+		} else {
+			i += ((ab_Branch*)copy)->len;
+			w = ((ab_Branch*)copy)->sub;
+		}
+
+		assert(w);
+	}
+}
+
+
+/* make the writer root visible to readers that begin from now */
+static void ab_publish(ab_Trie *trie)
+{
+	ab_Shared *sh = trie->shared;
+
+	__atomic_store_n(&trie->pub, trie->root, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&sh->epoch, 1, __ATOMIC_SEQ_CST);
+
+	if (sh->len - sh->head >= AB_RECLAIM_BATCH)
+		ab_reclaim(trie);
+}
+
+
+/*
+ * Turn `trie` in a shared trie: from now ab_set and ab_del (called only
+ * by the writer thread) copy the woods they change. Call it before
+ * starting the readers.
+ */
+void ab_share(ab_Trie *trie)
+{
+	ab_Shared *sh;
+
+	if (trie->shared)
+		return;
+
+	if (ab_readOnly(trie))
+		ea_fatal("ab_share: read only trie");
+
+	sh = ea_alloc(ab_Shared);
+	memset(sh, 0, sizeof(ab_Shared));
+	sh->epoch = 1;
+
+	trie->pub = trie->root;
+	trie->shared = sh;
+}
+
+
+int ab_isShared(ab_Trie *trie)
+{
+	return trie->shared != NULL;
+}
+
+
+/* reserve a reader slot for the calling thread (-1 if all are used) */
+int ab_readerJoin(ab_Trie *trie)
+{
+	int i;
+
+	assert(trie->shared);
+
+	for (i = 0; i < AB_READERS; i++) {
+		ab_Reader *r = trie->shared->readers + i;
+
+		if (!__atomic_exchange_n(&r->used, 1, __ATOMIC_SEQ_CST))
+			return i;
+	}
+
+	return -1;
+}
+
+
+void ab_readerLeave(ab_Trie *trie, int id)
+{
+	ab_Reader *r = trie->shared->readers + id;
+
+	assert(r->epoch == 0);
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Begin a read section: `view` become a read only trie with the last
+ * published root. Use `view` (find, get, cursors, scan, counts) until
+ * ab_readEnd: the woods reached from it are not freed before.
+ */
+void ab_readBegin(ab_Trie *trie, int id, ab_Trie *view)
+{
+	ab_Shared *sh = trie->shared;
+
+	/* don't read trie->root: the writer can be changing it */
+	view->map = trie->map;
+	view->mapsize = trie->mapsize;
+	view->pub = NULL;
+	view->shared = NULL;
+	view->index = NULL;
+
+	if (!sh) {
+		view->root = trie->root;
+		return;
+	}
+
+	__atomic_store_n(&sh->readers[id].epoch,
+	                 __atomic_load_n(&sh->epoch, __ATOMIC_SEQ_CST),
+	                 __ATOMIC_SEQ_CST);
+
+	view->root = __atomic_load_n(&trie->pub, __ATOMIC_SEQ_CST);
+}
+
+
+void ab_readEnd(ab_Trie *trie, int id)
+{
+	if (trie->shared)
+		__atomic_store_n(&trie->shared->readers[id].epoch, 0,
+		                 __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Call `fn(ptr)` when no reader can reach `ptr` anymore (immediately if
+ * the trie is not shared). Only the writer can retire.
+ */
+void ab_retire(ab_Trie *trie, void (*fn)(void *ptr), void *ptr)
+{
+	ab_Shared *sh = trie->shared;
+	ab_Retired *r;
+
+	if (!sh) {
+		fn(ptr);
+		return;
+	}
+
+	if (sh->len == sh->size) {
+		if (sh->head > 0) {
+			sh->len -= sh->head;
+			memmove(sh->retired, sh->retired + sh->head,
+			        sh->len * sizeof(ab_Retired));
+			sh->head = 0;
+		} else {
+			int size = (sh->size) ? sh->size * 2 : 256;
+
+			sh->retired = ea_resizeArray(ab_Retired, sh->size, size,
+			                             sh->retired);
+			sh->size = size;
+		}
+	}
+
+	r = sh->retired + sh->len++;
+	r->epoch = sh->epoch;
+	r->fn = fn;
+	r->ptr = ptr;
+}
+
+
+/* true if a reader that begun before `epoch` is in its read section */
+static int ab_readersBefore(ab_Trie *trie, uint64_t epoch)
+{
+	ab_Shared *sh = trie->shared;
+	int i;
+
+	for (i = 0; i < AB_READERS; i++) {
+		uint64_t e = __atomic_load_n(&sh->readers[i].epoch,
+		                             __ATOMIC_SEQ_CST);
+		if (e && (e < epoch))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* free the retired memory that no reader can reach */
+void ab_reclaim(ab_Trie *trie)
+{
+	ab_Shared *sh = trie->shared;
+	uint64_t min = UINT64_MAX;
+	int i;
+
+	if (!sh)
+		return;
+
+	for (i = 0; i < AB_READERS; i++) {
+		uint64_t e = __atomic_load_n(&sh->readers[i].epoch,
+		                             __ATOMIC_SEQ_CST);
+		if (e && (e < min))
+			min = e;
+	}
+
+	while ((sh->head < sh->len) && (sh->retired[sh->head].epoch < min)) {
+		ab_Retired *r = sh->retired + sh->head++;
+		r->fn(r->ptr);
+	}
+
+	if (sh->head == sh->len)
+		sh->head = sh->len = 0;
+}
+
+
+
+/*
+ *     HASH INDEX  #SECTION
+ */
+
+/*
+ * Key of the first (last if `bottom`) element, for lookups done by
+ * ab_first (the caller free it with ea_freeMem).
+ */
+static char* ab_edgeKey(ab_Trie *trie, int bottom, int *len)
+{
+	char *key = NULL;
+	int pass, n = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+		ab_Wood *w = trie->root;
+
+		if (pass)
+			key = ea_allocMem(AB_MAX(n, 1));
+
+		n = 0;
+
+		while (w) {
+			if (ab_kind(w) == AB_NODE) {
+				ab_Node *node = (ab_Node*)w;
+				int slot = (bottom) ? ab_nodeLast(node) :
+				                      ab_nodeFirst(node);
+				if (pass)
+					key[n] = ab_nodeLetter(node, slot);
+				n++;
+
+				if (!(ab_nodeFlags(node)[slot] & AB_ITEM_SUB))
+					break;
+
+				w = ab_nodeSub(node, slot);
+			} else {
+				ab_Branch *b = (ab_Branch*)w;
+
+				if (pass)
+					memcpy(key + n, ab_branchKey(b), b->len);
+				n += b->len;
+
+				w = ab_branchSub(b);
+			}
+		}
+	}
+
+	*len = n;
+	return key;
+}
+
+
+/* update the index with the result of ab_set (or ab_del if !set) */
+static void ab_indexUpdate(ab_Look *lo, int set, void *value)
+{
+	ab_Hash *h = lo->trie->index;
+	char *key = lo->key;
+	int len = lo->len;
+
+	if (lo->edge)
+		key = ab_edgeKey(lo->trie, lo->edge == 2, &len);
+
+	if (set)
+		ab_hashPut(h, key, len, value);
+	else
+		ab_hashDel(h, key, len);
+
+	if (lo->edge)
+		ea_freeMem(AB_MAX(len, 1), key);
+}
+
+
+static int ab_indexAdd(void *data, char *key, int len, void *value)
+{
+	ab_hashPut((ab_Hash*)data, key, len, value);
+	return true;
+}
+
+
+/*
+ * Add an exact match index to the trie: from now ab_lookup find keys
+ * without walking the trie (ab_set, ab_del and bulk load keep it
+ * updated). Readers of a shared trie don't use it.
+ */
+void ab_indexOn(ab_Trie *trie)
+{
+	if (trie->index)
+		return;
+
+	trie->index = ab_hashNew();
+	ab_scan(trie, NULL, 0, false, ab_indexAdd, trie->index);
+}
+
+
+/* exact match: return true and set `value` if `key` is in the trie */
+int ab_lookup(ab_Trie *trie, char *key, int len, void **value)
+{
+	ab_Look lo;
+
+	if (trie->index) {
+		void **slot = ab_hashGet(trie->index, key, len);
+
+		if (slot && value)
+			*value = *slot;
+
+		return slot != NULL;
+	}
+
+	if (!ab_find(&lo, trie, key, len))
+		return false;
+
+	if (value)
+		*value = ab_get(&lo);
+
+	return true;
+}
+
+
+
+/* PUBLIC METHOD #SECTION */
+
+
+void ab_printWood(ab_Wood *w, int indent, int recursive)
+{
+	assert(w);
+	switch(ab_kind(w)) {
+
+	case AB_NODE:
+		ab_printNode((ab_Node*)w, indent, recursive);
+		break;
+
+	case AB_BRANCH:
+		ab_printBranch((ab_Branch*)w, indent, recursive);
+		break;
+	}
+}
+
+
+void ab_printKeys(ab_Wood *w, int indent)
+{
+	assert(w);
+	switch(ab_kind(w)) {
+
+	case AB_NODE:
+		ab_printNodeKeys((ab_Node*)w, indent);
+		break;
+
+	case AB_BRANCH:
+		ab_printBranchKey((ab_Branch*)w, indent);
+		break;
+	}
+}
+
+void ab_printSearch(ab_Look *lo)
+{
+	int i;
+
+	printf("{\n");
+
+	printf("  status: %s,\n", ab_loStatusName(lo->status));
+	printf("  bpos: %d,\n", lo->bpos);
+	printf("  ipos: %d,\n", lo->ipos);
+	printf("  ipath: %d,\n", lo->ipath);
+
+	for (i = 0; i <= lo->ipath; i++) {
+		ab_Cursor *w = lo->path + i;
+		printf("\n  path[%d/%d]: {\n", i+1, lo->ipath+1);
+		if (w->wood)
+			ab_printCursor(w, 2);
+		printf("  } \n");
+	}
+
+	printf("}\n");
+}
+
+
+ab_Trie* ab_new()
+{
+	ab_Trie *result = ea_alloc(ab_Trie);
+	result->root = NULL;
+	result->map = NULL;
+	result->mapsize = 0;
+	result->pub = NULL;
+	result->shared = NULL;
+	result->index = NULL;
+
+	return result;
+}
+
+void ab_free(ab_Trie* trie)
+{
+	assert(trie->map == NULL);
+	assert(trie->root == NULL);
+
+	if (trie->index)
+		ab_hashFree(trie->index);
+
+	if (trie->shared) {
+		ab_Shared *sh = trie->shared;
+		int i;
+
+		for (i = 0; i < AB_READERS; i++)
+			assert(sh->readers[i].epoch == 0);
+
+		for (i = sh->head; i < sh->len; i++)
+			sh->retired[i].fn(sh->retired[i].ptr);
+
+		ea_freeArray(ab_Retired, sh->size, sh->retired);
+		ea_free(ab_Shared, sh);
+	}
+
+	ea_free(ab_Trie, trie);
+}
+
+int ab_empty(ab_Trie *trie)
+{
+	return trie->root == NULL;
+}
+
+
+
+
+void ab_loSet(ab_Look *lo, ab_Trie *trie, char *key, int len)
+{
+	lo->trie = trie;
+	lo->key = key;
+	lo->len = len;
+	lo->ipos = 0;
+	lo->bpos = 0;
+	lo->ipath = 0;
+	lo->edge = 0;
+
+	lo->status = (ab_empty(trie)) ? AB_LKUP_EMPTY : AB_LKUP_INIT;
+
+	lo->path[0].wood = trie->root;
+	lo->path[0].at = -1;
+}
+
+
+
+int ab_loNext(ab_Look *lo)
+{
+	int again = false;
+
+	if (lo->status != AB_LKUP_INIT)
+		return false;
+
+	AB_D printf("lu key[%d/%d] = '%c'\n", lo->ipos,
+		   lo->len, lo->key[lo->ipos]);
+
+	//AB_D ab_printSearch(lo);
+
+	switch(ab_kind(ab_loCurrent(lo)->wood)) {
+
+	case AB_NODE:
+		again = ab_loNode(lo);
+		break;
+
+	case AB_BRANCH:
+		again = ab_loBranch(lo);
+		break;
+	}
+
+	if (again)
+		lo->ipos++;
+
+	AB_D printf("lu: lo %s\n", (again) ? "again..." : "STOP");
+
+	return again;
+}
+
+
+int ab_find(ab_Look *lo, ab_Trie *trie, char *key, int len)
+{
+	ab_loSet(lo, trie, key, len);
+
+	while (ab_loNext(lo)) {
+	}
+
+	return lo->status == AB_LKUP_FOUND;
+}
+
+
+int ab_found(ab_Look *lo)
+{
+	return lo->status == AB_LKUP_FOUND;
+}
+
+
+
+
+
+void *ab_get(ab_Look *lo)
+{
+	ab_Cursor *last = lo->path + lo->ipath;
+
+	if (lo->status != AB_LKUP_FOUND)
+		ea_fatal("ab_get: lookup status (%s) != AB_LKUP_FOUND",
+		         ab_loStatusName(lo->status));
+
+
+	switch(ab_kind(last->wood)) {
+
+	case AB_NODE: {
+		ab_Node *node = (ab_Node*)last->wood;
+
+		if (ab_nodeFlags(node)[last->at] & AB_ITEM_VAL)
+			return ab_nodeValue(node, last->at);
+
+		return NULL;
+	}
+
+	case AB_BRANCH:
+		return ab_branchValue((ab_Branch*)last->wood);
+
+	default:
+		ea_fatal("ab_get: unexpected kind");
+		return NULL;
+	}
+}
+
+
+void* ab_set(ab_Look *lo, void *val)
+{
+	void *r = NULL;
+
+	AB_D printf("ab_set...\n");
+	AB_D ab_printSearch(lo);
+
+	if (ab_readOnly(lo->trie))
+		ea_fatal("ab_set: read only trie");
+
+	if (lo->trie->shared && (lo->status != AB_LKUP_INIT) &&
+	    (lo->status != AB_LKUP_UNSYNC) && (lo->status != AB_LKUP_EMPTY))
+		ab_cowPath(lo);
+
+	switch(lo->status) {
+
+	case AB_LKUP_FOUND:
+		r = ab_get(lo);
+		ab_setValue(lo, val);
+		break;
+
+	case AB_LKUP_NOVAL:
+		ab_setValue(lo, val);
+		ab_countKey(lo->trie, lo->key, lo->len, +1);
+		break;
+
+	case AB_LKUP_BRANCH_OVER:
+	case AB_LKUP_BRANCH_INTO:
+	case AB_LKUP_BRANCH_DIFF:
+	case AB_LKUP_NODE_NOITEM:
+	case AB_LKUP_NODE_NOSUB:
+		ab_addOn(lo, val);
+		ab_countKey(lo->trie, lo->key, lo->len, +1);
+		break;
+
+	case AB_LKUP_EMPTY:
+		AB_D printf("ab_set: first\n");
+		ab_Branch *first = ab_branchNew(lo->key, lo->len);
+		ab_branchSetValue(first, val);
+		first->count = 1;
+		lo->trie->root = (ab_Wood*)first;
+		break;
+
+	case AB_LKUP_INIT:
+		ea_fatal("ab_set: lookup has been only initialized");
+		break;
+
+
+	case AB_LKUP_UNSYNC:
+		ea_fatal("ab_set: lookup out of sync");
+		break;
+
+	default:
+		ea_fatal("ab_set: unexpected lu status %d", lo->status);
+	}
 
-	AB_D printf("nodeAdd '%c'\n", c);
+	if (lo->trie->index)
+		ab_indexUpdate(lo, true, val);
 
-	assert(ab_kind((ab_Wood*)node) == AB_NODE);
+	if (lo->trie->shared)
+		ab_publish(lo->trie);
 
-	if (lo->ipos < (lo->len - 1)) {
-		/* there are more than one letter => tail branch */
-		int off = lo->ipos+1;
-		ab_Branch *tail;
-		AB_D printf("nodeAdd node->suffix\n");
-		tail = ab_branchNew(lo->key + off, lo->len - off);
+	lo->status = AB_LKUP_UNSYNC;
+	return r;
+}
 
-		ab_branchSetValue(tail, value);
-		AB_D ab_printWood((ab_Wood*)tail, 4, true);
 
-		switch(lo->status) {
+void* ab_del(ab_Look *lo)
+{
+	ab_Cursor *last;
+	void *r;
 
-		case AB_LKUP_NODE_NOITEM:
-			ab_addItem(node, c, (ab_Wood*)tail, false, NULL);
-			break;
+	if (lo->status != AB_LKUP_FOUND)
+		ea_fatal("ab_del: lookup status (%s) != AB_LKUP_FOUND",
+		         ab_loStatusName(lo->status));
+
+	if (ab_readOnly(lo->trie))
+		ea_fatal("ab_del: read only trie");
+
+	if (lo->trie->shared)
+		ab_cowPath(lo);
+
+	if (lo->trie->index)
+		ab_indexUpdate(lo, false, NULL);
+
+	AB_D ab_printSearch(lo);
+
+	r = ab_get(lo);
+
+	if (lo->edge)
+		ab_countEdge(lo->trie, lo->edge == 2, -1);
+	else
+		ab_countKey(lo->trie, lo->key, lo->len, -1);
+
+	last = lo->path + lo->ipath;
+
+	switch(ab_kind(last->wood)) {
+
+	case AB_NODE:
+		ab_delFromNode(lo);
+		break;
+
+	case AB_BRANCH:
+		ab_delFromBranch(lo);
+		break;
+
+	default:
+		ea_fatal("ab_set: unexpected kind");
+		return NULL;
+	}
+
+	if (lo->trie->shared)
+		ab_publish(lo->trie);
+
+	lo->status = AB_LKUP_UNSYNC;
+
+	return r;
+}
+
+
+static ab_Wood* ab_firstNode(ab_Look *lo, ab_Wood *w, int *letter, int bottom)
+{
+	ab_Node *node = (ab_Node*)w;
+	int slot = (bottom) ? ab_nodeLast(node) : ab_nodeFirst(node);
+	int flag;
+
+	assert(slot != -1);
+
+	ab_loCurrent(lo)->at = slot;
+	flag = ab_nodeFlags(node)[slot];
+
+	AB_D printf("ab_first: kind=node\n");
 
-		case AB_LKUP_NODE_NOSUB: {
-			int from = ab_nodeFrom(node);
-			ab_NodeItem *item = node->items + (c - from);
+	assert(flag & AB_ITEM_ON);
+	assert(flag & (AB_ITEM_VAL | AB_ITEM_SUB));
+
+	*letter = ab_nodeLetter(node, slot);
+
+	AB_D printf("ab_first: node '%c'\n", *letter);
+
+	if (flag & AB_ITEM_SUB) {
+		w = ab_nodeSub(node, slot);
+		ab_loStep(lo, w);
+	} else /* (flag & AB_ITEM_VAL)*/ {
+		w = NULL;
+	}
+
+	return w;
+}
+
+
+static ab_Wood* ab_firstBranch(ab_Look *lo, ab_Wood *w)
+{
+	ab_Branch *b = (ab_Branch*)w;
+
+	assert(ab_branchSub(b) || (b->flag & AB_BRANCH_VAL));
+
+	AB_D printf("ab_first: branch '%.*s'\n", b->len, ab_branchKey(b));
+
+	if (ab_branchSub(b)) {
+		w = ab_branchSub(b);
+		ab_loStep(lo, w);
+	} else /* (b->flag & AB_BRANCH_VAL) */ {
+		w = NULL;
+	}
+
+	return w;
+}
+
+
+/*
+ * ab_fist search the first (or last if `bottom` is true) element in the trie.
+ *
+ * The key of this element can be stored in an optional buffer `buf` of
+ * size `buflen`. If the key is bigger of `buflen` it will be truncated.
+ *
+ * If `buf` is NULL `buflen` must be 0.
+ *
+ * The function return -1 if the trie is empty otherwise return the min
+ * of key size and `buflen`.
+ *
+ */
+int ab_first(ab_Look *lo, ab_Trie *trie, char *buf, int buflen, int bottom)
+{
+	ab_Wood *w = trie->root;
+
+	/* lo->len is used as index */
+	ab_loSet(lo, trie, buf, 0);
+	lo->edge = (bottom) ? 2 : 1;
+
+	if (lo->status == AB_LKUP_EMPTY)
+		return -1;
+
+	while(w) {
+		switch(ab_kind(w)) {
+
+		case AB_NODE: {
+			int letter;
+
+			w = ab_firstNode(lo, w, &letter, bottom);
+
+			if (lo->len < buflen) {
+				lo->key[lo->len] = letter;
+				lo->len++;
+			}
 
-			ab_nodeAddSub(node, (ab_Wood*)tail, item);
 			break;
+		}
+
+		case AB_BRANCH: {
+
+			if (lo->len < buflen) {
+				ab_Branch *b = (ab_Branch*)w;
+				int n = AB_MIN(buflen - lo->len, b->len);
+
+				memcpy(lo->key + lo->len, ab_branchKey(b), n);
+				lo->len += n;
+			}
+
+			w = ab_firstBranch(lo, w);
 
+			break;
 		}
 
 		default:
-			ea_fatal("nodeAdd: (suf) unexpected status %d = %s",
-			         lo->status,
-			         ab_loStatusName(lo->status));
+			ea_fatal("ab_set: unexpected kind");
 		}
-	} else {
-		/* only one letter => add new item */
-		assert(lo->status == AB_LKUP_NODE_NOITEM);
-		ab_addItem(node, c, NULL, true, value);
 	}
+
+	lo->ipos = lo->len - 1;
+	lo->status = AB_LKUP_FOUND;
+	return lo->len;
 }
 
 
-static void ab_addOnBranch(ab_Look *lo, void *value)
+
+
+
+static void ab_startFrom(ab_Cursor *c, ab_Wood *wood)
 {
-	ab_Cursor *last = ab_loCurrent(lo);
-	ab_Branch *b = (ab_Branch*)last->wood;
+	c->wood = wood;
 
-	AB_D printf("branchAdd: i=%d b=%d\n", lo->ipos, lo->bpos);
-	AB_D printf("branchAdd: len=%d b.len=%d\n", lo->len, b->len);
-	assert(ab_kind((ab_Wood*)b) == AB_BRANCH);
+	switch(ab_kind(wood)) {
 
-	switch(lo->status) {
+	case AB_NODE:
+		c->at = ab_nodeFirst((ab_Node*)wood);
+		break;
 
-	case AB_LKUP_BRANCH_OVER: {
-		/* bpos over branch length: abc + abcdef */
-		int off = lo->ipos + 1;
+	case AB_BRANCH:
+		c->at = 0;
+		break;
+	}
+}
 
-		AB_D printf("branchAdd: abc + abcdef\n");
-		ab_Branch *b2 = ab_branchNew(lo->key + off,
-		                             lo->len - off);
-		ab_branchSetValue(b2, value);
-		b->sub = b2;
-		return;
+
+int ab_start(ab_Trie *trie, ab_Cursor* c)
+{
+	if (!trie->root)
+		return false;
+
+	ab_startFrom(c, trie->root);
+
+	return true;
+}
+
+
+int ab_letter(ab_Cursor *c)
+{
+	switch(ab_kind(c->wood)) {
+
+	case AB_NODE:
+		assert(c->at != -1);
+		return ab_nodeLetter((ab_Node*)c->wood, c->at);
+
+	case AB_BRANCH:
+		assert(c->at < ((ab_Branch*)c->wood)->len);
+		return (uint8_t)ab_branchKey((ab_Branch*)c->wood)[c->at];
 	}
 
-	case AB_LKUP_BRANCH_INTO: {
-		/* abcdef + abc */
-		ab_Branch *head;
-		AB_D printf("branchAdd: abcdef + abc\n");
-		head = ab_branchCut(b, lo->bpos+1);
-		ab_setCurrentParent(lo, (ab_Wood*)head);
-		ab_branchSetValue(head, value);
-		break;
+	return 0;
+}
+
+/*
+ * Branch cursor: set `letters` to the rest of the label (from the cursor
+ * letter), move the cursor on the last letter and return the number of
+ * letters. A node cursor is left unchanged and return 0 (the only letter
+ * of the edge is ab_letter).
+ */
+int ab_edge(ab_Cursor *c, const uint8_t **letters)
+{
+	ab_Branch *b;
+	int n;
+
+	if (ab_kind(c->wood) != AB_BRANCH)
+		return 0;
+
+	b = (ab_Branch*)c->wood;
+	n = b->len - c->at;
+
+	*letters = (const uint8_t*)ab_branchKey(b) + c->at;
+	c->at = b->len - 1;
+
+	return n;
+}
+
+
+/* number of keys starting with the key of the cursor position */
+uint32_t ab_cursorCount(ab_Cursor *c)
+{
+	if (!c->wood)
+		return 0;
+
+	if (ab_kind(c->wood) == AB_NODE)
+		return ab_itemCount((ab_Node*)c->wood, c->at);
+
+	return ab_woodCount(c->wood);
+}
+
+
+int ab_value(ab_Cursor *c, void **value)
+{
+	if (!c->wood)
+		return false;
+
+
+	switch(ab_kind(c->wood)) {
+
+	case AB_NODE: {
+		ab_Node *node = (ab_Node*)c->wood;
+		int flag = ab_nodeFlags(node)[c->at];
+
+		assert(flag & AB_ITEM_ON);
+
+		if (!(flag & AB_ITEM_VAL))
+			return false;
+
+		if (value)
+			*value = ab_nodeValue(node, c->at);
+
+		return true;
 	}
 
-	case AB_LKUP_BRANCH_DIFF: {
-		/* abcdef + abcxyz */
-		ab_Node *node;
-		ab_Wood *head;
+	case AB_BRANCH: {
+		ab_Branch *b = (ab_Branch*)c->wood;
 
-		AB_D printf("branchAdd: abcdef + abcxyz\n");
-		AB_D ab_printWood(last->wood, 4, true);
+		if (c->at != b->len - 1)
+			return false;
 
-		head = ab_branchFork(b, lo->bpos, &node);
-		ab_setCurrentParent(lo, head);
+		if (!(b->flag & AB_BRANCH_VAL))
+			return false;
 
-		//ab_loCurrent(lo)->wood = head; TODO ??
+		if (value)
+			*value = ab_branchValue(b);
 
-		/* overwrite lu status to node NOITEM because fork work
-		 * on two different char and other char doesn't exists
-		 * in node
-		 */
-		lo->status = AB_LKUP_NODE_NOITEM;
-		ab_addOnNode(lo, node, value);
-		break;
+		return true;
 	}
 
-	default:
-		ea_fatal("ab_addOnBranch: unexpected lo status %d = %s",
-		         lo->status, ab_loStatusName(lo->status));
 	}
 
-	/* the src branch can be free only after update parent to avoid
-	   leak reference (e.g. in lo->path) */
-	ab_branchFree(b);
+	return false;
 }
 
 
-static void ab_setValue(ab_Look *lo, void *value)
+int ab_choices(ab_Cursor *c, char *array)
 {
-	ab_Cursor *f = ab_loCurrent(lo);
+	switch(ab_kind(c->wood)) {
 
-	AB_D printf("setValue...\n");
+	case AB_NODE: {
+		ab_Node *node = (ab_Node*)c->wood;
 
-	switch(ab_kind(f->wood)) {
+		if (!array)
+			return node->size;
 
-	case AB_NODE:
-		ab_nodeSetValue((ab_Node*)f->wood, f->at.item, value);
-		break;
+		return ab_nodeLetters(node, (uint8_t*)array);
+	}
 
 	case AB_BRANCH:
-		ab_branchSetValue((ab_Branch*)f->wood, value);
-		break;
+		if (array) {
+			ab_Branch *b = (ab_Branch*)c->wood;
+			array[0] = ab_branchKey(b)[c->at];
+		}
 
-	default:
-		ea_fatal("ab_setValue: unexpected kind");
+		return 1;
 	}
+
+	return -1;
 }
 
 
-//l+ampone
-static void ab_addOn(ab_Look *lo, void *value)
+/*
+ * TODO
+ * AB_SWITCH_BEGIN(c->wood)
+ * AB_SWITCH_END
+ */
+
+int ab_seek(ab_Cursor *c, int letter)
 {
-	ab_Cursor *last = ab_loCurrent(lo);
+	switch(ab_kind(c->wood)) {
 
-	AB_D printf("addWood '%s' len=%d\n", lo->key, lo->len);
+	case AB_NODE: {
+		int slot = ab_nodeGet((ab_Node*)c->wood, letter);
 
-	switch(ab_kind(last->wood)) {
+		if (slot == -1)
+			return false;
 
-	case AB_NODE:
-		AB_D printf("addWood: on node\n");
-		ab_addOnNode(lo, (ab_Node*)last->wood, value);
-		break;
+		c->at = slot;
 
-	case AB_BRANCH:
-		AB_D printf("addWood: on branch\n");
-		ab_addOnBranch(lo, value);
-		break;
+		return true;
+	}
+
+	case AB_BRANCH: {
+		ab_Branch *b = (ab_Branch*)c->wood;
+		return (uint8_t)ab_branchKey(b)[c->at] == (uint8_t)letter;
 	}
+	}
+	return false;
 }
 
 
+int ab_seekNext(ab_Cursor *c)
+{
+	switch(ab_kind(c->wood)) {
+	case AB_NODE: {
+		int slot = ab_nodeNext((ab_Node*)c->wood, c->at);
 
+		if (slot == -1)
+			return false;
 
+		c->at = slot;
+		return true;
+	}
+	case AB_BRANCH: {
+		return false;
+	}
+	}
+	return false;
+}
 
 
 /*
- *     REMOVE KEYS  #SECTION
+ * Move the cursor to the first letter >= `letter` (a branch cursor can't
+ * move: succeed only if its letter is >= `letter`).
  */
+int ab_seekFrom(ab_Cursor *c, int letter)
+{
+	switch(ab_kind(c->wood)) {
+	case AB_NODE: {
+		int slot = ab_nodeFrom((ab_Node*)c->wood, (uint8_t)letter);
 
+		if (slot == -1)
+			return false;
 
-static void ab_branchDelValue(ab_Branch *b)
-{
-	b->flag = AB_BRANCH;
-	b->value = NULL;
+		c->at = slot;
+		return true;
+	}
+	case AB_BRANCH: {
+		ab_Branch *b = (ab_Branch*)c->wood;
+		return (uint8_t)ab_branchKey(b)[c->at] >= (uint8_t)letter;
+	}
+	}
+	return false;
 }
 
+
 /*
- * copy from the array 'src' (with 'n' elements of kind 't') all elements
- * excluding the one at 'exclude' position
+ * Try to go forward in the trie from the cursor position `c` and
+ * save the next cursor position (if exists) in `nxt`.
+ *
+ * Return true if exists a next cursor position.
+ *
+ * If the pointer `nxt` is NULL the function only probe
+ * the existence of next cursor position.
+ *
+ * To move a cursor instead of create a next cursor use
+ * the same pointer for `c` and `nxt`.
+ *
  */
-#define ab_arrayDel(dest, src, n, t, exclude)                                 \
-        memcpy(dest, src, exclude*sizeof(t));                                 \
-        memcpy(dest + exclude, src + exclude+1, (n - (exclude+1))*sizeof(t));
-
-
-static void ab_nodeDelSub(ab_Node *node, ab_NodeItem *item)
+int ab_next(ab_Cursor *nxt, ab_Cursor *c)
 {
-	assert(node->nsize);
-	assert(item->flag & AB_ITEM_ON);
-	assert(item->flag & AB_ITEM_SUB);
-
-	AB_D printf("nodeDelSub...\n");
+	assert(c->wood);
 
-	if (node->nsize == 1) {
-		ea_freeArray(ab_Wood*, 1, node->subs);
-		node->subs = NULL;
-		node->nsize = 0;
-	} else {
-		ab_Wood **subs = ea_allocArray(ab_Wood*, node->nsize - 1);
-		int j, i = item->n;
+	AB_D printf("ab_next...\n");
+	AB_D ab_printWood(c->wood, 4, false);
 
-		ab_arrayDel(subs, node->subs, node->nsize, ab_Wood*, i);
-		ea_freeArray(ab_Wood*, node->nsize, node->subs);
+	switch(ab_kind(c->wood)) {
+	case AB_NODE: {
+		ab_Node *node = (ab_Node*)c->wood;
+		int flag = ab_nodeFlags(node)[c->at];
 
-		node->subs = subs;
-		node->nsize--;
+		assert(flag & AB_ITEM_ON);
 
-		for (j = 0; j < node->size; j++)
-			if (node->items[j].n > i)
-				node->items[j].n--;
-	}
+		if (!(flag & AB_ITEM_SUB))
+			return false;
 
-	item->n = 0;
+		AB_D printf("ab_next...(node) have next!\n");
+		AB_D ab_printNodeItem(node, c->at, 4);
 
-	if (item->flag & AB_ITEM_VAL)
-		item->flag = AB_ITEM_ON | AB_ITEM_VAL;
-	else
-		item->flag = AB_ITEM_OFF;
-}
+		if (nxt)
+			ab_startFrom(nxt, ab_nodeSub(node, c->at));
 
+		return true;
+	}
 
-static void ab_nodeDelVal(ab_Node *node, ab_NodeItem *item)
-{
-	assert(node->vsize);
-	assert(item->flag & AB_ITEM_ON);
-	assert(item->flag & AB_ITEM_VAL);
+	case AB_BRANCH: {
+		ab_Branch *b = (ab_Branch*)c->wood;
 
-	AB_D printf("nodeDelVal: vsize = %d\n", node->vsize);
-	if (node->vsize == 1) {
-		ea_freeArray(void*, 1, node->values);
-		node->values = NULL;
-		node->vsize = 0;
-	} else {
-		void **values = ea_allocArray(void*, node->vsize - 1);
-		int j, i = item->v;
+		if (c->at < (b->len-1)) {
+			if (nxt) {
+				nxt->wood = c->wood;
+				nxt->at = c->at + 1;
+			}
+			AB_D printf("ab_next...(branch) have next (inside)!\n");
+			return true;
+		}
 
-		ab_arrayDel(values, node->values, node->vsize, void*, i);
-		ea_freeArray(void*, node->vsize, node->values);
+		if (!ab_branchSub(b))
+			return false;
 
-		node->values = values;
-		node->vsize--;
+		AB_D printf("ab_next...(branch) have next!\n");
+		if (nxt)
+			ab_startFrom(nxt, ab_branchSub(b));
+		return true;
+	}
+	default:
+		ea_fatal("ab_interNext: unexpected wood kind");
+		return false;
+	}
+}
 
-		for (j = 0; j < node->size; j++)
-			if (node->items[j].v > i)
-				node->items[j].v--;
 
-	}
 
-	item->v = 0;
 
-	if (item->flag & AB_ITEM_SUB)
-		item->flag = AB_ITEM_ON | AB_ITEM_SUB;
-	else
-		item->flag = AB_ITEM_OFF;
-}
 
+/*
+ *     ORDERED SCAN  #SECTION
+ */
 
-static void ab_nodeShrink(ab_Node *node, ab_NodeItem *item)
+/*
+ * Call `fn` for every key greater or equal to `from` (strictly greater if
+ * `after`) in lexicographic (unsigned byte) order, until `fn` return
+ * false. The key passed to `fn` is valid only during the call.
+ *
+ * Return true if the scan was stopped by `fn`.
+ */
+int ab_scan(ab_Trie *trie, char *from, int fromlen, int after,
+            ab_ScanFn fn, void *data)
 {
-	int from = ab_nodeFrom(node);
-	int to = ab_nodeTo(node);
-	int i, size;
-	ab_NodeItem *items;
+	int size = AB_MAX(64, fromlen + 1);
+	ab_Cursor *stack = ea_allocArray(ab_Cursor, size);
+	char *key = ea_allocArray(char, size);
+	int d = 0, stop = false;
+	/* key[0..d-1] == from[0..d-1] */
+	int bound = fromlen > 0;
 
-	AB_D printf("nodeShrink - f='%c'%d to ='%c'%d\n", from, from, to, to);
+	if (!ab_start(trie, stack))
+		goto end;
 
-#if 0
-	AB_D {
-		ab_printNode(node, 4, false);
-		printf("nodeShrink items =\n");
-		for (i = 0; i < node->size; i++)
-			ab_printNodeItem(node->items + i, 4);
-	}
-#endif
+	if (bound && !ab_seekFrom(stack, from[0]))
+		goto end;
 
-	if (item->letter == from) {
-		for (i = from + 1; i < to; i++)
-			if (node->items[i - from].flag)
-				break;
+	for (;;) {
+		void *value;
+		int letter = ab_letter(stack + d);
 
-		from = i;
-	} else if (item->letter == to) {
-		for (i = to - 1; i > from; i--)
-			if (node->items[i - from].flag)
-				break;
+		key[d] = letter;
 
-		to = i;
-	} else {
-		AB_D printf("nodeShrink...nothing to do\n");
-		return;
-	}
+		if (bound && (letter != (uint8_t)from[d]))
+			bound = false;
 
+		if (ab_value(stack + d, &value)) {
+			int less = bound && ((d + 1 < fromlen) || after);
 
-	AB_D printf("nodeShrink -GO- f='%c'%d t='%c'%d\n", from, from, to, to);
+			if (!less && !fn(data, key, d + 1, value)) {
+				stop = true;
+				goto end;
+			}
+		}
 
-	size = to - from + 1;
-	i = from - ab_nodeFrom(node);
+		/* all longer keys are greater than `from` */
+		if (bound && (d + 1 >= fromlen))
+			bound = false;
 
-	// TODO
-	//items = ab_nodeItemsNewFrom(size, node->items, i, size);
-	AB_D printf("nodeShrink copy from %d size=%d\n", i, size);
+		if (d + 1 == size) {
+			int nsize = size * 2;
+			stack = ea_resizeArray(ab_Cursor, size, nsize, stack);
+			key = ea_resizeArray(char, size, nsize, key);
+			size = nsize;
+		}
 
-	items = ab_nodeItemsNew(size);
-	memcpy(items, node->items + i, size * sizeof(ab_NodeItem)) ;
+		/* go down */
+		if (ab_next(stack + d + 1, stack + d)) {
+			d++;
 
+			if (!bound || ab_seekFrom(stack + d, from[d]))
+				continue;
 
-	ea_freeArray(ab_NodeItem, node->size, node->items);
+			d--;
+		}
 
-	node->items = items;
-	node->size = size;
+		/* go to the next sibling or up */
+		bound = false;
 
-#if 0
-	AB_D {
-		ab_printNode(node, 4, false);
-		printf("nodeShrink new items =\n");
-		for (i = 0; i < node->size; i++)
-			ab_printNodeItem(node->items + i, 4);
+		while (!ab_seekNext(stack + d)) {
+			if (d == 0)
+				goto end;
+			d--;
+		}
 	}
-#endif
-}
-
 
+end:
+	ea_freeArray(ab_Cursor, size, stack);
+	ea_freeArray(char, size, key);
 
+	return stop;
+}
 
-static int ab_mergeBranch(ab_Branch *b)
-{
-	ab_Branch *b2;
-
-	AB_D printf("mergeBranch...\n");
 
-	AB_D ab_printWood((ab_Wood*)b, 4, true);
 
-	if (!b->sub)
-		return false;
 
-	if (b->value)
-		return false;
 
-	if (ab_kind(b->sub) != AB_BRANCH)
-		return false;
+/*
+ *     CLEAR  #SECTION
+ *
+ * The detached woods are freed in one pass: a wood is taken from the
+ * stack, its values are passed to `fn`, its subs pushed and then it is
+ * freed (no lookup and no merge as with ab_del).
+ */
 
-	b2 = (ab_Branch*)b->sub;
+static void ab_clearPush(ab_Clear *cl, ab_Wood *w)
+{
+	if (cl->len == cl->size) {
+		int nsize = cl->size * 2;
 
-	AB_D {
-		printf("mergeBranch...merging A+B\n");
-		printf("mergeBranch: A = ");
-		ab_printWood((ab_Wood*)b, 0, false);
-		printf("mergeBranch: B = ");
-		ab_printWood((ab_Wood*)b2, 0, true);
+		cl->woods = ea_resizeArray(ab_Wood*, cl->size, nsize,
+		                           cl->woods);
+		cl->size = nsize;
 	}
 
-
-	b->kdata = ea_reallocMem(b->kdata, b->len + b2->len);
-	memcpy(b->kdata + b->len, b2->kdata, b2->len);
-
-
-	b->len += b2->len;
-	if (b2->flag & AB_BRANCH_VAL)
-		ab_branchSetValue(b, b2->value);
-	b->sub = b2->sub;
-	ab_branchFree(b2);
-	return true;
+	cl->woods[cl->len++] = w;
 }
 
 
-
-
-
-static ab_Branch *ab_newBranchFrom(ab_Node *node)
+static void ab_clearWood(ab_Clear *cl, ab_Wood *w)
 {
-	ab_NodeItem *item = node->items + 0;
-	ab_Branch *b;
+	if (ab_kind(w) == AB_NODE) {
+		ab_Node *node = (ab_Node*)w;
+		uint8_t *flags = ab_nodeFlags(node);
+		ab_NodeItem *items = ab_nodeItems(node);
+		int slot;
+
+		for (slot = ab_nodeFirst(node); slot != -1;
+		     slot = ab_nodeNext(node, slot)) {
+			if ((flags[slot] & AB_ITEM_VAL) && cl->fn)
+				cl->fn(items[slot].value);
+
+			if (flags[slot] & AB_ITEM_SUB)
+				ab_clearPush(cl, items[slot].sub);
+		}
 
-	assert(node->size == 1);
+		ab_nodeFree(node);
 
-	AB_D printf("node2branch...\n");
+	} else {
+		ab_Branch *b = (ab_Branch*)w;
 
-	b = ab_branchNew(&(item->letter), 1);
+		if ((b->flag & AB_BRANCH_VAL) && cl->fn)
+			cl->fn(b->value);
 
-	if (item->flag & AB_ITEM_SUB)
-		b->sub = node->subs[0];
+		if (b->sub)
+			ab_clearPush(cl, b->sub);
 
-	if (item->flag & AB_ITEM_VAL)
-		ab_branchSetValue(b, node->values[0]);
+		ab_branchFree(b);
+	}
 
-	return b;
+	cl->freed++;
 }
 
 
-static void ab_nodeToBranch(ab_Look *lo, ab_Node *node)
+/* detach the root and the index of the trie */
+static void ab_clearDetach(ab_Clear *cl)
 {
-	ab_Branch *b = ab_newBranchFrom(node);
-	ab_NodeItem *item = node->items;
-
-	AB_D printf("node2branch: new (replace) branch\n");
-	AB_D ab_printBranch(b, 4, true);
+	ab_Trie *trie = cl->trie;
 
-	if (item->flag & AB_ITEM_SUB)
-		ab_nodeDelSub(node, node->items);
+	if (trie->root)
+		ab_clearPush(cl, trie->root);
 
-	if (item->flag & AB_ITEM_VAL)
-		ab_nodeDelVal(node, node->items);
+	trie->root = NULL;
 
-	ab_nodeFree(node);
+	if (trie->index) {
+		if (cl->nindex == cl->indexsize) {
+			int nsize = cl->indexsize * 2;
 
-	ab_setCurrentParent(lo, (ab_Wood*)b);
+			cl->index = ea_resizeArray(ab_Hash*, cl->indexsize,
+			                           nsize, cl->index);
+			cl->indexsize = nsize;
+		}
 
-	if (lo->ipath > 0) {
-		ab_Cursor *parent = lo->path + lo->ipath - 1;
+		/* below the index being freed (the last) */
+		memmove(cl->index + 1, cl->index,
+		        cl->nindex * sizeof(ab_Hash*));
+		cl->index[0] = trie->index;
+		cl->nindex++;
 
-		if (ab_kind(parent->wood) == AB_BRANCH) {
-			AB_D printf("nodeUpd: merge parent...\n");
-			if (ab_mergeBranch((ab_Branch*)parent->wood)) {
-				AB_D printf("nodeUpd: parent merged\n");
-				b = (ab_Branch*)parent->wood;
-			}
-		}
+		trie->index = ab_hashNew();
 	}
 
-	if (!b->sub)
-		return;
-
-	AB_D printf("nodeUpd: merge sub\n");
-	ab_mergeBranch(b);
+	/* readers begun from now see the empty trie */
+	if (trie->shared) {
+		ab_publish(trie);
+		cl->epoch = trie->shared->epoch;
+	}
 }
 
 
-static void ab_nodeUpdateCurrent(ab_Look *lo)
+void ab_clearStart(ab_Clear *cl, ab_Trie *trie, ab_ValueFn fn)
 {
-	ab_Cursor *last = lo->path + lo->ipath;
-	ab_Node *node = (ab_Node*)last->wood;
-	ab_NodeItem *item = last->at.item;
-
-	AB_D printf("nodeUpd: shrink\n");
-	ab_nodeShrink(node, item);
-
-	AB_D printf("nodeUpd: shrinked\n");
-	AB_D ab_printWood((ab_Wood*)node, 4, true);
-
-	if (node->size > 1)
-		return;
-
-	ab_nodeToBranch(lo, node);
+	if (ab_readOnly(trie))
+		ea_fatal("ab_clearStart: read only trie");
+
+	cl->trie = trie;
+	cl->fn = fn;
+	cl->size = 64;
+	cl->woods = ea_allocArray(ab_Wood*, cl->size);
+	cl->len = 0;
+	cl->indexsize = 4;
+	cl->index = ea_allocArray(ab_Hash*, cl->indexsize);
+	cl->nindex = 0;
+	cl->pos = 0;
+	cl->epoch = 0;
+	cl->freed = 0;
+
+	ab_clearDetach(cl);
 }
 
-static void ab_delFromNode(ab_Look *lo)
+
+/*
+ * Empty the trie again while `cl` is running: the keys set since
+ * ab_clearStart are freed with the others (in a shared trie the steps wait
+ * also for the readers begun before now).
+ */
+void ab_clearAdd(ab_Clear *cl)
 {
-	ab_Cursor *last = lo->path + lo->ipath;
-	ab_Node *node = (ab_Node*)last->wood;
-	ab_NodeItem *item = last->at.item;
+	ab_clearDetach(cl);
+}
 
-	AB_D printf("delFromNode...\n");
 
-	AB_D ab_printWood((ab_Wood*)node, 4, true);
-	ab_nodeDelVal(node, item);
-	AB_D ab_printWood((ab_Wood*)node, 4, true);
+/* true while readers of a shared trie can reach the detached woods */
+int ab_clearWaiting(ab_Clear *cl)
+{
+	if (!cl->epoch)
+		return false;
 
-	if (item->flag & AB_ITEM_SUB)
-		/* non terminal node */
-		return;
+	if (ab_readersBefore(cl->trie, cl->epoch))
+		return true;
 
-	ab_nodeUpdateCurrent(lo);
+	cl->epoch = 0;
+	return false;
 }
 
 
-static void ab_delFromBranch(ab_Look *lo)
+/*
+ * Free at most `budget` woods (and `budget` index slots), return true if
+ * there is something left to free.
+ */
+int ab_clearStep(ab_Clear *cl, int budget)
 {
-	ab_Cursor *prev, *last = lo->path + lo->ipath;
-	ab_Branch *b = (ab_Branch*)last->wood;
+	int n = budget;
 
-	AB_D printf("delFromBranch...\n");
+	if (ab_clearWaiting(cl))
+		return true;
 
-	if (b->sub) {
-		/* non-terminal branch */
-		AB_D printf("delFromBranch: inside\n");
-		ab_branchDelValue(b);
-		ab_mergeBranch(b);
-		return;
+	while ((n > 0) && (cl->len > 0)) {
+		ab_clearWood(cl, cl->woods[--cl->len]);
+		n--;
 	}
 
-	if (lo->ipath == 0) {
-	/* only one wood (branch) in trie - empties trie */
-		AB_D printf("delFromBranch: root-parent\n");
-		lo->trie->root = NULL;
-		ab_branchFree(b);
-		return;
+	if (cl->nindex && (n > 0)) {
+		if (!ab_hashFreeStep(cl->index[cl->nindex - 1], &cl->pos, n)) {
+			cl->nindex--;
+			cl->pos = 0;
+		}
 	}
 
-	/* terminal branch */
-	prev = lo->path + (--lo->ipath);
+	return (cl->len > 0) || cl->nindex;
+}
 
-	AB_D printf("delFromBranch: terminal branch\n");
 
-	switch(ab_kind(prev->wood)) {
+/* free at once what is left */
+void ab_clearEnd(ab_Clear *cl)
+{
+	while (ab_clearStep(cl, 1 << 20));
 
-	case AB_NODE:
-		AB_D printf("delFromBranch: sub=node\n");
-		ab_nodeDelSub(((ab_Node*)(prev->wood)), prev->at.item);
+	ea_freeArray(ab_Wood*, cl->size, cl->woods);
+	ea_freeArray(ab_Hash*, cl->indexsize, cl->index);
+}
 
-		if (prev->at.item->flag & AB_ITEM_VAL)
-			break;
 
-		ab_nodeUpdateCurrent(lo);
-		break;
+void ab_clear(ab_Trie *trie, ab_ValueFn fn)
+{
+	ab_Clear cl;
 
-	case AB_BRANCH:
-		AB_D printf("delFromBranch: sub=branch\n");
-		((ab_Branch*)(prev->wood))->sub = NULL;
-		break;
+	ab_clearStart(&cl, trie, fn);
+	ab_clearEnd(&cl);
+}
 
-	default:
-		ea_fatal("delFromBranch: unexpected kind");
-	}
 
-	ab_branchFree(b);
+/* clear and free a trie */
+void ab_destroy(ab_Trie *trie, ab_ValueFn fn)
+{
+	ab_clear(trie, fn);
+	ab_free(trie);
 }
 
 
 
-/* PUBLIC METHOD #SECTION */
 
 
-void ab_printWood(ab_Wood *w, int indent, int recursive)
+/*
+ *     DEFRAGMENTATION  #SECTION
+ *
+ * A step walks from the root to the position `df->next` (the woods on the
+ * way are already moved) and continue the depth first walk moving every
+ * new wood reached: the copy is linked in the (already moved) parent and
+ * the original is freed. Woods added by ab_set behind the position are
+ * not moved by this pass.
+ *
+ * In a shared trie woods are changed in place as in a private trie, so
+ * a step runs only without readers and then publish the moved root.
+ */
+
+/* subs of a moved node prefetched (the walk visits them next) */
+#define AB_PREFETCH_SUBS 8
+
+
+static void ab_prefetchSubs(ab_Node *node)
 {
-	assert(w);
-	switch(ab_kind(w)) {
+	uint8_t *flags = ab_nodeFlags(node);
+	int i = 0, slot = ab_nodeFirst(node);
 
-	case AB_NODE:
-		ab_printNode((ab_Node*)w, indent, recursive);
-		break;
+	while ((slot != -1) && (i++ < AB_PREFETCH_SUBS)) {
+		if (flags[slot] & AB_ITEM_SUB)
+			AB_PREFETCH(ab_nodeItems(node)[slot].sub);
 
-	case AB_BRANCH:
-		ab_printBranch((ab_Branch*)w, indent, recursive);
-		break;
+		slot = ab_nodeNext(node, slot);
 	}
 }
 
 
-void ab_printKeys(ab_Wood *w, int indent)
+static ab_Wood* ab_woodPack(ab_Defrag *df, ab_Wood *w)
 {
-	assert(w);
-	switch(ab_kind(w)) {
+	df->woods++;
 
-	case AB_NODE:
-		ab_printNodeKeys((ab_Node*)w, indent);
-		break;
+	if (ab_kind(w) == AB_NODE) {
+		ab_Node *src = (ab_Node*)w;
+		size_t n = ab_nodeBytes(src->kind);
+		ab_Node *node = ea_allocPacked(n);
 
-	case AB_BRANCH:
-		ab_printBranchKey((ab_Branch*)w, indent);
-		break;
-	}
-}
+		memcpy(node, src, n);
+		ab_nodeFree(src);
+		ab_prefetchSubs(node);
+		df->bytes += n;
 
-void ab_printSearch(ab_Look *lo)
-{
-	int i;
+		return (ab_Wood*)node;
 
-	printf("{\n");
+	} else {
+		ab_Branch *src = (ab_Branch*)w;
+		ab_Branch *b = ea_allocPacked(sizeof(ab_Branch));
 
-	printf("  status: %s,\n", ab_loStatusName(lo->status));
-	printf("  bpos: %d,\n", lo->bpos);
-	printf("  ipos: %d,\n", lo->ipos);
-	printf("  ipath: %d,\n", lo->ipath);
+		*b = *src;
+		df->bytes += sizeof(ab_Branch);
 
-	for (i = 0; i <= lo->ipath; i++) {
-		ab_Cursor *w = lo->path + i;
-		printf("\n  path[%d/%d]: {\n", i+1, lo->ipath+1);
-		if (w->wood)
-			ab_printCursor(w, 2);
-		printf("  } \n");
-	}
+		if (b->len > AB_BRANCH_INLINE) {
+			b->key.ptr = ea_allocPacked(b->len);
+			memcpy(b->key.ptr, src->key.ptr, b->len);
+			df->bytes += b->len;
+		}
 
-	printf("}\n");
+		ab_branchFree(src);
+
+		if (b->sub)
+			AB_PREFETCH(b->sub);
+
+		return (ab_Wood*)b;
+	}
 }
 
 
-ab_Trie* ab_new()
+/* link a moved wood in the parent cursor item */
+static void ab_defragLink(ab_Cursor *parent, ab_Wood *w)
 {
-	ab_Trie *result = ea_alloc(ab_Trie);
-	result->root = NULL;
-
-	return result;
+	if (ab_kind(parent->wood) == AB_NODE)
+		ab_nodeItems((ab_Node*)parent->wood)[parent->at].sub = w;
+	else
+		((ab_Branch*)parent->wood)->sub = w;
 }
 
-void ab_free(ab_Trie* trie)
+
+void ab_defragStart(ab_Defrag *df, ab_Trie *trie)
 {
-	assert(trie->root == NULL);
-	ea_free(ab_Trie, trie);
+	if (ab_readOnly(trie))
+		ea_fatal("ab_defragStart: read only trie");
+
+	df->trie = trie;
+	df->size = 64;
+	df->next = ea_allocArray(char, df->size);
+	df->key = ea_allocArray(char, df->size);
+	df->stack = ea_allocArray(ab_Cursor, df->size);
+	df->len = 0;
+	df->started = false;
+	df->done = false;
+	df->woods = 0;
+	df->bytes = 0;
 }
 
-int ab_empty(ab_Trie *trie)
+
+/*
+ * Move at most `budget` woods, return true if the pass is not complete.
+ */
+int ab_defragStep(ab_Defrag *df, int budget)
 {
-	return trie->root == NULL;
-}
+	ab_Trie *trie = df->trie;
+	ab_Cursor *stack = df->stack;
+	char *from = df->next;
+	int fromlen = df->len;
+	/* key[0..d-1] == from[0..d-1] */
+	int bound = fromlen > 0;
+	int d = 0;
+
+	if (df->done)
+		return false;
 
+	if (ab_defragWaiting(df))
+		return true;
 
+	if (!trie->root)
+		goto end;
 
+	if (!df->started) {
+		trie->root = ab_woodPack(df, trie->root);
+		df->started = true;
+		budget--;
+	}
 
-void ab_loSet(ab_Look *lo, ab_Trie *trie, char *key, int len)
-{
-	lo->trie = trie;
-	lo->key = key;
-	lo->len = len;
-	lo->ipos = 0;
-	lo->bpos = 0;
-	lo->ipath = 0;
+	ab_startFrom(stack, trie->root);
 
-	lo->status = (ab_empty(trie)) ? AB_LKUP_EMPTY : AB_LKUP_INIT;
+	if (bound && !ab_seekFrom(stack, from[0]))
+		goto end;
 
-	lo->path[0].wood = trie->root;
-	lo->path[0].at.item = NULL;
-}
+	for (;;) {
+		int letter = ab_letter(stack + d);
 
+		df->key[d] = letter;
 
+		if (bound && (letter != (uint8_t)from[d]))
+			bound = false;
 
-int ab_loNext(ab_Look *lo)
-{
-	int again = false;
+		if (d + 1 == df->size) {
+			int nsize = df->size * 2;
 
-	if (lo->status != AB_LKUP_INIT)
-		return false;
+			df->next = ea_resizeArray(char, df->size, nsize,
+			                          df->next);
+			df->key = ea_resizeArray(char, df->size, nsize, df->key);
+			df->stack = ea_resizeArray(ab_Cursor, df->size, nsize,
+			                           df->stack);
+			df->size = nsize;
+			from = df->next;
+			stack = df->stack;
+		}
 
-	AB_D printf("lu key[%d/%d] = '%c'\n", lo->ipos,
-		   lo->len, lo->key[lo->ipos]);
+		/* go down: the wood reached has prefix key[0..d] */
+		if (ab_next(stack + d + 1, stack + d)) {
+			int fresh = stack[d + 1].wood != stack[d].wood;
 
-	//AB_D ab_printSearch(lo);
+			d++;
 
-	switch(ab_kind(ab_loCurrent(lo)->wood)) {
+			if (bound && (d < fromlen)) {
+				/* a wood above the position: already moved */
+				if (ab_seekFrom(stack + d, from[d]))
+					continue;
 
-	case AB_NODE:
-		again = ab_loNode(lo);
-		break;
+				d--;
 
-	case AB_BRANCH:
-		again = ab_loBranch(lo);
-		break;
-	}
+			} else {
+				bound = false;
 
-	if (again)
-		lo->ipos++;
+				if (!fresh)
+					continue;
 
-	AB_D printf("lu: lo %s\n", (again) ? "again..." : "STOP");
+				if (budget <= 0) {
+					memcpy(df->next, df->key, d);
+					df->len = d;
 
-	return again;
-}
+					if (trie->shared)
+						ab_publish(trie);
 
+					return true;
+				}
 
-int ab_find(ab_Look *lo, ab_Trie *trie, char *key, int len)
-{
-	ab_loSet(lo, trie, key, len);
+				stack[d].wood = ab_woodPack(df, stack[d].wood);
+				ab_defragLink(stack + d - 1, stack[d].wood);
+				budget--;
+				continue;
+			}
+		}
 
-	while (ab_loNext(lo)) {
-	}
+		/* go to the next sibling or up */
+		bound = false;
 
-	return lo->status == AB_LKUP_FOUND;
-}
+		while (!ab_seekNext(stack + d)) {
+			if (d == 0)
+				goto end;
+			d--;
+		}
+	}
 
+end:
+	if (trie->shared)
+		ab_publish(trie);
 
-int ab_found(ab_Look *lo)
-{
-	return lo->status == AB_LKUP_FOUND;
+	df->done = true;
+	return false;
 }
 
 
+/* true if a step of a shared trie must wait for the readers to leave */
+int ab_defragWaiting(ab_Defrag *df)
+{
+	if ((!df->trie->shared) || df->done)
+		return false;
 
+	return ab_readersBefore(df->trie, UINT64_MAX);
+}
 
 
-void *ab_get(ab_Look *lo)
+void ab_defragEnd(ab_Defrag *df)
 {
-	ab_Cursor *last = lo->path + lo->ipath;
+	ea_freeArray(char, df->size, df->next);
+	ea_freeArray(char, df->size, df->key);
+	ea_freeArray(ab_Cursor, df->size, df->stack);
+}
 
-	if (lo->status != AB_LKUP_FOUND)
-		ea_fatal("ab_get: lookup status (%s) != AB_LKUP_FOUND",
-		         ab_loStatusName(lo->status));
 
 
-	switch(ab_kind(last->wood)) {
 
-	case AB_NODE:
-		if (last->at.item->flag & AB_ITEM_VAL) {
-			ab_Node *node = (ab_Node*)last->wood;
-			return node->values[last->at.item->v];
-		}
-		return NULL;
 
-	case AB_BRANCH:
-		return ((ab_Branch*)last->wood)->value;
+/*
+ *     BULK LOAD  #SECTION
+ *
+ * Keys are added in order and the items of the last key stay open on the
+ * stack `items`, one group for every depth. When a new key diverges from
+ * the last one at depth L, the open items deeper than L are closed from
+ * the bottom: the children of an item become a node of the exact kind, or
+ * (if there is only one child) a branch. A single child without value
+ * extends the branch of its parent upward, so a chain of single children
+ * stays open in `chain` until its top is known and is then allocated as
+ * one branch with the chars of the last key.
+ */
 
-	default:
-		ea_fatal("ab_get: unexpected kind");
-		return NULL;
-	}
-}
+#define AB_BULK_NOCHAIN (-2)
 
 
-void* ab_set(ab_Look *lo, void *val)
+static ab_Wood* ab_bulkChain(ab_Bulk *bk)
 {
-	void *r = NULL;
+	ab_BulkChain *ch = &bk->chain;
+	ab_Branch *b = ab_branchNew(bk->key + ch->depth + 1,
+	                            ch->end - ch->depth);
 
-	AB_D printf("ab_set...\n");
-	AB_D ab_printSearch(lo);
+	b->sub = ch->sub;
+	b->count = ch->count;
 
-	switch(lo->status) {
+	if (ch->flag & AB_ITEM_VAL)
+		ab_branchSetValue(b, ch->value);
 
-	case AB_LKUP_FOUND:
-		r = ab_get(lo);
-	case AB_LKUP_NOVAL:
-		ab_setValue(lo, val);
-		break;
+	ch->depth = AB_BULK_NOCHAIN;
 
-	case AB_LKUP_BRANCH_OVER:
-	case AB_LKUP_BRANCH_INTO:
-	case AB_LKUP_BRANCH_DIFF:
-	case AB_LKUP_NODE_NOITEM:
-	case AB_LKUP_NODE_NOSUB:
-		ab_addOn(lo, val);
-		break;
+	return (ab_Wood*)b;
+}
 
-	case AB_LKUP_EMPTY:
-		AB_D printf("ab_set: first\n");
-		ab_Branch *first = ab_branchNew(lo->key, lo->len);
-		ab_branchSetValue(first, val);
-		lo->trie->root = (ab_Wood*)first;
-		break;
 
-	case AB_LKUP_INIT:
-		ea_fatal("ab_set: lookup has been only initialized");
-		break;
+static void ab_bulkSetSub(ab_BulkItem *item, ab_Wood *sub)
+{
+	item->sub = sub;
+	item->flag |= AB_ITEM_SUB;
+	item->count += ab_woodCount(sub);
+}
 
 
-	case AB_LKUP_UNSYNC:
-		ea_fatal("ab_set: lookup out of sync");
-		break;
+static ab_Wood* ab_bulkNode(ab_BulkItem *items, int n)
+{
+	ab_Node *node;
+	int i, kind = AB_NODE4;
 
-	default:
-		ea_fatal("ab_set: unexpected lu status %d", lo->status);
+	while (ab_nodeCapacity(kind) < n)
+		kind++;
+
+	node = ab_nodeNew(kind);
+
+	for (i = 0; i < n; i++) {
+		node = ab_addItem(node, items[i].letter, items[i].sub,
+		                  items[i].flag & AB_ITEM_VAL, items[i].value);
+		node->count += items[i].count;
 	}
 
-	lo->status = AB_LKUP_UNSYNC;
-	return r;
+	assert(node->kind == kind);
+
+	return (ab_Wood*)node;
 }
 
 
-void* ab_del(ab_Look *lo)
+/*
+ * Pop the items at depth d+1 and return the sub they make for the item
+ * at depth d (NULL if they opened or extended the chain).
+ */
+static ab_Wood* ab_bulkSub(ab_Bulk *bk, int d)
 {
-	ab_Cursor *last;
-	void *r;
+	int first = bk->start[d + 1];
+	int n = bk->nitems - first;
+	ab_BulkItem *child = bk->items + first;
+	ab_BulkChain *ch = &bk->chain;
 
-	if (lo->status != AB_LKUP_FOUND)
-		ea_fatal("ab_del: lookup status (%s) != AB_LKUP_FOUND",
-		         ab_loStatusName(lo->status));
+	bk->nitems = first;
 
+	if (n == 0)
+		return NULL;
 
-	AB_D ab_printSearch(lo);
+	/* only the last child can have an open chain */
+	if (ch->depth == d + 1) {
+		if (n == 1 && !(child->flag & AB_ITEM_VAL)) {
+			/* chain grows upward */
+			ch->depth = d;
+			return NULL;
+		}
 
-	r = ab_get(lo);
+		ab_bulkSetSub(child + n - 1, ab_bulkChain(bk));
+	}
 
-	last = lo->path + lo->ipath;
+	if (n > 1)
+		return ab_bulkNode(child, n);
 
-	switch(ab_kind(last->wood)) {
+	/* a single child open a chain */
+	ch->depth = d;
+	ch->end = d + 1;
+	ch->flag = child->flag;
+	ch->count = child->count;
+	ch->value = child->value;
+	ch->sub = child->sub;
+
+	return NULL;
+}
+
+
+/* close the (last) item at depth d */
+static void ab_bulkClose(ab_Bulk *bk, int d)
+{
+	ab_Wood *sub = ab_bulkSub(bk, d);
+
+	if (sub)
+		ab_bulkSetSub(bk->items + bk->nitems - 1, sub);
+}
 
-	case AB_NODE:
-		ab_delFromNode(lo);
-		break;
 
-	case AB_BRANCH:
-		ab_delFromBranch(lo);
-		break;
+static void ab_bulkPush(ab_Bulk *bk, int c)
+{
+	ab_BulkItem *item;
 
-	default:
-		ea_fatal("ab_set: unexpected kind");
-		return NULL;
+	if (bk->nitems == bk->itemsize) {
+		int size = bk->itemsize * 2;
+		bk->items = ea_resizeArray(ab_BulkItem, bk->itemsize, size,
+		                           bk->items);
+		bk->itemsize = size;
 	}
 
-	lo->status = AB_LKUP_UNSYNC;
+	item = bk->items + bk->nitems++;
+	item->letter = c;
+	item->flag = AB_ITEM_ON;
+	item->count = 0;
+	item->value = NULL;
+	item->sub = NULL;
+}
 
-	return r;
+
+void ab_bulkStart(ab_Bulk *bk, ab_Trie *trie)
+{
+	if (!ab_empty(trie) || ab_readOnly(trie))
+		ea_fatal("ab_bulkStart: trie is not empty");
+
+	bk->trie = trie;
+	bk->itemsize = 64;
+	bk->nitems = 0;
+	bk->items = ea_allocArray(ab_BulkItem, bk->itemsize);
+
+	bk->keysize = 64;
+	bk->len = 0;
+	bk->key = ea_allocArray(char, bk->keysize);
+	/* start[d] for d in [0, keysize] */
+	bk->start = ea_allocArray(int, bk->keysize + 1);
+	bk->start[0] = 0;
+
+	bk->chain.depth = AB_BULK_NOCHAIN;
 }
 
 
-static ab_Wood* ab_firstNode(ab_Look *lo, ab_Wood *w, int *letter, int bottom)
+/*
+ * Add a key: return false (and add nothing) if the key is empty or not
+ * greater than the previous one.
+ */
+int ab_bulkAdd(ab_Bulk *bk, char *key, int len, void *value)
 {
-	ab_Node *node = (ab_Node*)w;
-	ab_NodeItem* item = node->items + 0;
+	int l, d;
 
-	if (bottom)
-		item += node->size - 1;
+	if (len <= 0)
+		return false;
 
-	ab_loCurrent(lo)->at.item = item;
+	l = ab_matchLen(bk->key, key, AB_MIN(bk->len, len));
 
-	AB_D printf("ab_first: kind=node\n");
+	if (l == len)
+		return false;
 
-	assert(node->size > 0);
-	assert(item->flag & AB_ITEM_ON);
-	assert(item->flag & (AB_ITEM_VAL | AB_ITEM_SUB));
+	if (l < bk->len && (uint8_t)key[l] < (uint8_t)bk->key[l])
+		return false;
 
-	AB_D printf("ab_first: node '%c'\n", item->letter);
+	for (d = bk->len - 1; d >= l; d--)
+		ab_bulkClose(bk, d);
 
-	*letter = item->letter;
+	/* the item at depth l get a sibling: its chain can't grow anymore */
+	if (bk->chain.depth == l)
+		ab_bulkSetSub(bk->items + bk->nitems - 1, ab_bulkChain(bk));
 
-	if (item->flag & AB_ITEM_SUB) {
-		w = node->subs[item->n];
-		ab_loStep(lo, w);
-	} else /* (item->flag & AB_ITEM_VAL)*/ {
-		w = NULL;
-	}
+	assert(bk->chain.depth == AB_BULK_NOCHAIN);
 
-	return w;
-}
+	if (len > bk->keysize) {
+		int size = AB_MAX(len, bk->keysize * 2);
+		bk->key = ea_resizeArray(char, bk->keysize, size, bk->key);
+		bk->start = ea_resizeArray(int, bk->keysize + 1, size + 1,
+		                           bk->start);
+		bk->keysize = size;
+	}
 
+	for (d = l; d < len; d++) {
+		if (d > l)
+			bk->start[d] = bk->nitems;
+		ab_bulkPush(bk, (uint8_t)key[d]);
+	}
 
-static ab_Wood* ab_firstBranch(ab_Look *lo, ab_Wood *w)
-{
-	ab_Branch *b = (ab_Branch*)w;
+	bk->start[len] = bk->nitems;
 
-	assert(b->sub || (b->flag & AB_BRANCH_VAL));
+	bk->items[bk->nitems - 1].flag |= AB_ITEM_VAL;
+	bk->items[bk->nitems - 1].count = 1;
+	bk->items[bk->nitems - 1].value = value;
 
-	AB_D printf("ab_first: branch '%.*s'\n", b->len, b->kdata);
+	memcpy(bk->key + l, key + l, len - l);
+	bk->len = len;
 
-	if (b->sub) {
-		w = b->sub;
-		ab_loStep(lo, w);
-	} else /* (b->flag & AB_BRANCH_VAL) */ {
-		w = NULL;
-	}
+	if (bk->trie->index)
+		ab_hashPut(bk->trie->index, key, len, value);
 
-	return w;
+	return true;
 }
 
 
-/*
- * ab_fist search the first (or last if `bottom` is true) element in the trie.
- *
- * The key of this element can be stored in an optional buffer `buf` of
- * size `buflen`. If the key is bigger of `buflen` it will be truncated.
- *
- * If `buf` is NULL `buflen` must be 0.
- *
- * The function return -1 if the trie is empty otherwise return the min
- * of key size and `buflen`.
- *
- */
-int ab_first(ab_Look *lo, ab_Trie *trie, char *buf, int buflen, int bottom)
+/* close all items and set the trie root */
+void ab_bulkEnd(ab_Bulk *bk)
 {
-	ab_Wood *w = trie->root;
-
-	/* lo->len is used as index */
-	ab_loSet(lo, trie, buf, 0);
-
-	if (lo->status == AB_LKUP_EMPTY)
-		return -1;
+	ab_Wood *root;
+	int d;
 
-	while(w) {
-		switch(ab_kind(w)) {
+	for (d = bk->len - 1; d >= 0; d--)
+		ab_bulkClose(bk, d);
 
-		case AB_NODE: {
-			int letter;
+	root = ab_bulkSub(bk, -1);
 
-			w = ab_firstNode(lo, w, &letter, bottom);
+	if (bk->chain.depth == -1)
+		root = ab_bulkChain(bk);
 
-			if (lo->len < buflen) {
-				lo->key[lo->len] = letter;
-				lo->len++;
-			}
+	bk->trie->root = root;
 
-			break;
-		}
+	if (bk->trie->shared)
+		ab_publish(bk->trie);
 
-		case AB_BRANCH: {
+	ea_freeArray(ab_BulkItem, bk->itemsize, bk->items);
+	ea_freeArray(char, bk->keysize, bk->key);
+	ea_freeArray(int, bk->keysize + 1, bk->start);
+}
 
-			if (lo->len < buflen) {
-				ab_Branch *b = (ab_Branch*)w;
-				int n = AB_MIN(buflen - lo->len, b->len);
 
-				memcpy(lo->key + lo->len, b->kdata, n);
-				lo->len += n;
-			}
 
-			w = ab_firstBranch(lo, w);
 
-			break;
-		}
+/*
+ *     SNAPSHOT  #SECTION
+ */
 
-		default:
-			ea_fatal("ab_set: unexpected kind");
-		}
-	}
+/*
+ * Image layout (host byte order, every record 8 bytes aligned):
+ *
+ *   ab_SnapHeader
+ *   woods in depth first order: a wood is followed by the records of its
+ *   values and then by its subs, so offsets always point forward.
+ *
+ * A value record is a uint32_t length followed by the data.
+ */
 
-	lo->ipos = lo->len - 1;
-	lo->status = AB_LKUP_FOUND;
-	return lo->len;
-}
+#define AB_SNAP_MAGIC "ABTRIE01"
+#define AB_SNAP_ORDER 0x01020304
 
+typedef struct {
+	char magic[8];
+	uint32_t order;
+	uint32_t count;
+	uint64_t size;
+	uint64_t root;
+} ab_SnapHeader;
 
 
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+	ab_SnapValueFn fn;
+} ab_SnapBuf;
 
 
-static void ab_startFrom(ab_Cursor *c, ab_Wood *wood)
+static size_t ab_snapAlloc(ab_SnapBuf *sb, size_t n)
 {
-	c->wood = wood;
+	size_t pos = sb->len;
 
-	switch(ab_kind(wood)) {
+	n = (n + 7) & ~(size_t)7;
 
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)wood;
-		c->at.item = ab_nodeGet(node, ab_nodeFrom(node));
-		break;
-	}
+	if (sb->len + n > sb->size) {
+		size_t size = AB_MAX(sb->size * 2, sb->len + n);
 
-	case AB_BRANCH:
-		c->at.brpos = 0;
-		break;
+		sb->data = ea_reallocMem(sb->data, sb->size, size);
+		sb->size = size;
 	}
+
+	memset(sb->data + pos, 0, n);
+	sb->len += n;
+
+	return pos;
 }
 
 
-int ab_start(ab_Trie *trie, ab_Cursor* c)
+static uint32_t ab_snapOffset(size_t from, size_t to)
 {
-	if (!trie->root)
-		return false;
+	size_t off = (to - from) / 8;
 
-	ab_startFrom(c, trie->root);
+	if (off > UINT32_MAX)
+		ea_fatal("ab_snapWrite: offset overflow");
 
-	return true;
+	return off;
 }
 
 
-int ab_letter(ab_Cursor *c)
+static size_t ab_snapValueRecord(ab_SnapBuf *sb, void *value)
 {
-	switch(ab_kind(c->wood)) {
+	char tmp[AB_SNAP_TMP];
+	int len;
+	char *data = sb->fn(value, &len, tmp);
+	size_t pos = ab_snapAlloc(sb, sizeof(uint32_t) + len);
 
-	case AB_NODE:
-		assert(c->at.item);
-		return c->at.item->letter;
-
-	case AB_BRANCH:
-		assert(c->at.brpos < ((ab_Branch*)c->wood)->len);
-		return ((ab_Branch*)c->wood)->kdata[c->at.brpos];
-	}
+	*(uint32_t*)(sb->data + pos) = len;
+	memcpy(sb->data + pos + sizeof(uint32_t), data, len);
 
-	return 0;
+	return pos;
 }
 
-int ab_value(ab_Cursor *c, void **value)
-{
-	if (!c->wood)
-		return false;
 
+static size_t ab_snapPut(ab_SnapBuf *sb, ab_Wood *w);
 
-	switch(ab_kind(c->wood)) {
 
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)c->wood;
-		ab_NodeItem *item = c->at.item;
+/* sb->data can move on every alloc: refer the node by position */
+#define AB_SNAP_REFS(sb, pos, head) ((uint32_t*)((sb)->data + (pos) + (head)))
 
-		assert(item->flag & AB_ITEM_ON);
+static size_t ab_snapNode(ab_SnapBuf *sb, ab_Node *node)
+{
+	int n = node->size;
+	size_t head = (sizeof(ab_Node) + 2 * n + 3) & ~(size_t)3;
+	size_t pos = ab_snapAlloc(sb, head + 2 * n * sizeof(uint32_t));
+	ab_NodeF *f = (ab_NodeF*)(sb->data + pos);
+	int i, j;
+
+	f->node.flag = AB_NODE | AB_FROZEN;
+	f->node.kind = AB_NODEF;
+	f->node.size = n;
+	f->node.count = node->count;
+
+	for (i = ab_nodeFirst(node), j = 0; i != -1; i = ab_nodeNext(node, i), j++) {
+		f->keys[j] = ab_nodeLetter(node, i);
+		f->keys[n + j] = ab_nodeFlags(node)[i];
+	}
 
-		if (!(item->flag & AB_ITEM_VAL))
-			return false;
+	assert(j == n);
 
-		if (value)
-			*value = node->values[item->v];
+	for (i = ab_nodeFirst(node), j = 0; i != -1; i = ab_nodeNext(node, i), j++) {
+		if (ab_nodeFlags(node)[i] & AB_ITEM_VAL) {
+			size_t v = ab_snapValueRecord(sb, ab_nodeValue(node, i));
+			AB_SNAP_REFS(sb, pos, head)[n + j] = ab_snapOffset(pos, v);
+		}
+	}
 
-		return true;
+	for (i = ab_nodeFirst(node), j = 0; i != -1; i = ab_nodeNext(node, i), j++) {
+		if (ab_nodeFlags(node)[i] & AB_ITEM_SUB) {
+			size_t sub = ab_snapPut(sb, ab_nodeSub(node, i));
+			AB_SNAP_REFS(sb, pos, head)[j] = ab_snapOffset(pos, sub);
+		}
 	}
 
-	case AB_BRANCH: {
-		ab_Branch *b = (ab_Branch*)c->wood;
+	return pos;
+}
 
-		if (c->at.brpos != b->len - 1)
-			return false;
+#undef AB_SNAP_REFS
 
-		if (!(b->flag & AB_BRANCH_VAL))
-			return false;
 
-		if (value)
-			*value = b->value;
+static size_t ab_snapBranch(ab_SnapBuf *sb, ab_Branch *b)
+{
+	size_t pos = ab_snapAlloc(sb, sizeof(ab_BranchF) + b->len);
+	ab_BranchF *f = (ab_BranchF*)(sb->data + pos);
 
-		return true;
+	f->flag = AB_BRANCH | AB_FROZEN | (b->flag & AB_BRANCH_VAL);
+	f->len = b->len;
+	f->count = b->count;
+	memcpy(f->key, ab_branchKey(b), b->len);
+
+	if (b->flag & AB_BRANCH_VAL) {
+		size_t v = ab_snapValueRecord(sb, ab_branchValue(b));
+		((ab_BranchF*)(sb->data + pos))->value = ab_snapOffset(pos, v);
 	}
 
+	if (ab_branchSub(b)) {
+		size_t sub = ab_snapPut(sb, ab_branchSub(b));
+		((ab_BranchF*)(sb->data + pos))->sub = ab_snapOffset(pos, sub);
 	}
 
-	return false;
+	return pos;
 }
 
 
-int ab_choices(ab_Cursor *c, char *array)
+static size_t ab_snapPut(ab_SnapBuf *sb, ab_Wood *w)
 {
-	switch(ab_kind(c->wood)) {
-
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)c->wood;
-		int i, n = 0;
-		for (i = 0; i < node->size; i++) {
-			ab_NodeItem* item = node->items + i;
-
-			if (item->flag & AB_ITEM_ON) {
-				if (array)
-					array[n] = item->letter;
-				n++;
-			}
-		}
+	switch(ab_kind(w)) {
 
-		return n;
-	}
+	case AB_NODE:
+		return ab_snapNode(sb, (ab_Node*)w);
 
 	case AB_BRANCH:
-		if (array) {
-			ab_Branch *b = (ab_Branch*)c->wood;
-			array[0] = b->kdata[c->at.brpos];
-		}
+		return ab_snapBranch(sb, (ab_Branch*)w);
 
-		return 1;
+	default:
+		ea_fatal("ab_snapPut: unexpected kind");
+		return 0;
 	}
-
-	return -1;
 }
 
 
 /*
- * TODO
- * AB_SWITCH_BEGIN(c->wood)
- * AB_SWITCH_END
+ * Write the snapshot image of `trie` in `filename`, the data of every
+ * value is given by `fn`. Return false on I/O error (see errno).
  */
-
-int ab_seek(ab_Cursor *c, int letter)
+int ab_snapWrite(ab_Trie *trie, const char *filename, ab_SnapValueFn fn)
 {
-	switch(ab_kind(c->wood)) {
+	ab_SnapBuf sb = {NULL, 0, 0, fn};
+	ab_SnapHeader *h;
+	size_t root = 0;
+	FILE *f;
+	int ok;
 
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)c->wood;
-		ab_NodeItem *item = ab_nodeGet(node, letter);
+	ab_snapAlloc(&sb, sizeof(ab_SnapHeader));
 
-		if (!item)
-			return false;
+	if (trie->root)
+		root = ab_snapPut(&sb, trie->root);
 
-		if (!(item->flag & AB_ITEM_ON))
-			return false;
+	h = (ab_SnapHeader*)sb.data;
+	memcpy(h->magic, AB_SNAP_MAGIC, sizeof(h->magic));
+	h->order = AB_SNAP_ORDER;
+	h->count = ab_count(trie);
+	h->size = sb.len;
+	h->root = root;
 
+	f = fopen(filename, "wb");
+	ok = f && (fwrite(sb.data, 1, sb.len, f) == sb.len);
 
-		c->at.item = item;
+	if (f && fclose(f))
+		ok = false;
 
-		return true;
-	}
+	ea_freeMem(sb.size, sb.data);
 
-	case AB_BRANCH: {
-		ab_Branch *b = (ab_Branch*)c->wood;
-		return b->kdata[c->at.brpos] == letter;
-	}
-	}
-	return false;
+	return ok;
 }
 
 
-int ab_seekNext(ab_Cursor *c)
+/*
+ * Map a snapshot image as a read only trie (close it with ab_snapClose).
+ * Return NULL on error (see errno, EINVAL for a bad image).
+ */
+ab_Trie* ab_snapOpen(const char *filename)
 {
-	switch(ab_kind(c->wood)) {
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)c->wood;
-		ab_NodeItem *item = c->at.item;
-		int to = ab_nodeTo(node);
-		int i = item->letter + 1;
-
-		if (i > to)
-			return false;
+	ab_SnapHeader *h;
+	ab_Trie *trie;
+	struct stat st;
+	void *map;
+	int fd = open(filename, O_RDONLY);
 
-		for (; i <= to; i++) {
-			item = ab_nodeGet(node, i);
-			if (item->flag & AB_ITEM_ON) {
-				c->at.item = item;
-				return true;
-			}
-		}
+	if (fd == -1)
+		return NULL;
 
-		assert(true);
-	}
-	case AB_BRANCH: {
-		return false;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
 	}
+
+	if ((size_t)st.st_size < sizeof(ab_SnapHeader)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
 	}
-	return false;
-}
 
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
 
-/*
- * Try to go forward in the trie from the cursor position `c` and
- * save the next cursor position (if exists) in `nxt`.
- *
- * Return true if exists a next cursor position.
- *
- * If the pointer `nxt` is NULL the function only probe
- * the existence of next cursor position.
- *
- * To move a cursor instead of create a next cursor use
- * the same pointer for `c` and `nxt`.
- *
- */
-int ab_next(ab_Cursor *nxt, ab_Cursor *c)
-{
-	assert(c->wood);
+	if (map == MAP_FAILED)
+		return NULL;
 
-	AB_D printf("ab_next...\n");
-	AB_D ab_printWood(c->wood, 4, false);
+	h = (ab_SnapHeader*)map;
 
-	switch(ab_kind(c->wood)) {
-	case AB_NODE: {
-		ab_Node *node = (ab_Node*)c->wood;
-		ab_NodeItem *item = c->at.item;
+	if (memcmp(h->magic, AB_SNAP_MAGIC, sizeof(h->magic)) ||
+	    (h->order != AB_SNAP_ORDER) || (h->size != (uint64_t)st.st_size) ||
+	    (h->root >= h->size)) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
 
-		assert(item->flag & AB_ITEM_ON);
+	trie = ab_new();
+	trie->root = (h->root) ? (ab_Wood*)((char*)map + h->root) : NULL;
+	trie->map = map;
+	trie->mapsize = st.st_size;
 
-		if (!(item->flag & AB_ITEM_SUB))
-			return false;
+	return trie;
+}
 
-		AB_D printf("ab_next...(node) have next!\n");
-		AB_D ab_printNodeItem(item, 4);
 
-		if (nxt)
-			ab_startFrom(nxt, node->subs[item->n]);
+void ab_snapClose(ab_Trie *trie)
+{
+	assert(trie->map);
 
-		return true;
-	}
+	if (trie->index)
+		ab_hashFree(trie->index);
 
-	case AB_BRANCH: {
-		ab_Branch *b = (ab_Branch*)c->wood;
+	munmap(trie->map, trie->mapsize);
+	ea_free(ab_Trie, trie);
+}
 
-		if (c->at.brpos < (b->len-1)) {
-			if (nxt) {
-				nxt->wood = c->wood;
-				nxt->at.brpos = c->at.brpos + 1;
-			}
-			AB_D printf("ab_next...(branch) have next (inside)!\n");
-			return true;
-		}
 
-		if (!b->sub)
-			return false;
+int ab_readOnly(ab_Trie *trie)
+{
+	return trie->map != NULL;
+}
 
-		AB_D printf("ab_next...(branch) have next!\n");
-		if (nxt)
-			ab_startFrom(nxt, b->sub);
-		return true;
-	}
-	default:
-		ea_fatal("ab_interNext: unexpected wood kind");
-		return false;
-	}
+
+int ab_isSnapValue(void *value)
+{
+	return ((uintptr_t)value & 3) == AB_SNAP_TAG;
 }
 
 
+char* ab_snapValue(void *value, int *len)
+{
+	char *rec = (char*)((uintptr_t)value & ~(uintptr_t)AB_SNAP_TAG);
 
+	*len = *(uint32_t*)rec;
 
+	return rec + sizeof(uint32_t);
+}
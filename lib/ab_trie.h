@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "ea.h"
+#include "ab_hash.h"
 
 
 #ifndef AB_DEBUG
@@ -40,11 +41,29 @@
 #endif
 
 
+/*
+ * Node scan kernels: 0 = scalar, 1 = SSE2, 2 = AVX2. By default use the
+ * best instruction set enabled in the compiler (e.g. -mavx2).
+ */
+#ifndef AB_SIMD
+	#if defined(__AVX2__)
+		#define AB_SIMD 2
+	#elif defined(__SSE2__)
+		#define AB_SIMD 1
+	#else
+		#define AB_SIMD 0
+	#endif
+#endif
+
+
 #define AB_NODE 1
 #define AB_BRANCH 2
 
 #define AB_BRANCH_VAL 4
 
+/* wood stored in a read-only snapshot image (see SNAPSHOT) */
+#define AB_FROZEN 8
+
 
 #define AB_ITEM_OFF    0
 #define AB_ITEM_ON     1
@@ -53,6 +72,7 @@
 #define AB_ITEM_MASK   (AB_ITEM_ON | AB_ITEM_VAL | AB_ITEM_SUB)
 
 #define AB_MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define AB_MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 enum {
 	/* lookup initialized but not performed */
@@ -88,67 +108,205 @@ enum {
 
 
 
+/*
+ * Node kinds: a node stores its items in one of four layouts, chosen by
+ * the number of active items and converted automatically on insert and
+ * delete:
+ *
+ * AB_NODE4, AB_NODE16: up to 4 (16) items with letters sorted in `keys`
+ * AB_NODE48:           up to 48 items located through `index` (letter ->
+ *                      slot + 1, 0 = no item)
+ * AB_NODE256:          one slot for every possible letter
+ *
+ * Every node kind is a single allocation.
+ *
+ * AB_NODEF:            node of a snapshot image (ab_NodeF), read only
+ */
+#define AB_NODE4   0
+#define AB_NODE16  1
+#define AB_NODE48  2
+#define AB_NODE256 3
+#define AB_NODEF   4
+
+
 typedef struct {
 	uint8_t flag;
-	char letter;
-	uint8_t n;
-	uint8_t v;
-} ab_NodeItem;
-
+} ab_Wood;
 
 
+typedef struct {
+	ab_Wood *sub;
+	void *value;
+} ab_NodeItem;
 
 
-typedef struct {
-	uint8_t flag;
-} ab_Wood;
+/*
+ * Branch key: labels up to AB_BRANCH_INLINE bytes are stored inside the
+ * branch (`key.data`), longer ones in a separate buffer (`key.ptr`).
+ */
+#ifndef AB_BRANCH_INLINE
+	#define AB_BRANCH_INLINE 16
+#endif
 
+/*
+ * Every node and branch keep `count`: the number of keys stored in its
+ * subtree (its own values included).
+ */
 
 typedef struct {
 	uint8_t flag;
 	int len;
-	char* kdata;
+	uint32_t count;
 	void *value;
 	void *sub;
+	union {
+		char *ptr;
+		char data[AB_BRANCH_INLINE];
+	} key;
 } ab_Branch;
 
 
 typedef struct {
 	uint8_t flag;
-	uint8_t size;
-	uint8_t nsize;
-	uint8_t vsize;
-	ab_NodeItem *items;
-	ab_Wood **subs;
-	void **values;
+	uint8_t kind;
+	uint16_t size;
+	uint32_t count;
 } ab_Node;
 
 
+typedef struct {
+	ab_Node node;
+	uint8_t keys[4];
+	uint8_t flags[4];
+	ab_NodeItem items[4];
+} ab_Node4;
+
+
+typedef struct {
+	ab_Node node;
+	uint8_t keys[16];
+	uint8_t flags[16];
+	ab_NodeItem items[16];
+} ab_Node16;
+
+
+typedef struct {
+	ab_Node node;
+	uint8_t index[256];
+	uint8_t keys[48];
+	uint8_t flags[48];
+	ab_NodeItem items[48];
+} ab_Node48;
+
+
+typedef struct {
+	ab_Node node;
+	uint8_t flags[256];
+	ab_NodeItem items[256];
+} ab_Node256;
+
+
+/*
+ * Snapshot woods (flag AB_FROZEN) have no pointers: subs and values are
+ * referenced by offsets, in 8 bytes units, from the start of the wood
+ * (0 = none).
+ *
+ * ab_NodeF:   `size` sorted letters followed by their flags, then (4 bytes
+ *             aligned) `size` sub offsets and `size` value offsets.
+ * ab_BranchF: same leading fields of ab_Branch, the label follow.
+ */
+
+typedef struct {
+	ab_Node node;
+	uint8_t keys[];
+} ab_NodeF;
+
+
+typedef struct {
+	uint8_t flag;
+	int len;
+	uint32_t count;
+	uint32_t value;
+	uint32_t sub;
+	char key[];
+} ab_BranchF;
+
+
+/*
+ * Shared trie: one writer thread and many reader threads (see ab_share).
+ *
+ * The writer never changes a wood that readers can reach: ab_set and
+ * ab_del copy the woods of the lookup path, change the copies and then
+ * publish the new root. Replaced woods (and values passed to ab_retire)
+ * are freed only when every reader that could see them has left its
+ * read section (epoch based reclamation).
+ */
+#ifndef AB_READERS
+	#define AB_READERS 64
+#endif
+
+typedef struct {
+	/* 0 = free slot */
+	uint32_t used;
+	/* epoch seen by a reader inside a read section (0 = outside) */
+	uint64_t epoch;
+	/* keep every slot in its own cache line */
+	char pad[48];
+} ab_Reader;
+
+typedef struct {
+	uint64_t epoch;
+	void (*fn)(void *ptr);
+	void *ptr;
+} ab_Retired;
+
+typedef struct {
+	ab_Reader readers[AB_READERS];
+	uint64_t epoch;
+
+	/* retired[head..len] wait to be freed (in epoch order) */
+	ab_Retired *retired;
+	int head;
+	int len;
+	int size;
+} ab_Shared;
+
+
+/*
+ * A trie opened by ab_snapOpen is read only: `map` is the memory mapped
+ * image (NULL for a normal trie).
+ *
+ * `root` is the writer root, readers of a shared trie use `pub` (the
+ * last published root) through ab_readBegin.
+ *
+ * `index` is the optional exact match index (see ab_indexOn).
+ */
 typedef struct {
 	ab_Wood *root;
+	void *map;
+	size_t mapsize;
+	ab_Wood *pub;
+	ab_Shared *shared;
+	ab_Hash *index;
 } ab_Trie;
 
 
 
 
 
-/* TODO
- * an integer can be used in place of at.item to locate the nodeitem in
- * the node. The union at.{brpos, item} can be replace by a single int index;
- *
+/*
+ * A cursor locate a position inside a wood: for a node `at` is the item
+ * slot (-1 = no item), for a branch `at` is the char position.
  */
 
 typedef struct {
 	ab_Wood *wood;
-	union {
-		ab_NodeItem *item;
-		int brpos;
-	} at;
+	int at;
 } ab_Cursor;
 
 
 /* TODO
- * lo.bpos can be removed, cursors.at.brpos can be used instead
+ * lo.bpos can be removed, cursors.at can be used instead
  */
 
 typedef struct {
@@ -163,11 +321,124 @@ typedef struct {
 
 	int ipath;
 	ab_Cursor path[3];
+
+	/* lookup by ab_first: 0 = no, 1 = first, 2 = last */
+	int edge;
 } ab_Look;
 
 
 
 
+/*
+ * Bulk load: build a trie bottom-up from keys added in strictly increasing
+ * (unsigned byte) order. Only the items of the last added key are kept
+ * open. A node or branch is allocated once with its final size when the
+ * next key leaves it.
+ */
+
+typedef struct {
+	uint8_t letter;
+	uint8_t flag;
+	uint32_t count;
+	void *value;
+	ab_Wood *sub;
+} ab_BulkItem;
+
+typedef struct {
+	/* depth of the item whose sub is a still open branch (chain) */
+	int depth;
+	/* depth of the last chain char (the branch value/sub) */
+	int end;
+	int flag;
+	uint32_t count;
+	void *value;
+	ab_Wood *sub;
+} ab_BulkChain;
+
+typedef struct {
+	ab_Trie *trie;
+
+	/* open items of every depth: items[start[d]..] are at depth d */
+	ab_BulkItem *items;
+	int nitems;
+	int itemsize;
+	int *start;
+
+	/* last added key */
+	char *key;
+	int len;
+	int keysize;
+
+	ab_BulkChain chain;
+} ab_Bulk;
+
+
+/*
+ * Clear: the woods and the index are detached from the trie (that is
+ * empty at once) and freed in slices of at most `budget` woods for every
+ * ab_clearStep. In a shared trie the slices are freed only when the
+ * readers that can reach the detached woods have left (ab_clearWaiting).
+ * ab_clearAdd empties the trie again while the clear is running (the
+ * woods detached then are freed by the same steps).
+ */
+
+typedef void (*ab_ValueFn)(void *value);
+
+typedef struct {
+	ab_Trie *trie;
+	ab_ValueFn fn;
+
+	/* detached woods to free */
+	ab_Wood **woods;
+	int len;
+	int size;
+
+	/* detached indexes, the last is freed from slot `pos` */
+	ab_Hash **index;
+	int nindex;
+	int indexsize;
+	uint32_t pos;
+
+	/* shared trie: readers begun before this epoch can still reach the
+	   detached woods (0 = not shared) */
+	uint64_t epoch;
+
+	size_t freed;   /* freed woods */
+} ab_Clear;
+
+
+/*
+ * Defragmentation: the woods are moved in depth first order to adjacent
+ * packed blocks (see ea_allocPacked), at most `budget` woods for every
+ * ab_defragStep. The trie can be changed between two steps: the position
+ * is kept as the key prefix of the next wood to move.
+ *
+ * In a shared trie a step moves nothing while a reader is in a read
+ * section (see ab_defragWaiting): the readers must begin their sections
+ * in the writer thread while a pass is running.
+ */
+
+typedef struct {
+	ab_Trie *trie;
+
+	/* prefix of the next wood to move */
+	char *next;
+	int len;
+
+	/* walk stack and key of a step */
+	ab_Cursor *stack;
+	char *key;
+	int size;
+
+	int started;
+	int done;
+
+	size_t woods;   /* moved woods */
+	size_t bytes;   /* moved bytes */
+} ab_Defrag;
+
+
+
 void ab_printWood(ab_Wood *w, int indent, int recursive);
 void ab_printKeys(ab_Wood *w, int indent);
 void ab_printSearch(ab_Look *lo);
@@ -177,6 +448,16 @@ ab_Trie* ab_new();
 void ab_free(ab_Trie* trie);
 int ab_empty(ab_Trie *trie);
 
+/* remove every key (`fn` is called for every value) */
+void ab_clear(ab_Trie *trie, ab_ValueFn fn);
+void ab_destroy(ab_Trie *trie, ab_ValueFn fn);
+
+void ab_clearStart(ab_Clear *cl, ab_Trie *trie, ab_ValueFn fn);
+void ab_clearAdd(ab_Clear *cl);
+int ab_clearStep(ab_Clear *cl, int budget);
+int ab_clearWaiting(ab_Clear *cl);
+void ab_clearEnd(ab_Clear *cl);
+
 
 void ab_loSet(ab_Look *lo, ab_Trie *trie, char *key, int len);
 int ab_loNext(ab_Look *lo);
@@ -190,14 +471,82 @@ void* ab_set(ab_Look *lo, void *val);
 void* ab_del(ab_Look *lo);
 
 
+/* exact match index */
+void ab_indexOn(ab_Trie *trie);
+int ab_lookup(ab_Trie *trie, char *key, int len, void **value);
+
+
+/* subtree counts */
+uint32_t ab_count(ab_Trie *trie);
+uint32_t ab_countPrefix(ab_Trie *trie, char *prefix, int len);
+uint32_t ab_rank(ab_Trie *trie, char *key, int len);
+int ab_select(ab_Trie *trie, char *prefix, int plen, uint32_t n,
+              char *buf, int buflen, void **value);
+
+
+/* shared trie: one writer, many lock free readers */
+void ab_share(ab_Trie *trie);
+int ab_isShared(ab_Trie *trie);
+int ab_readerJoin(ab_Trie *trie);
+void ab_readerLeave(ab_Trie *trie, int id);
+void ab_readBegin(ab_Trie *trie, int id, ab_Trie *view);
+void ab_readEnd(ab_Trie *trie, int id);
+void ab_retire(ab_Trie *trie, void (*fn)(void *ptr), void *ptr);
+void ab_reclaim(ab_Trie *trie);
+
+
 /* cursor */
 int ab_start(ab_Trie *trie, ab_Cursor* c);
 int ab_letter(ab_Cursor *c);
+int ab_edge(ab_Cursor *c, const uint8_t **letters);
+uint32_t ab_cursorCount(ab_Cursor *c);
 int ab_value(ab_Cursor *c, void **value);
 int ab_choices(ab_Cursor *c, char *array);
 int ab_seek(ab_Cursor *c, int letter);
 int ab_seekNext(ab_Cursor *c);
+int ab_seekFrom(ab_Cursor *c, int letter);
 int ab_next(ab_Cursor *nxt, ab_Cursor *c);
 
 
+/* ordered scan */
+typedef int (*ab_ScanFn)(void *data, char *key, int len, void *value);
+
+int ab_scan(ab_Trie *trie, char *from, int fromlen, int after,
+            ab_ScanFn fn, void *data);
+
+
+/* bulk load */
+void ab_bulkStart(ab_Bulk *bk, ab_Trie *trie);
+int ab_bulkAdd(ab_Bulk *bk, char *key, int len, void *value);
+void ab_bulkEnd(ab_Bulk *bk);
+
+
+/* defragmentation (not for read only tries) */
+void ab_defragStart(ab_Defrag *df, ab_Trie *trie);
+int ab_defragStep(ab_Defrag *df, int budget);
+int ab_defragWaiting(ab_Defrag *df);
+void ab_defragEnd(ab_Defrag *df);
+
+
+/*
+ * Snapshot: values are stored as records (uint32_t length + data) and
+ * the value pointers returned by a snapshot trie are tagged with
+ * AB_SNAP_TAG (use ab_snapValue to read them).
+ *
+ * ab_SnapValueFn return the data of a value to save and its length in
+ * `len`; it can use `tmp` (AB_SNAP_TMP bytes) as storage.
+ */
+#define AB_SNAP_TAG 2
+#define AB_SNAP_TMP 16
+
+typedef char* (*ab_SnapValueFn)(void *value, int *len, char *tmp);
+
+int ab_snapWrite(ab_Trie *trie, const char *filename, ab_SnapValueFn fn);
+ab_Trie* ab_snapOpen(const char *filename);
+void ab_snapClose(ab_Trie *trie);
+int ab_readOnly(ab_Trie *trie);
+int ab_isSnapValue(void *value);
+char* ab_snapValue(void *value, int *len);
+
+
 #endif
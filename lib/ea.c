@@ -23,7 +23,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "ea.h"
 
@@ -61,31 +64,536 @@ void ea_pfatal(char const *m, ...)
 
 /*---------------------------------------------------------------------------
  *  MEMORY TOOL
+ *
+ *  Blocks up to EA_SLAB_MAXOBJ bytes are rounded to a size class and served
+ *  from the class free list. An empty free list is refilled by carving a
+ *  new slab (EA_SLAB_SIZE bytes from malloc) in blocks of the class size.
+ *  Freed blocks return to their class free list. Bigger blocks are always
+ *  served by malloc.
+ *
+ *  ea_allocPacked carves blocks (of the class size) one after the other in
+ *  a pack region of EA_PACK_SIZE bytes, whatever their class: consecutive
+ *  packed allocations are adjacent in memory. A packed block is freed as
+ *  any other block (to its class free list).
+ *
+ *  Slabs and pack regions are released to the system only by ea_trim,
+ *  when all their blocks are free.
+ *
+ *  The allocator is not thread safe: while other threads can use it
+ *  (between ea_memShared(true) and the matching ea_memShared(false), see
+ *  ea_poolRun and ea_queuePush) every call holds ea_memMutex.
  *  -----------------------------------------------------------------------*/
 
-void *ea_allocMem(size_t n)
+static const size_t ea_classSize[] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	144, 160, 176, 192, 208, 224, 240, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+	1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096,
+	5120, 6144, 7168, 8192
+};
+
+#define EA_NCLASS ((int)(sizeof(ea_classSize) / sizeof(ea_classSize[0])))
+
+/* size in 16 byte units -> class */
+static uint8_t ea_classMap[EA_SLAB_MAXOBJ / 16 + 1];
+
+/* counters: one for every class plus one for blocks > EA_SLAB_MAXOBJ */
+static ea_MemClass ea_stat[EA_NCLASS + 1];
+
+static int ea_memReady = false;
+
+static pthread_mutex_t ea_memMutex = PTHREAD_MUTEX_INITIALIZER;
+/* ea_memShared(true) calls not yet closed */
+static int ea_memLocked = 0;
+
+static void ea_memFree(size_t n, void* ptr);
+
+#if EA_SLAB
+typedef struct ea_FreeBlock_ {
+	struct ea_FreeBlock_ *next;
+} ea_FreeBlock;
+
+static ea_FreeBlock* ea_freeList[EA_NCLASS];
+
+/* a slab (of class `cls`) or a pack region (cls = -1) */
+typedef struct {
+	char *base;
+	size_t size;   /* bytes from malloc */
+	size_t used;   /* bytes carved in blocks */
+	size_t free;   /* bytes of free blocks (only during ea_trim) */
+	int cls;
+} ea_Chunk;
+
+/* every slab and closed pack region, unordered (sorted by ea_trim) */
+static ea_Chunk *ea_chunks = NULL;
+static size_t ea_nchunks = 0;
+static size_t ea_chunksSize = 0;
+
+/* open pack region */
+static char *ea_pack = NULL;
+static size_t ea_packUsed = 0;
+static size_t ea_packs = 0;
+#endif
+
+
+static void ea_memInit()
+{
+	int i, c = 0;
+
+	for (i = 0; i <= EA_SLAB_MAXOBJ / 16; i++) {
+		while (ea_classSize[c] < (size_t)i * 16)
+			c++;
+
+		ea_classMap[i] = c;
+	}
+
+	for (i = 0; i < EA_NCLASS; i++)
+		ea_stat[i].size = ea_classSize[i];
+
+	ea_memReady = true;
+}
+
+
+static int ea_classOf(size_t n)
+{
+	if (!ea_memReady)
+		ea_memInit();
+
+	if (n > EA_SLAB_MAXOBJ)
+		return EA_NCLASS;
+
+	return ea_classMap[(n + 15) / 16];
+}
+
+
+static void ea_memCount(int c, size_t n, int inc)
 {
-	void *ptr = malloc(n);
+	if (inc > 0) {
+		ea_stat[c].live++;
+		ea_stat[c].bytes += n;
+	} else {
+		ea_stat[c].live--;
+		ea_stat[c].bytes -= n;
+	}
+}
+
+
+#if EA_SLAB
+static void ea_chunkAdd(char *base, size_t size, size_t used, int cls)
+{
+	ea_Chunk *k;
+
+	if (ea_nchunks == ea_chunksSize) {
+		size_t n = (ea_chunksSize) ? ea_chunksSize * 2 : 64;
+		ea_Chunk *chunks = realloc(ea_chunks, n * sizeof(ea_Chunk));
+
+		if (!chunks)
+			ea_fatal("out of mem");
+
+		ea_chunks = chunks;
+		ea_chunksSize = n;
+	}
+
+	k = ea_chunks + ea_nchunks++;
+	k->base = base;
+	k->size = size;
+	k->used = used;
+	k->free = 0;
+	k->cls = cls;
+}
+
+
+static void ea_slabNew(int c)
+{
+	size_t size = ea_classSize[c];
+	size_t i, n = EA_SLAB_SIZE / size;
+	char *slab = malloc(EA_SLAB_SIZE);
+
+	if (!slab)
+		ea_fatal("out of mem");
+
+	/* link blocks in address order */
+	for (i = 0; i < n; i++) {
+		ea_FreeBlock *b = (ea_FreeBlock*)(slab + i * size);
+		b->next = (i + 1 < n) ? (ea_FreeBlock*)(slab + (i + 1) * size)
+		                      : ea_freeList[c];
+	}
+
+	ea_freeList[c] = (ea_FreeBlock*)slab;
+	ea_stat[c].slabs++;
+	ea_chunkAdd(slab, EA_SLAB_SIZE, n * size, c);
+}
+
+
+/* register the open pack region (its unused tail is lost) */
+static void ea_packClose()
+{
+	if (!ea_pack)
+		return;
+
+	if (ea_packUsed) {
+		ea_chunkAdd(ea_pack, EA_PACK_SIZE, ea_packUsed, -1);
+	} else {
+		free(ea_pack);
+		ea_packs--;
+	}
+
+	ea_pack = NULL;
+	ea_packUsed = 0;
+}
+#endif
+
+
+static void *ea_memAlloc(size_t n)
+{
+	int c = ea_classOf(n);
+	void *ptr;
+
+#if EA_SLAB
+	if (c < EA_NCLASS) {
+		if (!ea_freeList[c])
+			ea_slabNew(c);
+
+		ptr = ea_freeList[c];
+		ea_freeList[c] = ea_freeList[c]->next;
+		ea_memCount(c, n, 1);
+
+		return ptr;
+	}
+#endif
+
+	ptr = malloc(n);
 
 	if (n && !ptr)
 		ea_fatal("out of mem");
 
+	ea_memCount(c, n, 1);
+
 	return ptr;
 }
 
-void *ea_reallocMem(void *ptr, size_t n)
+static void *ea_memPacked(size_t n)
 {
+#if EA_SLAB
+	int c = ea_classOf(n);
+
+	if (c < EA_NCLASS) {
+		size_t size = ea_classSize[c];
+		void *ptr;
+
+		if (!ea_pack || (ea_packUsed + size > EA_PACK_SIZE)) {
+			ea_packClose();
+
+			ea_pack = malloc(EA_PACK_SIZE);
+
+			if (!ea_pack)
+				ea_fatal("out of mem");
+
+			ea_packs++;
+		}
+
+		ptr = ea_pack + ea_packUsed;
+		ea_packUsed += size;
+		ea_memCount(c, n, 1);
+
+		return ptr;
+	}
+#endif
+
+	return ea_memAlloc(n);
+}
+
+
+static void *ea_memRealloc(void *ptr, size_t n0, size_t n)
+{
+	int c0, c;
+
+	if (!ptr)
+		return ea_memAlloc(n);
+
+	c0 = ea_classOf(n0);
+	c = ea_classOf(n);
+
+#if EA_SLAB
+	if ((c0 == c) && (c < EA_NCLASS)) {
+		/* same block */
+		ea_stat[c].bytes += n;
+		ea_stat[c].bytes -= n0;
+		return ptr;
+	}
+
+	if ((c0 < EA_NCLASS) || (c < EA_NCLASS)) {
+		void *dest = ea_memAlloc(n);
+
+		memcpy(dest, ptr, (n0 < n) ? n0 : n);
+		ea_memFree(n0, ptr);
+
+		return dest;
+	}
+#endif
+
 	ptr = realloc(ptr, n);
 
 	if (n && !ptr)
 		ea_fatal("out of mem");
 
+	ea_memCount(c0, n0, -1);
+	ea_memCount(c, n, 1);
+
 	return ptr;
 
 }
 
-void ea_freeMem(size_t n, void* ptr)
+static void ea_memFree(size_t n, void* ptr)
 {
+	int c;
+
+	if (!ptr)
+		return;
+
+	c = ea_classOf(n);
+	ea_memCount(c, n, -1);
+
+#if EA_SLAB
+	if (c < EA_NCLASS) {
+		ea_FreeBlock *b = ptr;
+		b->next = ea_freeList[c];
+		ea_freeList[c] = b;
+		return;
+	}
+#endif
+
 	free(ptr);
 }
 
+
+/*
+ * Lock the allocator while other threads can use it: the calls nest (the
+ * lock is dropped by the last ea_memShared(false)), only a thread that
+ * already uses the allocator with others can turn it shared (or the only
+ * thread that uses it).
+ */
+void ea_memShared(int on)
+{
+	__atomic_add_fetch(&ea_memLocked, (on) ? 1 : -1, __ATOMIC_SEQ_CST);
+}
+
+
+#define EA_LOCK(locked)                                                  \
+	if ((locked = __atomic_load_n(&ea_memLocked, __ATOMIC_RELAXED))) \
+		pthread_mutex_lock(&ea_memMutex)
+
+#define EA_UNLOCK(locked) if (locked) pthread_mutex_unlock(&ea_memMutex)
+
+void *ea_allocMem(size_t n)
+{
+	void *ptr;
+	int locked;
+
+	EA_LOCK(locked);
+	ptr = ea_memAlloc(n);
+	EA_UNLOCK(locked);
+
+	return ptr;
+}
+
+void *ea_allocPacked(size_t n)
+{
+	void *ptr;
+	int locked;
+
+	EA_LOCK(locked);
+	ptr = ea_memPacked(n);
+	EA_UNLOCK(locked);
+
+	return ptr;
+}
+
+void *ea_reallocMem(void *ptr, size_t n0, size_t n)
+{
+	int locked;
+
+	EA_LOCK(locked);
+	ptr = ea_memRealloc(ptr, n0, n);
+	EA_UNLOCK(locked);
+
+	return ptr;
+}
+
+void ea_freeMem(size_t n, void* ptr)
+{
+	int locked;
+
+	EA_LOCK(locked);
+	ea_memFree(n, ptr);
+	EA_UNLOCK(locked);
+}
+
+
+#if EA_SLAB
+static int ea_chunkCmp(const void *a, const void *b)
+{
+	const char *x = ((const ea_Chunk*)a)->base;
+	const char *y = ((const ea_Chunk*)b)->base;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+/* chunk of a block (ea_chunks must be sorted) */
+static ea_Chunk* ea_chunkOf(void *ptr)
+{
+	size_t lo = 0, hi = ea_nchunks;
+
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if ((char*)ptr < ea_chunks[mid].base)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	if (!ea_nchunks || ((char*)ptr < ea_chunks[lo].base) ||
+	    ((char*)ptr >= ea_chunks[lo].base + ea_chunks[lo].size))
+		ea_fatal("ea_chunkOf: block %p is not in a slab", ptr);
+
+	return ea_chunks + lo;
+}
+
+
+static int ea_chunkEmpty(ea_Chunk *k)
+{
+	return k->free == k->used;
+}
+#endif
+
+
+/*
+ * Release to the system every slab and pack region whose blocks are all
+ * free and return the released bytes. The open pack region is closed.
+ *
+ * The cost is linear in the number of free blocks: call it after a bulk
+ * of frees (for example after relocating a data structure with
+ * ea_allocPacked), not for every free.
+ */
+static size_t ea_memTrim()
+{
+	size_t released = 0;
+#if EA_SLAB
+	size_t i, j;
+	int c;
+
+	ea_packClose();
+
+	if (!ea_nchunks)
+		return 0;
+
+	qsort(ea_chunks, ea_nchunks, sizeof(ea_Chunk), ea_chunkCmp);
+
+	for (i = 0; i < ea_nchunks; i++)
+		ea_chunks[i].free = 0;
+
+	for (c = 0; c < EA_NCLASS; c++) {
+		ea_FreeBlock *b;
+
+		for (b = ea_freeList[c]; b; b = b->next)
+			ea_chunkOf(b)->free += ea_classSize[c];
+	}
+
+	/* unlink the blocks of empty chunks */
+	for (c = 0; c < EA_NCLASS; c++) {
+		ea_FreeBlock **b = ea_freeList + c;
+
+		while (*b) {
+			if (ea_chunkEmpty(ea_chunkOf(*b)))
+				*b = (*b)->next;
+			else
+				b = &(*b)->next;
+		}
+	}
+
+	for (i = j = 0; i < ea_nchunks; i++) {
+		ea_Chunk *k = ea_chunks + i;
+
+		if (!ea_chunkEmpty(k)) {
+			ea_chunks[j++] = *k;
+			continue;
+		}
+
+		if (k->cls >= 0)
+			ea_stat[k->cls].slabs--;
+		else
+			ea_packs--;
+
+		released += k->size;
+		free(k->base);
+	}
+
+	ea_nchunks = j;
+#endif
+
+	return released;
+}
+
+size_t ea_trim()
+{
+	size_t released;
+	int locked;
+
+	EA_LOCK(locked);
+	released = ea_memTrim();
+	EA_UNLOCK(locked);
+
+	return released;
+}
+
+
+int ea_memClasses()
+{
+	return EA_NCLASS + 1;
+}
+
+
+const ea_MemClass* ea_memClass(int i)
+{
+	if (!ea_memReady)
+		ea_memInit();
+
+	if ((i < 0) || (i > EA_NCLASS))
+		ea_fatal("ea_memClass: class %d out of range", i);
+
+	return ea_stat + i;
+}
+
+
+void ea_memPrint(FILE *stream)
+{
+	int i;
+
+	fprintf(stream, "%8s %10s %12s %6s\n", "class", "live", "bytes",
+	        "slabs");
+
+	for (i = 0; i <= EA_NCLASS; i++) {
+		const ea_MemClass *m = ea_memClass(i);
+
+		if (!m->live && !m->slabs)
+			continue;
+
+		if (m->size)
+			fprintf(stream, "%8zu", m->size);
+		else
+			fprintf(stream, "%8s", "large");
+
+		fprintf(stream, " %10zu %12zu %6zu\n", m->live, m->bytes,
+		        m->slabs);
+	}
+
+#if EA_SLAB
+	if (ea_packs)
+		fprintf(stream, "%8s %10s %12s %6zu\n", "packed", "", "",
+		        ea_packs);
+#endif
+}
@@ -24,14 +24,27 @@
 #ifndef __AE_BASE_LIB_H__
 #define __AE_BASE_LIB_H__
 
+#include <stdio.h>
 #include <stdlib.h>
 
 /*
  * char *s = ea_allocArray(char, 10);
- * s = ea_resizeArray(char, 20, s);
+ * s = ea_resizeArray(char, 10, 20, s);
  * ea_freeArray(char, 20, s)
+ *
+ * Every block must be freed (or resized) with the size used to allocate
+ * it: blocks up to EA_SLAB_MAXOBJ bytes are served by size-classed slabs
+ * (see ea.c). Build with EA_SLAB=0 to use libc malloc for everything.
  */
 
+#ifndef EA_SLAB
+	#define EA_SLAB 1
+#endif
+
+#define EA_SLAB_SIZE (64 * 1024)
+#define EA_SLAB_MAXOBJ 8192
+#define EA_PACK_SIZE (256 * 1024)
+
 #ifndef true
 	#define true 1
 #endif
@@ -49,12 +62,36 @@ void ea_pfatal(char const *m, ...);
 #define ea_free(s, ptr)       ea_freeMem(sizeof(s), (void*)(ptr))
 
 #define ea_allocArray(s, n)         ((s*)ea_allocMem(sizeof(s)*(n)))
-#define ea_resizeArray(s, n, ptr)   ((s*)ea_reallocMem((ptr), sizeof(s)*(n)))
+#define ea_resizeArray(s, n0, n, ptr)                                         \
+        ((s*)ea_reallocMem((ptr), sizeof(s)*(n0), sizeof(s)*(n)))
 #define ea_freeArray(s, n, ptr)     ea_freeMem(sizeof(s)*(n), (void*)ptr)
 
 void *ea_allocMem(size_t n);
-void *ea_reallocMem(void *ptr, size_t n);
+void *ea_reallocMem(void *ptr, size_t n0, size_t n);
 void ea_freeMem(size_t n, void* ptr);
 
+/* allocate adjacent to the previous packed block (see ea.c) */
+void *ea_allocPacked(size_t n);
+
+/* release empty slabs to the system, return the released bytes */
+size_t ea_trim();
+
+/* with true the allocator can be used by many threads (calls nest) */
+void ea_memShared(int on);
+
+
+/* allocator counters of a size class (the last class count blocks bigger
+   than EA_SLAB_MAXOBJ that are always served by malloc) */
+typedef struct {
+	size_t size;   /* block size of the class (0 for the last class) */
+	size_t live;   /* allocated blocks */
+	size_t bytes;  /* requested bytes of allocated blocks */
+	size_t slabs;  /* slabs owned by the class */
+} ea_MemClass;
+
+int ea_memClasses();
+const ea_MemClass* ea_memClass(int i);
+void ea_memPrint(FILE *stream);
+
 
 #endif
@@ -0,0 +1,466 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Fabio Sassi <fabio dot s81 at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef __linux__
+	#include <sys/eventfd.h>
+#endif
+
+#include "ea_pool.h"
+
+
+typedef struct {
+	ea_Pool *pool;
+	int id;
+} ea_PoolThread;
+
+struct ea_Pool_ {
+	/* threads 1..nthreads-1 (thread 0 is the caller of ea_poolRun) */
+	pthread_t *threads;
+	ea_PoolThread *args;
+	int nthreads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	/* held by the caller of a run */
+	pthread_mutex_t caller;
+
+	/* current run: generation, items and threads still working */
+	unsigned long run;
+	ea_PoolFn fn;
+	void *data;
+	int n;
+	int next;
+	int busy;
+	int quit;
+};
+
+
+static void ea_poolItems(ea_Pool *pool, int id)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	       pool->n)
+		pool->fn(pool->data, i, id);
+}
+
+
+static void* ea_poolThread(void *arg)
+{
+	ea_PoolThread *t = arg;
+	ea_Pool *pool = t->pool;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (;;) {
+		while ((!pool->quit) && (pool->run == seen))
+			pthread_cond_wait(&pool->start, &pool->mutex);
+
+		if (pool->quit)
+			break;
+
+		seen = pool->run;
+		pthread_mutex_unlock(&pool->mutex);
+
+		ea_poolItems(pool, t->id);
+
+		pthread_mutex_lock(&pool->mutex);
+
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+
+ea_Pool* ea_poolNew(int nthreads)
+{
+	ea_Pool *pool = ea_alloc(ea_Pool);
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	pool->nthreads = nthreads;
+	pool->threads = ea_allocArray(pthread_t, nthreads);
+	pool->args = ea_allocArray(ea_PoolThread, nthreads);
+	pool->run = 0;
+	pool->n = pool->next = pool->busy = 0;
+	pool->quit = false;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_mutex_init(&pool->caller, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 1; i < nthreads; i++) {
+		pool->args[i].pool = pool;
+		pool->args[i].id = i;
+
+		if (pthread_create(pool->threads + i, NULL, ea_poolThread,
+		                   pool->args + i))
+			ea_fatal("ea_poolNew: cannot create thread %d", i);
+	}
+
+	return pool;
+}
+
+
+void ea_poolFree(ea_Pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 1; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_mutex_destroy(&pool->caller);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+
+	ea_freeArray(pthread_t, pool->nthreads, pool->threads);
+	ea_freeArray(ea_PoolThread, pool->nthreads, pool->args);
+	ea_free(ea_Pool, pool);
+}
+
+
+int ea_poolThreads(ea_Pool *pool)
+{
+	return pool->nthreads;
+}
+
+
+void ea_poolRun(ea_Pool *pool, ea_PoolFn fn, void *data, int n)
+{
+	pthread_mutex_lock(&pool->caller);
+
+	if (pool->nthreads == 1) {
+		pool->fn = fn;
+		pool->data = data;
+		pool->n = n;
+		pool->next = 0;
+		ea_poolItems(pool, 0);
+		pthread_mutex_unlock(&pool->caller);
+		return;
+	}
+
+	ea_memShared(true);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->fn = fn;
+	pool->data = data;
+	pool->n = n;
+	pool->next = 0;
+	pool->busy = pool->nthreads - 1;
+	pool->run++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+
+	ea_poolItems(pool, 0);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	ea_memShared(false);
+
+	pthread_mutex_unlock(&pool->caller);
+}
+
+
+
+/*
+ *     JOB QUEUE
+ */
+
+typedef struct ea_QueueJob_ ea_QueueJob;
+
+struct ea_QueueJob_ {
+	ea_QueueFn fn;
+	void *data;
+	ea_QueueJob *next;
+};
+
+typedef struct {
+	ea_QueueJob *head;
+	ea_QueueJob *tail;
+} ea_QueueList;
+
+struct ea_Queue_ {
+	pthread_t *threads;
+	int nthreads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+
+	ea_QueueList pending;
+	ea_QueueList done;
+	int quit;
+
+	/* wake up fd: fd[0] is readable after a write on fd[1] (the same
+	   eventfd on Linux, a pipe elsewhere) */
+	int fd[2];
+};
+
+
+static void ea_listPush(ea_QueueList *l, ea_QueueJob *job)
+{
+	job->next = NULL;
+
+	if (l->tail)
+		l->tail->next = job;
+	else
+		l->head = job;
+
+	l->tail = job;
+}
+
+
+static ea_QueueJob* ea_listPop(ea_QueueList *l)
+{
+	ea_QueueJob *job = l->head;
+
+	if (job) {
+		l->head = job->next;
+
+		if (!l->head)
+			l->tail = NULL;
+	}
+
+	return job;
+}
+
+
+static void ea_queueWake(ea_Queue *q)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	if ((write(q->fd[1], &one, sizeof(one)) == -1) && (errno != EAGAIN))
+		ea_pfatal("ea_queueWake: write");
+#else
+	char one = 1;
+
+	/* a full pipe is readable anyway */
+	if ((write(q->fd[1], &one, 1) == -1) && (errno != EAGAIN))
+		ea_pfatal("ea_queueWake: write");
+#endif
+}
+
+
+/* empty the wake up fd */
+static void ea_queueDrain(ea_Queue *q)
+{
+	char buf[64];
+
+	while (read(q->fd[0], buf, sizeof(buf)) > 0);
+}
+
+
+static void* ea_queueThread(void *arg)
+{
+	ea_Queue *q = arg;
+
+	pthread_mutex_lock(&q->mutex);
+
+	for (;;) {
+		ea_QueueJob *job;
+
+		while ((!q->quit) && (!q->pending.head))
+			pthread_cond_wait(&q->start, &q->mutex);
+
+		if (q->quit)
+			break;
+
+		job = ea_listPop(&q->pending);
+		pthread_mutex_unlock(&q->mutex);
+
+		job->fn(job->data);
+
+		pthread_mutex_lock(&q->mutex);
+		ea_listPush(&q->done, job);
+		ea_queueWake(q);
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+}
+
+
+ea_Queue* ea_queueNew(int nthreads)
+{
+	ea_Queue *q = ea_alloc(ea_Queue);
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	q->nthreads = nthreads;
+	q->threads = ea_allocArray(pthread_t, nthreads);
+	q->pending.head = q->pending.tail = NULL;
+	q->done.head = q->done.tail = NULL;
+	q->quit = false;
+
+#ifdef __linux__
+	q->fd[0] = q->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (q->fd[0] == -1)
+		ea_pfatal("ea_queueNew: eventfd");
+#else
+	if (pipe(q->fd) == -1)
+		ea_pfatal("ea_queueNew: pipe");
+
+	for (i = 0; i < 2; i++)
+		fcntl(q->fd[i], F_SETFL, fcntl(q->fd[i], F_GETFL) | O_NONBLOCK);
+#endif
+
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->start, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(q->threads + i, NULL, ea_queueThread, q))
+			ea_fatal("ea_queueNew: cannot create thread %d", i);
+
+	return q;
+}
+
+
+void ea_queueStop(ea_Queue *q)
+{
+	ea_QueueJob *job;
+	int i;
+
+	if (!q->nthreads)
+		return;
+
+	pthread_mutex_lock(&q->mutex);
+	q->quit = true;
+	pthread_cond_broadcast(&q->start);
+	pthread_mutex_unlock(&q->mutex);
+
+	for (i = 0; i < q->nthreads; i++)
+		pthread_join(q->threads[i], NULL);
+
+	ea_freeArray(pthread_t, q->nthreads, q->threads);
+	q->nthreads = 0;
+
+	while ((job = ea_listPop(&q->pending)))
+		ea_listPush(&q->done, job);
+}
+
+
+void ea_queueFree(ea_Queue *q)
+{
+	ea_queueStop(q);
+
+	while (ea_queueDone(q));
+
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->start);
+
+	close(q->fd[0]);
+
+	if (q->fd[1] != q->fd[0])
+		close(q->fd[1]);
+
+	ea_free(ea_Queue, q);
+}
+
+
+int ea_queueThreads(ea_Queue *q)
+{
+	return q->nthreads;
+}
+
+
+int ea_queueFd(ea_Queue *q)
+{
+	return q->fd[0];
+}
+
+
+void ea_queuePush(ea_Queue *q, ea_QueueFn fn, void *data)
+{
+	ea_QueueJob *job;
+
+	ea_memShared(true);
+
+	job = ea_alloc(ea_QueueJob);
+	job->fn = fn;
+	job->data = data;
+
+	pthread_mutex_lock(&q->mutex);
+	ea_listPush(&q->pending, job);
+	pthread_cond_signal(&q->start);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+
+/* return the data of a finished job (NULL if none) */
+void* ea_queueDone(ea_Queue *q)
+{
+	ea_QueueJob *job;
+	void *data;
+
+	pthread_mutex_lock(&q->mutex);
+
+	job = ea_listPop(&q->done);
+
+	/* the fd is drained with the list empty: a job finished from now
+	   makes it readable again */
+	if (!job)
+		ea_queueDrain(q);
+
+	pthread_mutex_unlock(&q->mutex);
+
+	if (!job)
+		return NULL;
+
+	data = job->data;
+	ea_free(ea_QueueJob, job);
+
+	ea_memShared(false);
+
+	return data;
+}
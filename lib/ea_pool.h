@@ -0,0 +1,68 @@
+/* MIT License
+ *
+ * Copyright (c) 2019 Fabio Sassi <fabio dot s81 at gmail dot com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AE_POOL_H__
+#define __AE_POOL_H__
+
+#include "ea.h"
+
+/*
+ * Fork-join thread pool: ea_poolRun call fn(data, i, thread) for every
+ * item i in [0, n), the items are taken in order by the pool threads and
+ * by the calling thread (thread 0), and return when all are done. The
+ * allocator is shared while the items run (see ea_memShared). Runs called
+ * by different threads are done one at a time.
+ */
+typedef void (*ea_PoolFn)(void *data, int item, int thread);
+
+typedef struct ea_Pool_ ea_Pool;
+
+ea_Pool* ea_poolNew(int nthreads);
+void ea_poolFree(ea_Pool *pool);
+int ea_poolThreads(ea_Pool *pool);
+void ea_poolRun(ea_Pool *pool, ea_PoolFn fn, void *data, int n);
+
+
+/*
+ * Job queue: the jobs pushed by ea_queuePush (fn(data)) are run in push
+ * order by the queue threads, a finished job is returned (its data) by
+ * ea_queueDone. ea_queueFd is readable when there are finished jobs (add
+ * it to the event loop and call ea_queueDone until NULL on every event).
+ *
+ * The allocator is shared from the push of a job to its ea_queueDone.
+ * ea_queueStop wait the running jobs and stop the threads: the jobs not
+ * started are returned by ea_queueDone as finished.
+ */
+typedef void (*ea_QueueFn)(void *data);
+
+typedef struct ea_Queue_ ea_Queue;
+
+ea_Queue* ea_queueNew(int nthreads);
+void ea_queueStop(ea_Queue *q);
+void ea_queueFree(ea_Queue *q);
+int ea_queueThreads(ea_Queue *q);
+int ea_queueFd(ea_Queue *q);
+void ea_queuePush(ea_Queue *q, ea_QueueFn fn, void *data);
+void* ea_queueDone(ea_Queue *q);
+
+#endif
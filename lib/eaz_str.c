@@ -41,8 +41,8 @@ static void eaz_grow(eaz_String *s, int inc)
 	if ((s->size - s->length) >= inc)
 		return;
 
+	s->data = ea_resizeArray(char, s->size, s->size + inc, s->data);
 	s->size += inc;
-	s->data = ea_resizeArray(char, s->size, s->data);
 }
 
 
@@ -175,8 +175,9 @@ void eaz_growBy(eaz_String *s, int inc)
 
 void eaz_growTo(eaz_String *s, int size)
 {
+	/* eaz_grow wants the free space after the length */
 	if (size > s->size)
-		eaz_grow(s, size - s->size);
+		eaz_grow(s, size - s->length);
 }
 
 
@@ -184,12 +185,11 @@ void eaz_let(eaz_String *s, char* data, int len)
 {
 	assert(len > 0);
 
-	if (len > s->size)
-		eaz_grow(s, len - s->size);
-
 	if (s->size < 0)
 		ea_fatal("eaz_let: cannot set immutable (link) string");
 
+	eaz_growTo(s, len);
+
 	memcpy(s->data, data, len);
 
 	s->length = len;
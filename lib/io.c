@@ -29,6 +29,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 
 #include "ea.h"
@@ -56,6 +57,17 @@ static void io_reuseAddr(int fd)
 }
 
 
+/* send small writes at once (streamed responses end with a short one) */
+static void io_noDelay(int fd)
+{
+	const int enabled = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled,
+	               sizeof(const int)) == -1) {
+		ea_pfatal("error setting TCP_NODELAY in socket");
+	}
+}
+
+
 int io_createListenSocket(int port, int backlog)
 {
 	struct sockaddr_in addr;
@@ -112,6 +124,7 @@ int io_createConnectionSocket(int listensocket)
 	}
 
 	io_setNonBlocking(socket);
+	io_noDelay(socket);
 
 	return socket;
 }
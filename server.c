@@ -32,6 +32,7 @@
 
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "lib/ew.h"
 #include "lib/io.h"
@@ -39,6 +40,11 @@
 #include "taskprocess.h"
 
 ab_Trie* maintrie = NULL;
+ab_Defrag* maindefrag = NULL;
+ab_Clear* mainflush = NULL;
+uint64_t mainwrites = 0;
+ea_Pool* mainpool = NULL;
+ea_Queue* mainsearch = NULL;
 int evfd = 0;
 int listensocket = 0;
 int shutdown = 0;
@@ -54,6 +60,19 @@ int shutdown = 0;
 
 #define SHUTDOWN_BY_SIGINT 1
 
+/* woods moved by a defragmentation step (one step for every idle loop) */
+#define DEFRAG_STEP 512
+
+/* woods freed by a flush step */
+#define FLUSH_STEP 4096
+
+/* threads of a parallel LEV search and search threads (default: online
+   CPUs) */
+#define MAX_THREADS 64
+
+/* default size of the LEV cache (megabytes) */
+#define CACHE_MB 32
+
 void connClose(int fd)
 {
 	DBG1 report("close connection socket user=%d", fd);
@@ -106,6 +125,8 @@ static void processEvents(zm_VM* vm, ew_Event *events, int n)
 
 		if (ew_data(event) == NULL)
 			connOpen(vm);
+		else if (ew_data(event) == (void*)mainsearch)
+			lev_done(vm);
 		else
 			connIO(vm, event);
 	}
@@ -185,6 +206,10 @@ static void initListenSocket()
 	ew_add(evfd, listensocket, EW_LISTEN | EW_IN | EW_OUT,
 	       (void*)LISTEN_BACKLOG);
 
+	/* finished searches */
+	if (mainsearch)
+		ew_add(evfd, ea_queueFd(mainsearch), EW_IN, (void*)mainsearch);
+
 	atexit(closeListenSocket);
 }
 
@@ -201,16 +226,88 @@ static void closeTasks(zm_VM *vm)
 }
 
 
-static void flushTrie(ab_Trie *trie)
+/*
+ * Load a sorted dump: one `key<TAB>value` record for line, keys in
+ * increasing byte order (keys can't contain TAB or newline).
+ */
+static void loadTrie(ab_Trie *trie, const char *filename)
 {
-	ab_Look lo;
+	FILE *f = fopen(filename, "rb");
+	eaz_String *line = eaz_new(1024);
+	ab_Bulk bk;
+	int nline = 0, count = 0;
+	int c;
 
-	while(ab_first(&lo, trie, NULL, 0, true) != -1) {
-		eaz_String *val = (eaz_String*)ab_del(&lo);
+	if (!f)
+		ea_pfatal("can't open %s", filename);
 
-		if (val)
-			eaz_free(val);
-	}
+	ab_bulkStart(&bk, trie);
+
+	do {
+		char *tab;
+		int klen;
+
+		c = getc(f);
+
+		if ((c != '\n') && (c != EOF)) {
+			eaz_addChar(line, c);
+			continue;
+		}
+
+		if ((c == EOF) && (line->length == 0))
+			break;
+
+		nline++;
+
+		tab = memchr(line->data, '\t', line->length);
+
+		if (!tab)
+			ea_fatal("%s:%d: missing tab", filename, nline);
+
+		klen = tab - line->data;
+
+		if (klen > 1024)
+			ea_fatal("%s:%d: key len > 1024", filename, nline);
+
+		if (!ab_bulkAdd(&bk, line->data, klen,
+		                val_newFrom(tab + 1, line->length - klen - 1)))
+			ea_fatal("%s:%d: empty, duplicate or unsorted key",
+			         filename, nline);
+
+		count++;
+		line->length = 0;
+
+	} while (c != EOF);
+
+	ab_bulkEnd(&bk);
+
+	eaz_free(line);
+	fclose(f);
+
+	DBG0 report("loaded %d keys from %s", count, filename);
+}
+
+
+/* map a snapshot image written by saveSnapshot (-w) */
+static ab_Trie* openSnapshot(const char *filename)
+{
+	ab_Trie *trie = ab_snapOpen(filename);
+
+	if (!trie)
+		ea_pfatal("can't open snapshot %s", filename);
+
+	DBG0 report("mapped %u keys from %s", ab_count(trie), filename);
+
+	return trie;
+}
+
+
+static void saveSnapshot(ab_Trie *trie, const char *filename)
+{
+	if (!ab_snapWrite(trie, filename, val_data))
+		ea_pfatal("can't write snapshot %s", filename);
+
+	DBG0 report("saved %u keys in %s", ab_count(trie), filename);
 }
 
 
@@ -235,6 +332,62 @@ static const char *shutdownReason(int code)
 }
 
 
+static void defragStop()
+{
+	ab_defragEnd(maindefrag);
+	ea_free(ab_Defrag, maindefrag);
+	maindefrag = NULL;
+}
+
+
+/*
+ * Move a slice of the trie, return true if the pass is not complete.
+ * It waits while a search reads a view of the trie (the end of the search
+ * wakes the loop).
+ */
+static int defragStep()
+{
+	size_t released;
+
+	if ((!maindefrag) || ab_defragWaiting(maindefrag))
+		return false;
+
+	if (ab_defragStep(maindefrag, DEFRAG_STEP))
+		return true;
+
+	released = ea_trim();
+
+	DBG0 report("defrag: moved %zu woods (%zu bytes), released %zu bytes",
+	            maindefrag->woods, maindefrag->bytes, released);
+
+	defragStop();
+
+	return false;
+}
+
+
+/*
+ * Free a slice of a flushed trie, return true if it is not complete (it
+ * waits the searches begun before the flush as defragStep).
+ */
+static int flushStep()
+{
+	if ((!mainflush) || ab_clearWaiting(mainflush))
+		return false;
+
+	if (ab_clearStep(mainflush, FLUSH_STEP))
+		return true;
+
+	DBG3 report("flush: freed %zu woods", mainflush->freed);
+
+	ab_clearEnd(mainflush);
+	ea_free(ab_Clear, mainflush);
+	mainflush = NULL;
+
+	return false;
+}
+
+
 static void mainLoop(zm_VM *vm)
 {
 	int towait = -1;  // -1 = block wait - 0 = pool
@@ -247,7 +400,7 @@ static void mainLoop(zm_VM *vm)
 
 	while (!shutdown) {
 		ew_Event events[MAX_EVENTS];
-		int n;
+		int n, stall;
 
 		DBG3 report("main - ************* waiting *************");
 
@@ -264,22 +417,87 @@ static void mainLoop(zm_VM *vm)
 
 		towait = processGo(vm, NULL, 1000)  ? 0 : -1;
 
+		/* all tasks are waiting: free or defragment a slice and poll */
+		if ((towait == -1) && (flushStep() | defragStep()))
+			towait = 0;
+
+		/* views of the searches kept by stalled sends */
+		stall = lev_stalls(vm);
+
+		if ((stall != -1) && ((towait == -1) || (stall < towait)))
+			towait = stall;
+
 		DBG4 report("main - towait = %d", towait);
 	}
 
 	DBG0 report("shutdown server by %s", shutdownReason(shutdown));
 
+	if (maindefrag)
+		defragStop();
+
+	/* wait the running searches, then the tasks can be closed */
+	if (mainsearch)
+		ea_queueStop(mainsearch);
+
+	lev_stop();
 	closeTasks(vm);
 
+	if (mainsearch)
+		lev_done(vm);
+
+	while (flushStep());
+
 	closeListenSocket();
 }
 
 
-int main()
+static void usage(const char *prog)
 {
+	fprintf(stderr, "usage: %s [-l sorted-dump | -m snapshot] "
+	                "[-w snapshot] [-i] [-t threads] [-s searchers] "
+	                "[-c cache-mb]\n",
+	                prog);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *dump = NULL, *snap = NULL, *save = NULL;
+	int index = false;
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int searchers = threads;
+	int cache = CACHE_MB;
 	zm_VM *vm;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-l") && (i + 1 < argc))
+			dump = argv[++i];
+		else if (!strcmp(argv[i], "-m") && (i + 1 < argc))
+			snap = argv[++i];
+		else if (!strcmp(argv[i], "-w") && (i + 1 < argc))
+			save = argv[++i];
+		else if (!strcmp(argv[i], "-i"))
+			index = true;
+		else if (!strcmp(argv[i], "-t") && (i + 1 < argc))
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && (i + 1 < argc))
+			searchers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-c") && (i + 1 < argc))
+			cache = atoi(argv[++i]);
+		else
+			usage(argv[0]);
+	}
+
+	if (dump && snap)
+		usage(argv[0]);
+
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
 
-	maintrie = ab_new();
+	if (searchers > MAX_THREADS)
+		searchers = MAX_THREADS;
 
 	vm = zm_newVM("levn");
 
@@ -287,13 +505,63 @@ int main()
 
 	DBG0 report("Levin version %s", LEVIN_VERSION);
 
-	mainLoop(vm);
+	maintrie = (snap) ? openSnapshot(snap) : ab_new();
+
+	if (index) {
+		ab_indexOn(maintrie);
+		DBG0 report("GET index enabled");
+	}
+
+	if (dump)
+		loadTrie(maintrie, dump);
+
+	if (save) {
+		saveSnapshot(maintrie, save);
+	} else {
+		if (threads > 1) {
+			mainpool = ea_poolNew(threads);
+			DBG0 report("LEV parallel search threads: %d",
+			            ea_poolThreads(mainpool));
+		}
+
+		/* the searches read a view while SET changes the trie */
+		if (!ab_readOnly(maintrie))
+			ab_share(maintrie);
+
+		if (searchers > 0) {
+			mainsearch = ea_queueNew(searchers);
+			DBG0 report("LEV search threads: %d",
+			            ea_queueThreads(mainsearch));
+		}
+
+		if (cache > 0) {
+			lev_cacheInit((size_t)cache << 20);
+			DBG0 report("LEV cache: %d MB", cache);
+		}
+
+		mainLoop(vm);
+
+		lev_cacheFree();
+	}
+
+	if (mainsearch)
+		ea_queueFree(mainsearch);
+
+	if (mainpool)
+		ea_poolFree(mainpool);
 
 	reportSetVM(NULL);
 
 	zm_freeVM(vm);
 
-	flushTrie(maintrie);
+	if (ab_readOnly(maintrie)) {
+		ab_snapClose(maintrie);
+	} else {
+		ab_destroy(maintrie, val_free);
+	}
 
-	ab_free(maintrie);
+	DBG3 {
+		report("memory classes:");
+		ea_memPrint(stdout);
+	}
 }
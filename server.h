@@ -35,6 +35,7 @@
 #define __LEVIN_SERVER_H__
 
 #include "lib/ea.h"
+#include "lib/ea_pool.h"
 #include "lib/ab_trie.h"
 #include "zm.h"
 #include "log.h"
@@ -69,6 +70,23 @@
 
 ab_Trie* maintrie;
 
+/* running defragmentation pass of maintrie (NULL if none) */
+ab_Defrag* maindefrag;
+
+/* detached keys of a FLUSHALL still to free (NULL if none) */
+ab_Clear* mainflush;
+
+/* write generation of maintrie: bumped by SET and FLUSHALL, a cached LEV
+   response is valid only with the generation it was searched with */
+uint64_t mainwrites;
+
+/* threads of a parallel LEV search (NULL with a single thread) */
+ea_Pool* mainpool;
+
+/* search threads: LEV searches a read view of the (shared) maintrie
+   there, while the event loop goes on (NULL: LEV runs in the loop) */
+ea_Queue* mainsearch;
+
 void connClose(int fd);
 
 #endif
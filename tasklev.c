@@ -32,366 +32,2303 @@
 
 
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 #include "lib/eak_stack.h"
 #include "taskprocess.h"
 
+/*
+ * AVX2 byte rows: 2 = always (built with -mavx2), 1 = when the CPU has it
+ * (an x86-64 build with gcc or clang and only SSE2 enabled: the AVX2
+ * kernel is compiled with a target attribute), 0 = never. -DLEV_AVX2=0
+ * disables the test.
+ */
+#ifndef LEV_AVX2
+	#if AB_SIMD >= 2
+		#define LEV_AVX2 2
+	#elif AB_SIMD == 1 && defined(__x86_64__) && defined(__GNUC__)
+		#define LEV_AVX2 1
+	#else
+		#define LEV_AVX2 0
+	#endif
+#endif
+
+#if AB_SIMD >= 2 || LEV_AVX2
+	#include <immintrin.h>
+#elif AB_SIMD >= 1
+	#include <emmintrin.h>
+#endif
+
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* trie positions visited by a search step (before the yield) */
+#define LEV_STEP 256
+
+/* longest word searched with bit-parallel rows */
+#define LEV_BITS 64
+
+/* byte rows: padding before cell 0 (cell -1 is 255) and length unit */
+#define LEV_PAD 32
+
+/* LEVX flags */
+#define LEV_DFA 1
+#define LEV_TOPK 2
+#define LEV_STREAM 4
+#define LEV_KEYS 8
+#define LEV_PARALLEL 16
+
+/* LEV_STREAM: size of a response chunk */
+#define LEV_STREAM_SIZE (16 * 1024)
+
+/* seconds a search thread view can stay open across a stalled send */
+#define LEV_VIEW_TIME 2
+
+/* parallel search: parts for every thread, and a search without
+   LEV_PARALLEL is parallel with maxlev >= LEV_PARALLEL_MAXLEV in a trie of
+   LEV_PARALLEL_KEYS keys or more */
+#define LEV_PARTS 8
+#define LEV_PARALLEL_MAXLEV 2
+#define LEV_PARALLEL_KEYS (1 << 20)
+
+/* memory of a Levenshtein automaton before it is rebuilt */
+#define LEV_DFA_BYTES (1 << 20)
+#define LEV_DFA_MINSTATES 64
+
+
+typedef struct {
+	eaz_String *key;
+	/* the value in the trie (pinned, see val_pin), NULL with LEV_KEYS */
+	void *value;
+	int dist;
+	int suffix;
+} Result;
+
+
+/*
+ * A level of the search stack: the cursor on the edge of this level (a
+ * node letter or a whole branch label) starting at key position `depth`.
+ */
+typedef struct {
+	ab_Cursor cursor;
+	int depth;
+	int suffmode;
+	int suffdist;
+} Level;
+
+
+/*
+ * Bit-parallel row (Myers/Hyyro) of a word up to LEV_BITS bytes: bit i-1
+ * of vp (vn) is set if row[i] - row[i-1] is +1 (-1), row[0] is the depth.
+ */
+typedef struct {
+	uint64_t vp;
+	uint64_t vn;
+} BitRow;
+
+
+typedef struct Dfa_ Dfa;
+
+
+typedef struct Search_ Search;
+
+struct Search_ {
+	eak_Stack *results;
+	eaz_String *word;
+	eaz_String *keybuffer;
+	int rowlen;
+	int maxlev;
+	int maxsuflen;
+	int flags;
+
+	/* value generation pinned by the results (0 = none) */
+	uint64_t pin;
+
+	/* the searched trie: `view` (reading) of maintrie, with the reader
+	   slot `reader` of a shared maintrie */
+	ab_Trie *trie;
+	ab_Trie view;
+	int reader;
+	int reading;
+
+	/* the task to wake when a reader slot is free or the search thread
+	   job is done (see lev_done), `orphan` if the task is closed
+	   meanwhile; `nextwait` links the searches waiting for a slot */
+	Shared *shared;
+	zm_State *process;
+	int running;
+	int started;
+	int orphan;
+	int waiting;
+	Search *nextwait;
+
+	/* LEV_STREAM: `sending` while a chunk is sent, `stalled` (linked by
+	   `nextstall`) if the search waits for the send (in the event loop,
+	   or a search thread with the next chunk ready), `draining` if the
+	   rest of the results go in the chunk so the view ends (see
+	   lev_stalls); `began` is the view start */
+	int sending;
+	int stalled;
+	int draining;
+	Search *nextstall;
+	time_t began;
+
+	/* LEV_TOPK: the search is repeated with maxlev = 0, 1, .. limit
+	   until it finds topk keys, best[0..nbest) is a max heap (by
+	   distance, then key, see resCmp) of the closest keys found;
+	   `keyorder` if the keys are found in key order (not a parallel
+	   search) */
+	int limit;
+	int topk;
+	Result **best;
+	int nbest;
+	int keyorder;
+
+	/* LEV_STREAM: the results are encoded in `chunk` (sent when it is
+	   LEV_STREAM_SIZE bytes long, the search goes on after the send),
+	   `count` is the number of results */
+	eaz_String *chunk;
+	uint32_t count;
+	int more;
+	int sent;
+	zm_State *task;
+
+	/* LEV cache: the key of the request and the write generation of
+	   maintrie when the search began (see mainwrites) */
+	eaz_String *cachekey;
+	uint64_t gen;
+
+	/* rows[d * rowlen] is the row of the first d letters of the key */
+	int *rows;
+
+	/* with a word up to LEV_BITS bytes: bits[d] in place of rows and
+	   the letter masks of the word */
+	BitRow *bits;
+	uint64_t *peq;
+	uint64_t mask;
+
+	/* with a longer word (and maxlev < 255): byte rows, cells saturated
+	   at cap = maxlev + 1, the row of depth d is cells + d * stride +
+	   LEV_PAD and its min is cellmin[d]; wordpad[i] = word[i - 1] */
+	uint8_t *cells;
+	uint8_t *cellmin;
+	uint8_t *wordpad;
+	int stride;
+	int cap;
+
+	/* with LEV_DFA (and maxlev < 255): a lazy automaton of byte rows */
+	Dfa *dfa;
+
+	/* levels[0..top], depth is the key length at the end of the edge
+	   of the top level */
+	Level *levels;
+	int top;
+	int maxdepth;
+	int depth;
+};
+
+
+static void resFree(Result *r)
+{
+	eaz_free(r->key);
+	ea_free(Result, r);
+}
+
+static Result* resPop(Search *s)
+{
+	return eak_pop(s->results).p;
+}
+
+/* order of the top-k results: by distance, then by key bytes */
+static int resCmp(const Result *x, const Result *y)
+{
+	int len = MIN(x->key->length, y->key->length);
+	int c;
+
+	if (x->dist != y->dist)
+		return x->dist - y->dist;
+
+	if ((c = memcmp(x->key->data, y->key->data, len)))
+		return c;
+
+	return x->key->length - y->key->length;
+}
+
+
+static void bestUp(Result **heap, int i)
+{
+	while (i) {
+		int parent = (i - 1) / 2;
+		Result *r = heap[i];
+
+		if (resCmp(heap[parent], r) >= 0)
+			break;
+
+		heap[i] = heap[parent];
+		heap[parent] = r;
+		i = parent;
+	}
+}
+
+
+static void bestDown(Result **heap, int n, int i)
+{
+	for (;;) {
+		int max = i, l = 2 * i + 1, r = l + 1;
+		Result *tmp;
+
+		if ((l < n) && (resCmp(heap[l], heap[max]) > 0))
+			max = l;
+
+		if ((r < n) && (resCmp(heap[r], heap[max]) > 0))
+			max = r;
+
+		if (max == i)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[max];
+		heap[max] = tmp;
+		i = max;
+	}
+}
+
+
+/*
+ * Add a result to the top-k heap (replacing the last one if full), so
+ * the top-k keys don't depend on the order they are found in: with a
+ * full heap only a key before the last can enter and maxlev (the bound
+ * of the search) is lowered to its distance. Keys found in key order
+ * come after the last at the same distance: the bound is below it.
+ */
+static void bestAdd(Search *search, Result *r)
+{
+	if (search->nbest < search->topk) {
+		search->best[search->nbest] = r;
+		bestUp(search->best, search->nbest++);
+	} else if (resCmp(r, search->best[0]) < 0) {
+		resFree(search->best[0]);
+		search->best[0] = r;
+		bestDown(search->best, search->nbest, 0);
+	} else {
+		resFree(r);
+	}
+
+	if (search->nbest == search->topk)
+		search->maxlev = search->best[0]->dist -
+		                 ((search->keyorder) ? 1 : 0);
+}
+
+
+static void bestClear(Search *search)
+{
+	while (search->nbest)
+		resFree(search->best[--search->nbest]);
+}
+
+
+static int bestCmp(const void *a, const void *b)
+{
+	return resCmp(*(Result* const*)a, *(Result* const*)b);
+}
+
+
+/* move the top-k results to `results` (the closest on the head) */
+static void bestEnd(Search *search)
+{
+	qsort(search->best, search->nbest, sizeof(Result*), bestCmp);
+
+	while (search->nbest)
+		eak_push(search->results)->p = search->best[--search->nbest];
+}
+
+
+/* size of a result record */
+static int resSize(Search *search, eaz_String *key, void *v)
+{
+	if (search->flags & LEV_KEYS)
+		return 6 + key->length;
+
+	return 10 + key->length + val_len(v);
+}
+
+
+/* add a result record to `s` (the value is omitted with LEV_KEYS) */
+static void resEncode(Search *search, eaz_String *s, eaz_String *key,
+                      void *v, int d, int suffmode)
+{
+	eaz_addU8(s, d);
+	eaz_addU8(s, suffmode);
+
+	eaz_addU32(s, key->length, true);
+	eaz_add(s, key);
+
+	if (!(search->flags & LEV_KEYS)) {
+		eaz_addU32(s, val_len(v), true);
+		val_add(s, v);
+	}
+
+	search->count++;
+}
+
+
+static void resPush(Search *search, void *v, int d, int suffmode)
+{
+	Result *r;
+
+	/* top-k: the bound can be lowered under a suffix distance */
+	if (search->topk && (d > search->maxlev))
+		return;
+
+	/* streamed results are not copied */
+	if (search->chunk && !search->topk) {
+		resEncode(search, search->chunk, search->keybuffer, v, d,
+		          suffmode);
+		return;
+	}
+
+	r = ea_alloc(Result);
+	r->key = eaz_dup(search->keybuffer, 0);
+	r->value = (search->flags & LEV_KEYS) ? NULL : v;
+	r->dist = d;
+	r->suffix = suffmode;
+
+	DBG4 report("push key=`%.*s`", r->key->length, r->key->data);
+
+	if (search->topk)
+		bestAdd(search, r);
+	else
+		eak_push(search->results)->p = r;
+}
+
+
+static void printRow(Search *search, int *row, int head)
+{
+	int i;
+
+	if (head) {
+		report("{");
+		for (i = 0; i < search->word->length; i++)
+			printf(" %c", search->word->data[i]);
+		report("}");
+	}
+
+	report("{");
+
+	printf("row = ");
+
+	for (i = 0; i < search->rowlen; i++) {
+		printf(" %d", row[i]);
+	}
+
+	report("}");
+}
+
+
+static int rowMin(int *row, int lo, int hi)
+{
+	int min = row[lo];
+
+	for (int i = lo + 1; i <= hi; i++)
+		if (row[i] < min)
+			min = row[i];
+
+	return min;
+}
+
+
+/*
+ * Cells of a row of depth d that can be <= maxlev: row[i] >= |i - d|, so
+ * only the band [d - maxlev, d + maxlev] (Ukkonen) is computed, the other
+ * cells are taken as maxlev + 1. Return false if the band is empty.
+ */
+static int searchBand(Search *search, int d, int *lo, int *hi)
+{
+	*lo = MAX(0, d - search->maxlev);
+	*hi = MIN(search->rowlen - 1, d + search->maxlev);
+
+	return *lo <= *hi;
+}
+
+
+/*
+ * Compute the cells lo..hi of the row of `letter` from `prev`: the cells
+ * lo - 1 and hi + 1 (if any) are set to maxlev + 1, so the band of the
+ * next row (one cell to the right) reads only cells written here.
+ */
+static void levenshteinRow(Search *search, int *row, int *prev, char letter,
+                           int lo, int hi)
+{
+	int i = lo;
+
+	DBG4 report("levensthein");
+	DBG4 printRow(search, prev, true);
+
+	if (lo == 0) {
+		row[0] = prev[0] + 1;
+		i = 1;
+	} else {
+		row[lo - 1] = search->maxlev + 1;
+	}
+
+	if (hi + 1 < search->rowlen)
+		row[hi + 1] = search->maxlev + 1;
+
+	for (; i <= hi; i++) {
+		int ins = row[i-1] + 1;
+		int del = prev[i] + 1;
+		int rep = prev[i-1];
+
+		if (search->word->data[i-1] != letter)
+			rep++;
+
+		row[i] = MIN(ins, MIN(del, rep));
+	}
+
+	DBG4 printRow(search, row, false);
+}
+
+
+static int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	int n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+
+	return n;
+#endif
+}
+
+
+/*
+ * Compute the bit-parallel row of `letter` from `prev` (Myers algorithm
+ * for the edit distance: row[0] grows by one for every letter).
+ */
+static void levenshteinBits(Search *search, BitRow *row, BitRow *prev,
+                            uint8_t letter)
+{
+	uint64_t eq = search->peq[letter];
+	uint64_t x = eq | prev->vn;
+	uint64_t d0 = (((x & prev->vp) + prev->vp) ^ prev->vp) | x;
+	uint64_t hn = prev->vp & d0;
+	uint64_t hp = prev->vn | ~(prev->vp | d0);
+
+	x = (hp << 1) | 1;
+
+	row->vn = x & d0 & search->mask;
+	row->vp = ((hn << 1) | ~(x | d0)) & search->mask;
+}
+
+
+/*
+ * Min of a bit-parallel row (of depth `depth`) if it is <= maxlev, else a
+ * value > maxlev: only cells with |i - depth| <= maxlev can be <= maxlev.
+ */
+static int bitsMin(Search *search, BitRow *row, int depth)
+{
+	uint64_t below;
+	int i, v, min, lo, hi;
+
+	if (!searchBand(search, depth, &lo, &hi))
+		return search->maxlev + 1;
+
+	below = (lo >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << lo) - 1;
+	v = depth + popcount64(row->vp & below) - popcount64(row->vn & below);
+	min = v;
+
+	for (i = lo; i < hi; i++) {
+		v += (int)((row->vp >> i) & 1) - (int)((row->vn >> i) & 1);
+
+		if (v < min)
+			min = v;
+	}
+
+	return min;
+}
+
+
+/*
+ * Byte rows: cells are uint8_t saturated at cap (a cell > maxlev is
+ * never used as a distance). A row is computed by chunks of 16 cells
+ * (32 with AVX2, see LEV_AVX2): t[i] = min(prev[i] + 1, prev[i - 1] +
+ * cost) and then the insertion dependency row[i] = min(t[i], row[i - 1] +
+ * 1), that is the prefix min of t[j] + (i - j), is done in log steps
+ * inside the chunk plus the carry of the last cell of the previous chunk.
+ * The row min is computed in the same pass.
+ *
+ * Only the chunks of the band lo..hi are computed (all the row for the
+ * automaton): the cell before the first chunk and the chunk after the
+ * last one are set to cap, the cells the next row reads outside its own
+ * chunks.
+ */
+
+#if AB_SIMD
+
+#define LEV_FF4 0xFF, 0xFF, 0xFF, 0xFF
+#define LEV_FF32 LEV_FF4, LEV_FF4, LEV_FF4, LEV_FF4, \
+                 LEV_FF4, LEV_FF4, LEV_FF4, LEV_FF4
+
+/* levLow + 32 - k: bytes < k are 0xFF, levHigh + 32 - k: bytes >= k */
+static const uint8_t levLow[64] = { LEV_FF32 };
+static const uint8_t levHigh[64] = { [32] = LEV_FF32 };
+
+#undef LEV_FF4
+#undef LEV_FF32
+
+
+/* SSE2: chunks of 16 cells */
+#define lev16Load(p)     _mm_loadu_si128((const __m128i*)(p))
+#define lev16Store(p, x) _mm_storeu_si128((__m128i*)(p), (x))
+#define lev16Set1(c)     _mm_set1_epi8((char)(c))
+#define lev16Min(x, y)   _mm_min_epu8((x), (y))
+#define lev16Adds(x, y)  _mm_adds_epu8((x), (y))
+#define lev16Or(x, y)    _mm_or_si128((x), (y))
+#define lev16AndNot(x, y) _mm_andnot_si128((x), (y))
+#define lev16Eq(x, y)    _mm_cmpeq_epi8((x), (y))
+#define lev16Shl(x, k)   _mm_slli_si128((x), (k))
+#define lev16Half(t)     (t)
+
+#if LEV_AVX2
+/* AVX2: chunks of 32 cells */
+#define lev32Load(p)     _mm256_loadu_si256((const __m256i*)(p))
+#define lev32Store(p, x) _mm256_storeu_si256((__m256i*)(p), (x))
+#define lev32Set1(c)     _mm256_set1_epi8((char)(c))
+#define lev32Min(x, y)   _mm256_min_epu8((x), (y))
+#define lev32Adds(x, y)  _mm256_adds_epu8((x), (y))
+#define lev32Or(x, y)    _mm256_or_si256((x), (y))
+#define lev32AndNot(x, y) _mm256_andnot_si256((x), (y))
+#define lev32Eq(x, y)    _mm256_cmpeq_epi8((x), (y))
+
+/* shift left by k bytes across the two 128 bit lanes (k < 16) */
+#define lev32Lane(x)     _mm256_permute2x128_si256((x), (x), 0x08)
+#define lev32Shl(x, k)   _mm256_alignr_epi8((x), lev32Lane(x), 16 - (k))
+
+/* scan step k = 16: the low lane moved to the high lane */
+#define lev32Half(t)     lev32Min((t), lev32Adds(lev32Or(lev32Lane(t),     \
+                             lev32Load(levLow + 16)), lev32Set1(16)))
+#endif
+
+
+static const uint8_t levRamp[32] = {
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+	17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32
+};
+
+
+/* t[i] = min(t[i], t[i - k] + k) (shifted in cells are 255) */
+#define LEV_SCAN(W, t, k) lev##W##Min((t),                                 \
+                          lev##W##Adds(lev##W##Or(lev##W##Shl((t), (k)),  \
+                          lev##W##Load(levLow + 32 - (k))), lev##W##Set1(k)))
+
+
+/* the kernel of chunks of W cells (levBytes16 and levBytes32) */
+#define LEV_BYTES(W, vec)                                                  \
+static int levBytes##W(Search *search, uint8_t *row, uint8_t *prev,        \
+                       uint8_t letter, int lo, int hi)                     \
+{                                                                          \
+	vec one = lev##W##Set1(1);                                         \
+	vec c = lev##W##Set1(letter);                                      \
+	vec cap = lev##W##Set1(search->cap);                               \
+	vec ramp = lev##W##Load(levRamp);                                  \
+	vec min = lev##W##Set1(255);                                       \
+	uint8_t a[W];                                                      \
+	int carry = 255, low = 255;                                        \
+	int i = lo - (lo % W), n = search->rowlen;                         \
+                                                                           \
+	if (i > 0)                                                         \
+		row[i - 1] = carry = search->cap;                          \
+                                                                           \
+	for (; i <= hi; i += W) {                                          \
+		vec cost = lev##W##AndNot(lev##W##Eq(                      \
+		           lev##W##Load(search->wordpad + i), c), one);   \
+		vec t = lev##W##Min(lev##W##Adds(lev##W##Load(prev + i),   \
+		                                 one),                     \
+		                    lev##W##Adds(lev##W##Load(prev + i - 1), \
+		                                 cost));                   \
+                                                                           \
+		t = LEV_SCAN(W, t, 1);                                     \
+		t = LEV_SCAN(W, t, 2);                                     \
+		t = LEV_SCAN(W, t, 4);                                     \
+		t = LEV_SCAN(W, t, 8);                                     \
+		t = lev##W##Half(t);                                       \
+		t = lev##W##Min(t, lev##W##Adds(lev##W##Set1(carry), ramp)); \
+		t = lev##W##Min(t, cap);                                   \
+                                                                           \
+		lev##W##Store(row + i, t);                                 \
+		carry = row[i + W - 1];                                    \
+                                                                           \
+		/* cells after the row end don't count for the min */     \
+		if (i + W > n)                                             \
+			t = lev##W##Or(t, lev##W##Load(levHigh + 32 -      \
+			                               (n - i)));          \
+                                                                           \
+		min = lev##W##Min(min, t);                                 \
+	}                                                                  \
+                                                                           \
+	if (i < search->stride - LEV_PAD)                                  \
+		lev##W##Store(row + i, cap);                               \
+                                                                           \
+	lev##W##Store(a, min);                                             \
+                                                                           \
+	for (i = 0; i < W; i++)                                            \
+		if (a[i] < low)                                            \
+			low = a[i];                                        \
+                                                                           \
+	return low;                                                        \
+}
+
+#if LEV_AVX2 < 2
+LEV_BYTES(16, __m128i)
+#endif
+
+#if LEV_AVX2 == 1
+__attribute__((target("avx2")))
+#endif
+#if LEV_AVX2
+LEV_BYTES(32, __m256i)
+#endif
+
+#undef LEV_SCAN
+#undef LEV_BYTES
+
+
+static int levenshteinBytes(Search *search, uint8_t *row, uint8_t *prev,
+                            uint8_t letter, int lo, int hi)
+{
+#if LEV_AVX2 == 1
+	/* a CPU test is a load: no state shared by the search threads */
+	if (__builtin_cpu_supports("avx2"))
+		return levBytes32(search, row, prev, letter, lo, hi);
+#elif LEV_AVX2 == 2
+	return levBytes32(search, row, prev, letter, lo, hi);
+#endif
+
+#if LEV_AVX2 < 2
+	return levBytes16(search, row, prev, letter, lo, hi);
+#endif
+}
+
+#else /* scalar */
+
+static int levenshteinBytes(Search *search, uint8_t *row, uint8_t *prev,
+                            uint8_t letter, int lo, int hi)
+{
+	int i, min = 255, carry = 255;
+
+	if (lo > 0)
+		row[lo - 1] = carry = search->cap;
+
+	if (hi + 1 < search->rowlen)
+		row[hi + 1] = search->cap;
+
+	for (i = lo; i <= hi; i++) {
+		int rep = prev[i - 1] + (search->wordpad[i] != letter);
+		int v = MIN(prev[i] + 1, rep);
+
+		v = MIN(v, carry + 1);
+		v = MIN(v, search->cap);
+
+		row[i] = carry = v;
+
+		if (v < min)
+			min = v;
+	}
+
+	return min;
+}
+
+#endif
+
+
+/*
+ * Levenshtein automaton (LEV_DFA): a state is a byte row (saturated at
+ * cap) and its transitions are computed the first time they are used, so
+ * the DFA of (word, maxlev) is built lazily for the visited part of the
+ * trie and a letter costs a table lookup. Letters not in the word have
+ * the same transitions (class 0). A DFA bigger than LEV_DFA_BYTES is
+ * rebuilt from the states of the search stack.
+ */
+
+typedef struct {
+	uint32_t hash;
+	int dist;
+	int min;
+} DfaState;
+
+struct Dfa_ {
+	/* letter -> class and a letter of every class */
+	uint16_t cls[256];
+	uint8_t letter[257];
+	int nclass;
+
+	/* row of state s: rows + s * stride + LEV_PAD */
+	DfaState *states;
+	uint8_t *rows;
+	/* next[s * nclass + class] (-1 = not computed) */
+	int32_t *next;
+	int nstates;
+	int size;
+	int maxstates;
+
+	/* states by row hash (-1 = empty), nslots = 2 * size */
+	int32_t *slots;
+	int nslots;
+
+	/* state of every depth of the search stack */
+	int32_t *path;
+
+	/* a new row */
+	uint8_t *tmp;
+};
+
+
+static uint8_t* dfaRow(Search *search, int s)
+{
+	return search->dfa->rows + (size_t)s * search->stride + LEV_PAD;
+}
+
+
+static uint32_t dfaHash(const uint8_t *row, int len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ row[i]) * 16777619u;
+
+	return h;
+}
+
+
+static void dfaSlots(Dfa *dfa)
+{
+	int s;
+
+	memset(dfa->slots, 0xFF, dfa->nslots * sizeof(int32_t));
+
+	for (s = 0; s < dfa->nstates; s++) {
+		uint32_t mask = dfa->nslots - 1;
+		uint32_t i = dfa->states[s].hash & mask;
+
+		while (dfa->slots[i] >= 0)
+			i = (i + 1) & mask;
+
+		dfa->slots[i] = s;
+	}
+}
+
+
+static void dfaGrow(Search *search)
+{
+	Dfa *dfa = search->dfa;
+	int size = dfa->size * 2;
+
+	dfa->states = ea_resizeArray(DfaState, dfa->size, size, dfa->states);
+	dfa->rows = ea_resizeArray(uint8_t, dfa->size * search->stride,
+	                           size * search->stride, dfa->rows);
+	dfa->next = ea_resizeArray(int32_t, dfa->size * dfa->nclass,
+	                           size * dfa->nclass, dfa->next);
+	ea_freeArray(int32_t, dfa->nslots, dfa->slots);
+
+	/* cell -1 of the new rows is 255 */
+	memset(dfa->rows + dfa->size * search->stride, 255,
+	       (size - dfa->size) * search->stride);
+
+	dfa->size = size;
+	dfa->nslots = 2 * size;
+	dfa->slots = ea_allocArray(int32_t, dfa->nslots);
+
+	dfaSlots(dfa);
+}
+
+
+/* state of a row (added if new) or -1 if the DFA is full */
+static int dfaState(Search *search, uint8_t *row, int min)
+{
+	Dfa *dfa = search->dfa;
+	uint32_t hash = dfaHash(row, search->rowlen);
+	uint32_t mask = dfa->nslots - 1;
+	uint32_t i;
+	int s;
+
+	for (i = hash & mask; dfa->slots[i] >= 0; i = (i + 1) & mask) {
+		s = dfa->slots[i];
+
+		if ((dfa->states[s].hash == hash) &&
+		    !memcmp(dfaRow(search, s), row, search->rowlen))
+			return s;
+	}
+
+	if (dfa->nstates == dfa->size) {
+		if (dfa->size == dfa->maxstates)
+			return -1;
+
+		dfaGrow(search);
+
+		return dfaState(search, row, min);
+	}
+
+	s = dfa->nstates++;
+
+	memcpy(dfaRow(search, s), row, search->rowlen);
+	memset(dfa->next + s * dfa->nclass, 0xFF,
+	       dfa->nclass * sizeof(int32_t));
+
+	dfa->states[s].hash = hash;
+	dfa->states[s].dist = row[search->rowlen - 1];
+	dfa->states[s].min = min;
+	dfa->slots[i] = s;
+
+	return s;
+}
+
+
+/* empty the DFA keeping the states of the depths 0..d */
+static void dfaReset(Search *search, int d)
+{
+	Dfa *dfa = search->dfa;
+	int n = d + 1, len = search->rowlen;
+	uint8_t *keep = ea_allocArray(uint8_t, n * len);
+	int *min = ea_allocArray(int, n);
+	int i;
+
+	DBG3 report("lev automaton full (%d states): rebuild", dfa->nstates);
+
+	for (i = 0; i < n; i++) {
+		memcpy(keep + i * len, dfaRow(search, dfa->path[i]), len);
+		min[i] = dfa->states[dfa->path[i]].min;
+	}
+
+	dfa->nstates = 0;
+	memset(dfa->slots, 0xFF, dfa->nslots * sizeof(int32_t));
+
+	for (i = 0; i < n; i++)
+		dfa->path[i] = dfaState(search, keep + i * len, min[i]);
+
+	ea_freeArray(uint8_t, n * len, keep);
+	ea_freeArray(int, n, min);
+}
+
+
+static void dfaNew(Search *search)
+{
+	Dfa *dfa = ea_alloc(Dfa);
+	int i, len = search->word->length;
+	size_t bytes;
+
+	search->dfa = dfa;
+
+	memset(dfa->cls, 0, sizeof(dfa->cls));
+	dfa->nclass = 1;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = search->word->data[i];
+
+		if (!dfa->cls[c]) {
+			dfa->cls[c] = dfa->nclass;
+			dfa->letter[dfa->nclass++] = c;
+		}
+	}
+
+	/* class 0 is a letter not in the word (if any) */
+	dfa->letter[0] = 0;
+
+	for (i = 0; i < 256; i++)
+		if (!dfa->cls[i] && (i != dfa->letter[1])) {
+			dfa->letter[0] = i;
+			break;
+		}
+
+	/* the stack states must fit after a rebuild */
+	bytes = search->stride + dfa->nclass * sizeof(int32_t) +
+	        sizeof(DfaState) + 2 * sizeof(int32_t);
+	dfa->maxstates = LEV_DFA_MINSTATES;
+
+	while ((dfa->maxstates < 2 * (search->maxdepth + 1)) ||
+	       ((size_t)dfa->maxstates * 2 * bytes <= LEV_DFA_BYTES))
+		dfa->maxstates *= 2;
+
+	dfa->size = LEV_DFA_MINSTATES;
+	dfa->nstates = 0;
+	dfa->nslots = 2 * dfa->size;
+	dfa->states = ea_allocArray(DfaState, dfa->size);
+	dfa->rows = ea_allocArray(uint8_t, dfa->size * search->stride);
+	dfa->next = ea_allocArray(int32_t, dfa->size * dfa->nclass);
+	dfa->slots = ea_allocArray(int32_t, dfa->nslots);
+	dfa->path = ea_allocArray(int32_t, search->maxdepth + 1);
+	dfa->tmp = ea_allocArray(uint8_t, search->stride - LEV_PAD);
+
+	memset(dfa->rows, 255, dfa->size * search->stride);
+	memset(dfa->slots, 0xFF, dfa->nslots * sizeof(int32_t));
+
+	/* first row */
+	for (i = 0; i < search->rowlen; i++)
+		dfa->tmp[i] = MIN(i, search->cap);
+
+	dfa->path[0] = dfaState(search, dfa->tmp, 0);
+}
+
+
+static void dfaFree(Search *search)
+{
+	Dfa *dfa = search->dfa;
+
+	ea_freeArray(DfaState, dfa->size, dfa->states);
+	ea_freeArray(uint8_t, dfa->size * search->stride, dfa->rows);
+	ea_freeArray(int32_t, dfa->size * dfa->nclass, dfa->next);
+	ea_freeArray(int32_t, dfa->nslots, dfa->slots);
+	ea_freeArray(int32_t, search->maxdepth + 1, dfa->path);
+	ea_freeArray(uint8_t, search->stride - LEV_PAD, dfa->tmp);
+	ea_free(Dfa, dfa);
+}
+
+
+/* state of depth d + 1 from the state of depth d and `letter` */
+static void dfaNext(Search *search, int d, uint8_t letter)
+{
+	Dfa *dfa = search->dfa;
+	int k = dfa->cls[letter];
+	int s = dfa->next[dfa->path[d] * dfa->nclass + k];
+
+	if (s < 0) {
+		int min = levenshteinBytes(search, dfa->tmp,
+		                           dfaRow(search, dfa->path[d]),
+		                           dfa->letter[k], 0,
+		                           search->rowlen - 1);
+
+		s = dfaState(search, dfa->tmp, min);
+
+		if (s < 0) {
+			dfaReset(search, d);
+			s = dfaState(search, dfa->tmp, min);
+		}
+
+		dfa->next[dfa->path[d] * dfa->nclass + k] = s;
+	}
+
+	dfa->path[d + 1] = s;
+}
+
+
+static void searchInit(Search *search)
+{
+	search->word = NULL;
+	search->rowlen = 0;
+	search->maxlev = 0;
+	search->maxsuflen = 0;
+	search->keybuffer = NULL;
+	search->rows = NULL;
+	search->bits = NULL;
+	search->peq = NULL;
+	search->cells = NULL;
+	search->wordpad = NULL;
+	search->dfa = NULL;
+	search->flags = 0;
+	search->pin = 0;
+	search->trie = NULL;
+	search->reader = -1;
+	search->reading = false;
+	search->shared = NULL;
+	search->process = NULL;
+	search->running = false;
+	search->started = false;
+	search->orphan = false;
+	search->waiting = false;
+	search->nextwait = NULL;
+	search->sending = false;
+	search->stalled = false;
+	search->draining = false;
+	search->nextstall = NULL;
+	search->began = 0;
+	search->topk = 0;
+	search->best = NULL;
+	search->keyorder = true;
+	search->chunk = NULL;
+	search->count = 0;
+	search->more = false;
+	search->sent = false;
+	search->task = NULL;
+	search->cachekey = NULL;
+	search->gen = 0;
+	search->levels = NULL;
+	search->results = eak_new();
+}
+
+
+/* byte rows parameters (padded word and row size) */
+static void searchBytes(Search *search)
+{
+	int size = (search->rowlen + LEV_PAD - 1) & ~(LEV_PAD - 1);
+
+	search->stride = LEV_PAD + size;
+	search->cap = search->maxlev + 1;
+	search->wordpad = ea_allocArray(uint8_t, size);
+
+	memset(search->wordpad, 0, size);
+	memcpy(search->wordpad + 1, search->word->data, search->word->length);
+}
+
+
+static void searchAlloc(Search *search)
+{
+	int i, len = search->word->length;
+
+	/* a key longer than word + maxlev has distance > maxlev and in
+	   suffix mode the search stops at word + maxsuflen */
+	search->maxdepth = len + MAX(search->maxlev, search->maxsuflen) + 1;
+
+	search->levels = ea_allocArray(Level, search->maxdepth);
+	search->keybuffer = eaz_new(search->maxdepth);
+	search->top = 0;
+	search->depth = 0;
+	search->limit = search->maxlev;
+
+	if (search->topk) {
+		search->best = ea_allocArray(Result*, search->topk);
+		search->nbest = 0;
+	}
+
+	if ((search->flags & LEV_DFA) && (search->maxlev < 255)) {
+		searchBytes(search);
+		dfaNew(search);
+		return;
+	}
+
+	if (len <= LEV_BITS) {
+		search->bits = ea_allocArray(BitRow, search->maxdepth + 1);
+		search->peq = ea_allocArray(uint64_t, 256);
+		search->mask = (len == 64) ? ~(uint64_t)0
+		                           : ((uint64_t)1 << len) - 1;
+
+		memset(search->peq, 0, 256 * sizeof(uint64_t));
+
+		for (i = 0; i < len; i++)
+			search->peq[(uint8_t)search->word->data[i]] |=
+			                                   (uint64_t)1 << i;
+
+		/* first row: row[i] = i */
+		search->bits[0].vp = search->mask;
+		search->bits[0].vn = 0;
+		return;
+	}
+
+	if (search->maxlev < 255) {
+		searchBytes(search);
+
+		search->cells = ea_allocArray(uint8_t, (search->maxdepth + 1) *
+		                                       search->stride);
+		search->cellmin = ea_allocArray(uint8_t, search->maxdepth + 1);
+
+		memset(search->cells, 255, (search->maxdepth + 1) *
+		                           search->stride);
+
+		/* first row */
+		for (i = 0; i < search->rowlen; i++)
+			search->cells[LEV_PAD + i] = MIN(i, search->cap);
+
+		search->cellmin[0] = 0;
+		return;
+	}
+
+	search->rows = ea_allocArray(int, (search->maxdepth + 1) *
+	                                  search->rowlen);
+
+	/* first row */
+	for (i = 0; i < search->rowlen; i++)
+		search->rows[i] = i;
+}
+
+
+static void searchFree(Search *search)
+{
+	if (search->rows)
+		ea_freeArray(int, (search->maxdepth + 1) * search->rowlen,
+		             search->rows);
+
+	if (search->bits)
+		ea_freeArray(BitRow, search->maxdepth + 1, search->bits);
+
+	if (search->peq)
+		ea_freeArray(uint64_t, 256, search->peq);
+
+	if (search->cells) {
+		ea_freeArray(uint8_t, (search->maxdepth + 1) * search->stride,
+		             search->cells);
+		ea_freeArray(uint8_t, search->maxdepth + 1, search->cellmin);
+	}
+
+	if (search->dfa)
+		dfaFree(search);
+
+	if (search->wordpad)
+		ea_freeArray(uint8_t, search->stride - LEV_PAD,
+		             search->wordpad);
+
+	if (search->levels)
+		ea_freeArray(Level, search->maxdepth, search->levels);
+
+	if (search->best) {
+		bestClear(search);
+		ea_freeArray(Result*, search->topk, search->best);
+	}
+
+	if (search->keybuffer)
+		eaz_free(search->keybuffer);
+}
+
+
+static int* searchRow(Search *search, int depth)
+{
+	return search->rows + depth * search->rowlen;
+}
+
+
+static uint8_t* searchCells(Search *search, int depth)
+{
+	return search->cells + depth * search->stride + LEV_PAD;
+}
+
+
+/* compute the row of depth d + 1 adding `letter` */
+static void searchRowNext(Search *search, int d, int letter)
+{
+	int lo, hi;
+
+	if (search->dfa) {
+		dfaNext(search, d, letter);
+	} else if (search->bits) {
+		levenshteinBits(search, search->bits + d + 1,
+		                search->bits + d, letter);
+	} else if (!searchBand(search, d + 1, &lo, &hi)) {
+		/* every cell > maxlev: the row is not used */
+		if (search->cells)
+			search->cellmin[d + 1] = search->cap;
+	} else if (search->cells) {
+		search->cellmin[d + 1] = levenshteinBytes(search,
+		                           searchCells(search, d + 1),
+		                           searchCells(search, d), letter,
+		                           lo, hi);
+	} else {
+		levenshteinRow(search, searchRow(search, d + 1),
+		               searchRow(search, d), letter, lo, hi);
+	}
+}
+
+
+/* min of the row of depth d (exact only if <= maxlev) */
+static int searchMin(Search *search, int d)
+{
+	int lo, hi;
+
+	if (search->dfa)
+		return search->dfa->states[search->dfa->path[d]].min;
+
+	if (search->bits)
+		return bitsMin(search, search->bits + d, d);
+
+	if (search->cells)
+		return search->cellmin[d];
+
+	if (!searchBand(search, d, &lo, &hi))
+		return search->maxlev + 1;
+
+	return rowMin(searchRow(search, d), lo, hi);
+}
+
+
+/* distance of the word from the first d letters of the key */
+static int searchDist(Search *search, int d)
+{
+	if (search->dfa)
+		return search->dfa->states[search->dfa->path[d]].dist;
+
+	if (search->bits) {
+		BitRow *row = search->bits + d;
+		return d + popcount64(row->vp) - popcount64(row->vn);
+	}
+
+	/* the last cell is out of the band */
+	if (search->rowlen - 1 > d + search->maxlev)
+		return search->maxlev + 1;
+
+	if (search->cells)
+		return searchCells(search, d)[search->rowlen - 1];
+
+	return searchRow(search, d)[search->rowlen - 1];
+}
+
+
+/*
+ * Check the keys of the edge of the current level and return true if the
+ * search must go deep (in the sub of the level cursor). The letters of a
+ * branch are consumed in a single loop: a branch has a value (and
+ * siblings) only at its end.
+ */
+static int searchVisit(Search *search)
+{
+	Level *level = search->levels + search->top;
+	int slen = search->word->length + search->maxsuflen;
+	int d = level->depth;
+	const uint8_t *letters;
+	uint8_t letter;
+	void *value;
+	int i, n, godeep;
+
+	if (!(n = ab_edge(&level->cursor, &letters))) {
+		letter = ab_letter(&level->cursor);
+		letters = &letter;
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++, d++) {
+		/* inside a branch: the suffix mode begins at word length
+		   (as in searchDown) */
+		if (i && (!level->suffmode) && search->maxsuflen &&
+		    (d >= search->word->length)) {
+			level->suffdist = searchMin(search, d);
+			level->suffmode = true;
+		}
+
+		DBG4 report("deep = %d/%d %.*s>'%c'", d, search->word->length,
+		            d, "----------------------------------------"
+		            "----------------------------------------",
+		            letters[i]);
+
+		search->keybuffer->data[d] = letters[i];
+
+		if (level->suffmode) {
+			/* suffix longer than maxsuflen (or a top-k bound
+			   lowered under the suffix distance) */
+			if ((d >= slen) || (level->suffdist > search->maxlev))
+				return false;
+		} else {
+			searchRowNext(search, d, letters[i]);
+
+			/* min(row) > maxlev => dist > maxlev: cannot go
+			   deep and the value (if any) cannot be added */
+			if (searchMin(search, d + 1) > search->maxlev)
+				return false;
+		}
+	}
+
+	search->keybuffer->length = search->depth = d;
+
+	godeep = ab_next(NULL, &level->cursor);
+
+	if (level->suffmode) {
+		DBG4 report("maxsuf = %d", search->maxsuflen);
+
+		if (ab_value(&level->cursor, &value))
+			resPush(search, value, level->suffdist, true);
+
+		if (godeep)
+			godeep = d < slen;
+	} else if (ab_value(&level->cursor, &value)) {
+		int dist = searchDist(search, d);
+
+		DBG4 report("found d=%d (max %d)", dist, search->maxlev);
+
+		if (dist <= search->maxlev)
+			resPush(search, value, dist, false);
+	}
+
+	return godeep;
+}
+
+
+/* push the level of the sub of the current level cursor */
+static void searchDown(Search *search)
+{
+	Level *prev = search->levels + search->top;
+	Level *level = prev + 1;
+	int d = search->depth;
+
+	assert(search->top + 1 < search->maxdepth);
+
+	search->top++;
+
+	ab_next(&level->cursor, &prev->cursor);
+	level->depth = d;
+	level->suffmode = prev->suffmode;
+	level->suffdist = prev->suffdist;
+
+	if ((!level->suffmode) && search->maxsuflen)
+		if (d >= search->word->length) {
+			DBG4 report("enable suffix-mode");
+
+			level->suffdist = searchMin(search, d);
+			level->suffmode = true;
+		}
+}
+
+
+/* put the root on the stack, false with an empty trie */
+static int searchRoot(Search *search)
+{
+	Level *root = search->levels;
+
+	search->top = 0;
+	search->depth = 0;
+
+	if (!ab_start(search->trie, &root->cursor))
+		return false;
+
+	root->depth = 0;
+	root->suffmode = false;
+	root->suffdist = 0;
+
+	return true;
+}
+
+
+/* top-k: start a pass with a greater maxlev if the last found < k keys */
+static int searchPass(Search *search)
+{
+	if ((!search->topk) || (search->nbest == search->topk) ||
+	    (search->maxlev >= search->limit))
+		return false;
+
+	bestClear(search);
+	search->maxlev++;
+
+	DBG3 report("lev top %d: pass maxlev = %d", search->topk,
+	            search->maxlev);
+
+	return searchRoot(search);
+}
+
+
+/* move to the next letter (pop the levels without one), false at end */
+static int searchNext(Search *search)
+{
+	while (!ab_seekNext(&search->levels[search->top].cursor)) {
+		if (search->top == 0)
+			return false;
+
+		search->top--;
+	}
+
+	return true;
+}
+
+
+/* allocate and put the root on the stack, false with an empty trie */
+static int searchStart(Search *search)
+{
+	DBG4 report("START rowlen = %d", search->rowlen);
+
+	searchAlloc(search);
+
+	/* top-k: first pass with maxlev = 0 */
+	if (search->topk)
+		search->maxlev = 0;
+
+	return searchRoot(search);
+}
+
+
+/*
+ * Visit up to n levels, return false at the end of the search. A streamed
+ * search stops with `more` set when its chunk is full.
+ */
+static int searchSteps(Search *search, int n)
+{
+	while (n--) {
+		if ((search->flags & LEV_STREAM) && (!search->draining) &&
+		    (search->chunk->length >= LEV_STREAM_SIZE)) {
+			search->more = true;
+			return true;
+		}
+
+		/* a chunk longer than a stream chunk (a list or a drained
+		   stream) doubles, not a resize for every record */
+		if (search->chunk &&
+		    (eaz_size(search->chunk) - search->chunk->length < 1024))
+			eaz_growBy(search->chunk, eaz_size(search->chunk));
+
+		if (searchVisit(search)) {
+			searchDown(search);
+		} else if ((!searchNext(search)) && (!searchPass(search))) {
+			if (search->topk)
+				bestEnd(search);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Compare any words in trie with a search-word using Levenshtein distance.
+ * All words whose distance is under a user defined threshold (max cost)
+ * are added in a list that rappresent the return value of this search.
+ *
+ * Taking advantage of trie structure, the computation of the common
+ * prefixes of different words is perfomed only one time.
+ *
+ * Levenshtein distance is perfomed with the two matrix rows approach
+ * adapted to a trie:
+ * https://en.wikipedia.org/wiki/Levenshtein_distance
+ * http://stevehanov.ca/blog/index.php?id=114
+ *
+ * The trie is visited depth first with an explicit stack of cursors
+ * (`levels`, one for every edge of the current key: a node letter or a
+ * whole branch label, consumed in a single loop) and every letter
+ * write its row in a matrix allocated once for the search: the row of
+ * depth d+1 is computed from the row of depth d.
+ * For example if the search word is "kitten" and current cursor is in the
+ * trie node 'G' of 'SITTING' the stack (with rows) is:
+ *
+ * search.word =     K I T T E N
+ * rows[0] =      [0 1 2 3 4 5 6]
+ * level0 - row = [1 1 2 3 4 5 6]  cursor S
+ * level1 - row = [2 2 1 2 3 4 5]  cursor I
+ * level2 - row = [3 3 2 1 2 3 4]  cursor T
+ * level3 - row = [4 4 3 2 1 2 3]  cursor T
+ * level4 - row = [5 5 4 3 2 2 3]  cursor I
+ * level5 - row = [6 6 5 4 3 3 2]  cursor N
+ * level6 - row = [7 7 6 5 4 4 3]  cursor G
+ *
+ * With a word up to LEV_BITS bytes a row is kept as two bit vectors (the
+ * +1 and -1 differences between adjacent cells) and a letter costs a few
+ * word operations (Myers algorithm).
+ *
+ * The search stops every LEV_STEP trie positions and yield to let the
+ * other tasks run.
+ *
+ * In top-k mode (LEV_TOPK) the keys are looked best first by distance
+ * layers: the search is done with maxlev = 0, 1, 2.. (a row min is a
+ * lower bound of the distances below it, so a pass visits only the trie
+ * part whose bound is <= maxlev) until a pass finds k keys; once k keys
+ * are kept, maxlev is lowered under the k-th distance to look only for
+ * closer keys.
+ *
+ * This kind of search allow to find (for example) "advance" also if search
+ * pattern contain a typo error like "advace" but cannot find a semantic
+ * similar word like "advanceness".
+ * To mitigate this problem user can enable the suffix mode search.
+ *
+ * In suffix mode, when the end of search-word is reached (with the min
+ * possible distance less than max cost) the algorithm continue
+ * trie digging. All words in the trie-branch with a suffix length
+ * under a user defined value will be added.
+ */
+ZMTASKDEF( tLevenshtein )
+{
+	ZMSELF(Search);
+
+	enum { START = 1, SEARCH };
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		if (!searchStart(self))
+			zmyield zmTERM;
+
+		zmpass;
+	}
+
+	zmstate SEARCH:
+	{
+		/* drained while a chunk was sent (see lev_stalls) */
+		if (self->draining)
+			zmyield zmTERM;
+
+		if (!searchSteps(self, LEV_STEP))
+			zmyield zmTERM;
+
+		/* stream: send a full chunk and go on later */
+		if (self->more)
+			zmyield zmCALLER | SEARCH;
+
+		zmyield SEARCH;
+	}
+
+	ZMEND
+}
+
+
+/*
+ * Parallel search (LEV_PARALLEL, or a big search, with the mainpool
+ * threads): the calling thread visits the top of the trie and splits it
+ * in parts, the subs with up to `grain` keys (the root children, or
+ * deeper subs of a skewed root), then every thread searches parts with
+ * its own Search (rows, levels and automaton) on the view of the
+ * search.
+ *
+ * The results of a worker are encoded in its chunk, or kept in its top-k
+ * heap (a worker bound is lowered by its own heap) and merged in the top-k
+ * heap of the search; the top-k passes are run in parallel one by one.
+ */
+typedef struct {
+	Level level;
+	/* key of the part: keys->data + key, level.depth bytes */
+	int key;
+	uint32_t count;
+} Part;
+
+typedef struct {
+	Search *search;
+	Search *workers;
+	int nworkers;
+	Part *parts;
+	int nparts;
+	int size;
+	eaz_String *keys;
+} Parallel;
+
+
+static int searchIsParallel(Search *search)
+{
+	if ((!mainpool) || (ea_poolThreads(mainpool) < 2))
+		return false;
+
+	if (search->flags & LEV_PARALLEL)
+		return true;
+
+	return (search->maxlev >= LEV_PARALLEL_MAXLEV) &&
+	       (ab_count(search->trie) >= LEV_PARALLEL_KEYS);
+}
+
+
+/* add the top level of the search (the sub just entered) as a part */
+static void partAdd(Parallel *par)
+{
+	Search *search = par->search;
+	Level *level = search->levels + search->top;
+	Part *part;
+
+	if (par->nparts == par->size) {
+		int size = (par->size) ? par->size * 2 : 64;
+
+		par->parts = ea_resizeArray(Part, par->size, size, par->parts);
+		par->size = size;
+	}
+
+	part = par->parts + par->nparts++;
+	part->level = *level;
+	part->key = par->keys->length;
+	part->count = ab_cursorCount(&search->levels[search->top - 1].cursor);
+
+	eaz_addData(par->keys, search->keybuffer->data, level->depth);
+}
+
+
+static int partCmp(const void *a, const void *b)
+{
+	const Part *x = a, *y = b;
+
+	/* the biggest first */
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+
+/* visit the top of the trie and split the subs with up to grain keys */
+static void searchPlan(Parallel *par, uint32_t grain)
+{
+	Search *search = par->search;
+
+	par->nparts = 0;
+	par->keys->length = 0;
+
+	if (!searchRoot(search))
+		return;
+
+	for (;;) {
+		if (searchVisit(search)) {
+			searchDown(search);
+
+			if (ab_cursorCount(&search->levels[search->top - 1].cursor)
+			                                                 > grain)
+				continue;
+
+			partAdd(par);
+			search->top--;
+		}
+
+		if (!searchNext(search))
+			break;
+	}
+
+	if (par->nparts)
+		qsort(par->parts, par->nparts, sizeof(Part), partCmp);
+}
+
+
+/* search a part (run by a pool thread) */
+static void partRun(void *data, int item, int thread)
+{
+	Parallel *par = data;
+	Part *part = par->parts + item;
+	Search *w = par->workers + thread;
+	int d, depth = part->level.depth;
+
+	/* the rows of the part key */
+	memcpy(w->keybuffer->data, par->keys->data + part->key, depth);
+
+	for (d = 0; d < depth; d++)
+		searchRowNext(w, d, (uint8_t)w->keybuffer->data[d]);
+
+	w->levels[0] = part->level;
+	w->top = 0;
+	w->depth = depth;
+
+	for (;;) {
+		if (searchVisit(w))
+			searchDown(w);
+		else if (!searchNext(w))
+			break;
+	}
+}
+
+
+/* move the results of the workers to the search */
+static void searchMerge(Parallel *par)
+{
+	Search *search = par->search;
+	int i, j;
+
+	for (i = 0; i < par->nworkers; i++) {
+		Search *w = par->workers + i;
+
+		if (!search->topk) {
+			if (w->count)
+				eaz_add(search->chunk, w->chunk);
+
+			search->count += w->count;
+			w->chunk->length = 0;
+			w->count = 0;
+			continue;
+		}
+
+		for (j = 0; j < w->nbest; j++) {
+			Result *r = w->best[j];
+
+			if (r->dist > search->maxlev)
+				resFree(r);
+			else
+				bestAdd(search, r);
+		}
+
+		w->nbest = 0;
+	}
+}
+
+
+static void searchParallel(Search *search)
+{
+	Parallel par;
+	uint32_t grain;
+	int i;
+
+	par.search = search;
+	par.nworkers = ea_poolThreads(mainpool);
+	par.workers = ea_allocArray(Search, par.nworkers);
+	par.parts = NULL;
+	par.nparts = par.size = 0;
+	par.keys = eaz_new(256);
+
+	grain = ab_count(search->trie) / (par.nworkers * LEV_PARTS) + 1;
+
+	searchAlloc(search);
+
+	for (i = 0; i < par.nworkers; i++) {
+		Search *w = par.workers + i;
+
+		searchInit(w);
+		w->trie = search->trie;
+		w->word = search->word;
+		w->rowlen = search->rowlen;
+		w->maxlev = search->maxlev;
+		w->maxsuflen = search->maxsuflen;
+		w->flags = search->flags;
+		w->topk = search->topk;
+		w->keyorder = false;
+
+		searchAlloc(w);
+
+		if (!w->topk)
+			w->chunk = eaz_new(LEV_STREAM_SIZE);
+	}
+
+	/* top-k: first pass with maxlev = 0, the results of the workers
+	   are merged in any order */
+	if (search->topk)
+		search->maxlev = 0;
+
+	search->keyorder = false;
+
+	for (;;) {
+		searchPlan(&par, grain);
+
+		DBG3 report("lev parallel: %d parts (grain %u) maxlev = %d",
+		            par.nparts, grain, search->maxlev);
+
+		for (i = 0; i < par.nworkers; i++)
+			par.workers[i].maxlev = search->maxlev;
+
+		ea_poolRun(mainpool, partRun, &par, par.nparts);
+
+		searchMerge(&par);
+
+		if ((!search->topk) || (search->nbest == search->topk) ||
+		    (search->maxlev >= search->limit))
+			break;
+
+		bestClear(search);
+		search->maxlev++;
+	}
+
+	if (search->topk)
+		bestEnd(search);
+
+	for (i = 0; i < par.nworkers; i++) {
+		Search *w = par.workers + i;
+
+		/* the word is owned by the search */
+		w->word = NULL;
+
+		searchFree(w);
+
+		if (w->chunk)
+			eaz_free(w->chunk);
+
+		eak_free(w->results);
+	}
+
+	ea_freeArray(Search, par.nworkers, par.workers);
+
+	if (par.parts)
+		ea_freeArray(Part, par.size, par.parts);
+
+	eaz_free(par.keys);
+}
+
+
+/*
+ * A search reads a view of maintrie (with a shared trie the view stays
+ * valid while SET changes the trie, see ab_readBegin), begun and ended in
+ * the event loop. Also a search of the event loop (no search threads): it
+ * yields every LEV_STEP levels and while a chunk is sent, and SET runs
+ * meanwhile. With all the reader slots used the task waits (RESP_WAIT)
+ * for the end of another view.
+ *
+ * Search threads (mainsearch): the search is a job that encodes the
+ * results in the chunk, so the event loop only sends them; a streamed
+ * search stops at every full chunk and is pushed again while the chunk
+ * is sent. The task waits for the job with RESP_WAIT and lev_done wakes
+ * it.
+ *
+ * An open view holds back ab_reclaim (the woods and values retired by
+ * SET meanwhile), the steps of FLUSHALL and DEFRAG: a client that doesn't
+ * read its stream would hold it forever. So a view older than
+ * LEV_VIEW_TIME with a stalled send is drained: the job (or the event
+ * loop for a search of the loop) puts the rest of the results in the
+ * chunk and the view ends.
+ */
+
+/* searches waiting for a reader slot (levwait is the first) */
+static Search *levwait = NULL;
+static Search *levwaitlast = NULL;
+
+/* searches with the next chunk ready while a chunk is sent */
+static Search *levstall = NULL;
+
+/* the server stops: the waiting tasks are closed, not woken */
+static int levstop = false;
+
+
+/* begin the view of the search, false if no reader slot is free */
+static int searchBegin(Search *search)
+{
+	if (ab_isShared(maintrie)) {
+		search->reader = ab_readerJoin(maintrie);
+
+		if (search->reader == -1)
+			return false;
+	}
+
+	ab_readBegin(maintrie, search->reader, &search->view);
+	search->trie = &search->view;
+	search->reading = true;
+	search->began = time(NULL);
+
+	return true;
+}
+
+
+static void searchWait(Search *search)
+{
+	search->waiting = true;
+	search->nextwait = NULL;
+
+	if (levwaitlast)
+		levwaitlast->nextwait = search;
+	else
+		levwait = search;
+
+	levwaitlast = search;
+}
+
+
+static void searchUnwait(Search *search)
+{
+	Search **s = &levwait, *prev = NULL;
+
+	while (*s != search) {
+		prev = *s;
+		s = &prev->nextwait;
+	}
+
+	*s = search->nextwait;
+
+	if (levwaitlast == search)
+		levwaitlast = prev;
+
+	search->waiting = false;
+}
+
+
+static void searchStall(Search *search)
+{
+	search->stalled = true;
+	search->nextstall = levstall;
+	levstall = search;
+}
+
+
+static void searchUnstall(Search *search)
+{
+	Search **s = &levstall;
+
+	while (*s != search)
+		s = &(*s)->nextstall;
+
+	*s = search->nextstall;
+	search->stalled = false;
+}
+
+
+/* the view is too old to wait for the send of a chunk */
+static int searchOld(Search *search, time_t now)
+{
+	return (now - search->began >= LEV_VIEW_TIME);
+}
+
+
+/* resume the task waiting for the search (RESP_WAIT) */
+static void searchWake(zm_VM *vm, Search *search)
+{
+	if (!search->shared->wait)
+		return;
+
+	search->shared->wait = false;
+
+	if (zm_isSuspended(search->process))
+		zm_resume(vm, search->process, NULL);
+}
+
 
+/* end the view of the search and give its slot to a waiting search */
+static void searchClose(zm_VM *vm, Search *search)
+{
+	if (!search->reading)
+		return;
 
-typedef struct {
-	eaz_String *key;
-	eaz_String *value; // TODO remove values in lev/suf search, only keys
-	int dist;
-	int suffix;
-} Result;
+	ab_readEnd(maintrie, search->reader);
 
+	if (search->reader != -1)
+		ab_readerLeave(maintrie, search->reader);
 
-typedef struct {
-	eak_Stack *results;
-	eaz_String *word;
-	eaz_String *keybuffer;
-	int rowlen;
-	int maxlev;
-	int maxsuflen;
-} Search;
+	search->reader = -1;
+	search->reading = false;
+	search->trie = NULL;
 
+	/* free the woods and the values that the view kept */
+	ab_reclaim(maintrie);
 
-static void resFree(Result *r)
+	if (levwait && !levstop) {
+		Search *w = levwait;
+
+		searchUnwait(w);
+		searchWake(vm, w);
+	}
+}
+
+
+/* run by a search thread: the whole search, or up to a full chunk */
+static void searchJob(void *data)
 {
-	eaz_free(r->key);
-	eaz_free(r->value);
-	ea_free(Result, r);
+	Search *search = data;
+
+	if (!search->started) {
+		search->started = true;
+
+		if (searchIsParallel(search)) {
+			searchParallel(search);
+			return;
+		}
+
+		if (!searchStart(search))
+			return;
+	}
+
+	while (searchSteps(search, LEV_STEP) && (!search->more));
 }
 
-static Result* resPop(Search *s)
+
+static void searchPush(Search *search)
 {
-	return eak_pop(s->results).p;
+	search->running = true;
+	ea_queuePush(mainsearch, searchJob, search);
 }
 
-static void resPush(Search *search, void *v, int d, int suffmode)
+
+static void searchDestroy(zm_VM *vm, Search *search)
 {
-	Result *r = ea_alloc(Result);
+	if (search->waiting)
+		searchUnwait(search);
 
-	r->key = eaz_dup(search->keybuffer, 0);
-	r->value = eaz_dup(v, 0);
-	r->dist = d;
-	r->suffix = suffmode;
+	if (search->stalled)
+		searchUnstall(search);
 
-	DBG4 report("push key=`%.*s`", r->key->length, r->key->data);
+	searchClose(vm, search);
+	searchFree(search);
 
-	eak_push(search->results)->p = r;
-}
+	if (search->word)
+		eaz_free(search->word);
 
+	if (search->chunk)
+		eaz_free(search->chunk);
 
-static void printRow(Search *search, int *row, int head)
-{
-	int i;
+	if (search->cachekey)
+		eaz_free(search->cachekey);
 
-	if (head) {
-		report("{");
-		for (i = 0; i < search->word->length; i++)
-			printf(" %c", search->word->data[i]);
-		report("}");
+	while(eak_isntEmpty(search->results)) {
+		resFree(eak_pop(search->results).p);
 	}
 
-	report("{");
+	eak_free(search->results);
 
-	printf("row = ");
+	if (search->pin)
+		val_unpin(search->pin);
 
-	for (i = 0; i < search->rowlen; i++) {
-		printf(" %d", row[i]);
-	}
+	ea_free(Search, search);
+}
 
-	report("}");
+
+void lev_stop()
+{
+	levstop = true;
 }
 
 
-static int rowMin(int *row, int len)
+void lev_done(zm_VM *vm)
 {
-	int min = row[0];
+	Search *search;
 
-	for (int i = 1; i < len; i++)
-		if (row[i] < min)
-			min = row[i];
+	while ((search = ea_queueDone(mainsearch))) {
+		search->running = false;
 
-	return min;
+		/* the task is closed */
+		if (search->orphan) {
+			searchDestroy(vm, search);
+			continue;
+		}
+
+		/* the chunk is still sent (see lev_stalls) */
+		if (search->more && search->sending)
+			searchStall(search);
+
+		/* the results are all in the chunk */
+		if (search->draining)
+			searchClose(vm, search);
+
+		searchWake(vm, search);
+	}
 }
 
 
-static void levenshteinRow(Search *search, int *row, int *prev, char letter)
+int lev_stalls(zm_VM *vm)
 {
-	int i;
+	time_t now = time(NULL);
+	Search **s = &levstall;
+	int wait = -1;
 
-	row[0] = prev[0] + 1;
+	while (*s) {
+		Search *search = *s;
 
-	DBG4 report("levensthein");
-	DBG4 printRow(search, prev, true);
+		if (!searchOld(search, now)) {
+			int left = (int)(search->began + LEV_VIEW_TIME - now);
 
+			if ((wait == -1) || (left * 1000 < wait))
+				wait = left * 1000;
 
-	for (i = 1; i < search->rowlen; i++) {
-		int ins = row[i-1] + 1;
-		int del = prev[i] + 1;
-		int rep = prev[i-1];
+			s = &search->nextstall;
+			continue;
+		}
 
-		if (search->word->data[i-1] != letter)
-			rep++;
+		DBG3 report("LEV stalled send: drain the search");
 
-		row[i] = MIN(ins, MIN(del, rep));
+		*s = search->nextstall;
+		search->stalled = false;
+		search->draining = true;
+		search->more = false;
+
+		if (mainsearch) {
+			searchPush(search);
+			continue;
+		}
+
+		/* a search of the event loop: tLevenshtein ends after it */
+		while (searchSteps(search, LEV_STEP));
+		searchClose(vm, search);
 	}
 
-	DBG4 printRow(search, row, false);
+	return wait;
 }
-/*
- * This class instance tasks that recusively, compare any words in
- * trie with a search-word using Levenshtein distance.
- * All words whose distance is under a user defined threshold (max cost)
- * are added in a list that rappresent the return value of this search.
- *
- * Taking advantage of trie structure, the computation of the common
- * prefixes of different words is perfomed only one time.
- *
- * Levenshtein distance is perfomed with the two matrix rows approach
- * adapted to a trie:
- * https://en.wikipedia.org/wiki/Levenshtein_distance
- * http://stevehanov.ca/blog/index.php?id=114
- *
- * The first task on the trie-root create the first row of the matrix and
- * instance sub-tasks to analize each trie branch. The same behaviour is
- * followed by the branch sub-tasks.
- * For example if the search word is "kitten" and current task is in the
- * trie node 'G' of 'SITTING' the excution stack (with row) is:
- *
- * search.word =     K I T T E N
- * task1 - row0 = [0 1 2 3 4 5 6]
- *         row =  [1 1 2 3 4 5 6]  cursor S
- * task2 - row =  [2 2 1 2 3 4 5]  cursor I
- * task3 - row =  [3 3 2 1 2 3 4]  cursor T
- * task4 - row =  [4 4 3 2 1 2 3]  cursor T
- * task5 - row =  [5 5 4 3 2 2 3]  cursor I
- * task6 - row =  [6 6 5 4 3 3 2]  cursor N
- * task7 - row =  [7 7 6 5 4 4 3]  cursor G
 
- * This kind of search allow to find (for example) "advance" also if search
- * pattern contain a typo error like "advace" but cannot find a semantic
- * similar word like "advanceness".
- * To mitigate this problem user can enable the suffix mode search.
- *
- * In suffix mode, when the end of search-word is reached (with the min
- * possible distance less than max cost) the algorithm continue
- * trie digging. All words in the trie-branch with a suffix length
- * under a user defined value will be added.
- *
- *
- *
+
+/*
+ * LEV cache: the encoded responses of the last searches by request (the
+ * flags that change the response, maxlev, maxsuflen, k and the word) in
+ * a LRU list of at most `max` bytes. An entry is valid only with the write
+ * generation of maintrie it was searched with (see mainwrites), a stale
+ * entry is dropped when it is found. Used only by the event loop.
  */
+#define LEV_CACHE_FLAGS (LEV_TOPK | LEV_STREAM | LEV_KEYS)
 
-ZMTASKDEF( tLevenshtein )
-{
-	struct LevStep {
-		Search *search;
-		ab_Cursor cursor;
-		int *row;
-		int *row0;
-		int deep;
-		struct {
-			char *list;
-			int index;
-			int len;
-		} bro;
-		int suffdist;
-		int suffmode;
-	} *self = zmdata;
-
-	Search *search = self->search;
-
-	enum { START = 1, ROOT, BRANCH, SEARCH, ITER, ITER2, LEV};
+/* an entry is at most 1 / LEV_CACHE_PART of the cache */
+#define LEV_CACHE_PART 16
 
-	ZMSTATES
+typedef struct CacheEntry_ CacheEntry;
 
-	zmstate ZM_INIT:
-	{
-		search = (Search*)zmdata;
-		self = ea_alloc(struct LevStep);
-		self->row = NULL;
-		self->row0 = NULL;
-		self->search = search;
-		self->bro.list = NULL;
-		self->bro.index = 0;
-		self->bro.len = 0;
-		zmdata = self;
-		zmyield zmDONE;
-	}
+struct CacheEntry_ {
+	eaz_String *key;
+	/* a list response, or the chunk of a stream sent in one chunk */
+	eaz_String *resp;
+	uint32_t count;
+	uint64_t gen;
+	size_t bytes;
+	/* LRU list: prev is more recent */
+	CacheEntry *prev;
+	CacheEntry *next;
+};
+
+static struct {
+	ab_Hash *index;
+	CacheEntry *first;
+	CacheEntry *last;
+	size_t bytes;
+	size_t max;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evicts;
+} levcache = { NULL, NULL, NULL, 0, 0, 0, 0, 0 };
+
+
+/* copy of a response (an empty chunk too) */
+static eaz_String* cacheDup(eaz_String *resp)
+{
+	eaz_String *s = eaz_new(resp->length + 1);
 
+	if (resp->length)
+		eaz_add(s, resp);
 
-	zmstate ROOT:
-	{
-		int i;
+	return s;
+}
 
-		DBG4 report("ROOT rowlen = %d", search->rowlen);
 
-		if (!ab_start(maintrie, &self->cursor))
-		    zmyield zmTERM;
+static void cacheUnlink(CacheEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		levcache.first = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		levcache.last = e->prev;
+}
 
-		self->deep = 0;
-		self->suffdist = 0;
-		self->suffmode = false;
-		self->row = ea_allocArray(int, search->rowlen);
-		self->row0 = ea_allocArray(int, search->rowlen);
 
-		/* first row */
-		for (i = 0; i < search->rowlen; i++)
-			self->row0[i] = i;
+static void cacheLinkFirst(CacheEntry *e)
+{
+	e->prev = NULL;
+	e->next = levcache.first;
 
-		zmyield SEARCH;
-	}
+	if (levcache.first)
+		levcache.first->prev = e;
+	else
+		levcache.last = e;
 
+	levcache.first = e;
+}
 
-	zmstate START:
-	{
-		DBG4 report("START...");
 
-		if (!zmarg)
-			zmyield ROOT;
+static void cacheDrop(CacheEntry *e)
+{
+	cacheUnlink(e);
+	ab_hashDel(levcache.index, e->key->data, e->key->length);
 
-		zmpass;
-	}
+	levcache.bytes -= e->bytes;
 
+	eaz_free(e->key);
+	eaz_free(e->resp);
+	ea_free(CacheEntry, e);
+}
 
-	zmstate BRANCH: {
-		struct LevStep *prev = zmarg;
 
-		ab_next(&self->cursor, &prev->cursor);
-		self->deep = prev->deep + 1;
-		self->suffmode = prev->suffmode;
-		self->suffdist = prev->suffdist;
+/* the key of the request of the search (NULL without cache) */
+static eaz_String* cacheKey(Search *search)
+{
+	eaz_String *key;
 
-		if (self->deep >= eaz_size(search->keybuffer))
-			eaz_growTo(search->keybuffer, self->deep + 64);
+	if (!levcache.index)
+		return NULL;
 
-		if ((!self->suffmode) && search->maxsuflen)
-			if (self->deep >= search->word->length) {
-				int d = rowMin(prev->row, search->rowlen);
+	key = eaz_new(5 + search->word->length);
+	eaz_addU8(key, search->flags & LEV_CACHE_FLAGS);
+	eaz_addU8(key, search->maxlev);
+	eaz_addU8(key, search->maxsuflen);
+	eaz_addU16(key, search->topk, true);
+	eaz_add(key, search->word);
 
-				DBG4 report("enable suffix-mode");
+	return key;
+}
 
-				self->suffdist = d;
-				self->suffmode = true;
-			}
 
-		if (!self->suffmode)
-			self->row = ea_allocArray(int, search->rowlen);
+static CacheEntry* cacheGet(eaz_String *key)
+{
+	void **v = ab_hashGet(levcache.index, key->data, key->length);
+	CacheEntry *e = (v) ? *v : NULL;
 
-		zmpass;
+	if (e && (e->gen != mainwrites)) {
+		cacheDrop(e);
+		e = NULL;
 	}
 
+	if (!e) {
+		levcache.misses++;
+		return NULL;
+	}
 
-	zmstate SEARCH:
-	{
-		self->bro.len = ab_choices(&self->cursor, NULL);
-
-		//if (self->bro.len > 1)
-		self->bro.list = ea_allocArray(char, self->bro.len);
-		ab_choices(&self->cursor, self->bro.list);
+	levcache.hits++;
 
-		DBG4 report("choices: ''%.*s''", self->bro.len, self->bro.list);
+	cacheUnlink(e);
+	cacheLinkFirst(e);
 
-		zmpass;
-	}
+	return e;
+}
 
 
-	zmstate ITER:
-	{
-		char letter;
-		int godeep;
+/* store a copy of the response of the search (if maintrie is unchanged) */
+static void cachePut(Search *search, eaz_String *resp, uint32_t count)
+{
+	eaz_String *key = search->cachekey;
+	CacheEntry *e;
+	void **v;
+	size_t bytes;
 
-		if (self->bro.index >= self->bro.len)
-			zmyield zmTERM;
+	if ((!key) || (search->gen != mainwrites))
+		return;
 
-		letter = self->bro.list[self->bro.index];
+	bytes = sizeof(CacheEntry) + key->length + resp->length;
 
-		if (self->bro.index)
-			ab_seek(&self->cursor, letter);
+	if (bytes > levcache.max / LEV_CACHE_PART)
+		return;
 
-		search->keybuffer->data[self->deep] = letter;
-		search->keybuffer->length = self->deep + 1;
-		self->bro.index++;
+	/* a request run again by another client meanwhile */
+	v = ab_hashGet(levcache.index, key->data, key->length);
 
-		DBG4 report("deep = %d/%d %.*s>'%c'", self->deep,
-		            search->word->length, self->deep,
-		            "----------------------------------------"
-		            "----------------------------------------",
-		            letter);
+	if (v)
+		cacheDrop(*v);
 
-		godeep = ab_next(NULL, &self->cursor);
+	while (levcache.last && (levcache.bytes + bytes > levcache.max)) {
+		cacheDrop(levcache.last);
+		levcache.evicts++;
+	}
 
-		if (self->suffmode) {
-			void *value;
-			DBG4 report("maxsuf = %d", search->maxsuflen);
+	e = ea_alloc(CacheEntry);
+	e->key = key;
+	e->resp = cacheDup(resp);
+	e->count = count;
+	e->gen = search->gen;
+	e->bytes = bytes;
 
-			if (ab_value(&self->cursor, &value))
-				resPush(search, value, self->suffdist, true);
+	search->cachekey = NULL;
 
-			if (godeep) {
-				int slen = search->word->length +
-				           search->maxsuflen;
-				godeep = (self->deep + 1) < slen;
-			}
-		} else {
-			void *value;
-			int *prev;
-			int min;
+	ab_hashPut(levcache.index, key->data, key->length, e);
+	cacheLinkFirst(e);
 
-			if (self->deep == 0)
-				prev = self->row0;
-			else
-				prev = zmCallerData(struct LevStep)->row;
+	levcache.bytes += bytes;
+}
 
 
-			levenshteinRow(search, self->row, prev,
-			             ab_letter(&self->cursor));
+void lev_cacheInit(size_t max)
+{
+	if (!max)
+		return;
 
+	levcache.index = ab_hashNew();
+	levcache.max = max;
+}
 
-			min = rowMin(self->row, search->rowlen);
 
-			if (min > search->maxlev) {
-				/* min(row) > maxlev => dist > maxlev
-				 * cannot go deep and current cursor
-				 * value also if exists cannot be added
-				 */
-				godeep = false;
-			} else if (ab_value(&self->cursor, &value)) {
-				int dist = self->row[search->rowlen - 1];
+void lev_cacheFree()
+{
+	if (!levcache.index)
+		return;
 
-				DBG4 report("found d=%d (max %d)", dist,
-						search->maxlev);
+	while (levcache.first)
+		cacheDrop(levcache.first);
 
-				if (dist <= search->maxlev)
-					resPush(search, value, dist, false);
-			}
-		}
+	ab_hashFree(levcache.index);
+	levcache.index = NULL;
+}
 
-		if (!godeep)
-			zmyield ITER;
 
+static void addU64(eaz_String *s, uint64_t n)
+{
+	eaz_addU32(s, (uint32_t)(n >> 32), true);
+	eaz_addU32(s, (uint32_t)n, true);
+}
 
-		DBG4 report("have next... go deep");
 
-		zmyield zmSU(tLevenshtein, search, self) | ITER;
-	}
+/*
+ * Process Stats Command: the counters of the LEV cache
+ *
+ * response: u64 hits, misses, evicts, entries, bytes
+ */
+ZMTASKDEF( tProcessStats )
+{
+	enum {START = 1};
 
+	ZMSTATES
 
-	zmstate ZM_TERM:
+	zmstate START:
 	{
-		if (self->row)
-			ea_freeArray(int, self->search->rowlen, self->row);
+		eaz_String *res = eaz_new(40);
+
+		DBG2 report("STATS");
 
-		if (self->row0)
-			ea_freeArray(int, self->search->rowlen, self->row0);
+		addU64(res, levcache.hits);
+		addU64(res, levcache.misses);
+		addU64(res, levcache.evicts);
+		addU64(res, (levcache.index) ? levcache.index->count : 0);
+		addU64(res, levcache.bytes);
 
-		if (self->bro.list)
-			ea_freeArray(char, self->bro.len, self->bro.list);
+		zmresult = ARGZ("i>S", RESP_STR, res);
 
-		ea_free(struct LevStep, self);
+		zmyield zmTERM;
 	}
 
 	ZMEND
@@ -405,7 +2342,8 @@ ZMTASKDEF( tProcessLev )
 {
 	ZMSELF(Search);
 
-	enum {START=1, PLEV, PLEV_SEARCH, PLEV_RESULT};
+	enum {START=1, FLAGS, PLEV, PLEV_PARAM, PLEV_TOPK, PLEV_CACHE,
+	      PLEV_SEARCH, PLEV_WAIT, PLEV_RESULT, PLEV_MORE};
 
 	ZMSTATES
 
@@ -413,22 +2351,35 @@ ZMTASKDEF( tProcessLev )
 	{
 		DBG4 report("INIT");
 		zmdata = self = ea_alloc(Search);
-		self->word = NULL;
-		self->rowlen = 0;
-		self->maxlev = 0;
-		self->maxsuflen = 0;
-		self->keybuffer = NULL;
-		self->results = eak_new();
+		searchInit(self);
 
 		zmyield zmDONE;
 	}
 
 	zmstate START:
 	{
+		Shared *root = zmRootData(Shared);
+
+		/* LEVX: fetch the flags before the key */
+		if (zmarg) {
+			arg_in(zmarg, "i = levx");
+			arg_i(zmarg);
+
+			zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT8)) |
+			                                      zmNEXT(FLAGS);
+		}
+
 		/* fetch the key */
 		zmyield zmSU(tKeyStr, NULL, NULL) | PLEV;
 	}
 
+	zmstate FLAGS: arg_in(zmarg, "u8 = flags");
+	{
+		self->flags = arg_u8(zmarg);
+
+		zmyield zmSU(tKeyStr, NULL, NULL) | PLEV;
+	}
+
 	zmstate PLEV: arg_in(zmarg, "S = eaz_String* key");
 	{
 		Shared *root = zmRootData(Shared);
@@ -443,76 +2394,252 @@ ZMTASKDEF( tProcessLev )
 		DBG4 report("PLEV rowlen = %d", self->rowlen);
 
 		zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT16)) |
-		                                  zmNEXT(PLEV_SEARCH);
+		                                  zmNEXT(PLEV_PARAM);
 	}
 
-	zmstate PLEV_SEARCH: arg_in(zmarg, "u16 = maxlev + maxsuflen");
+	zmstate PLEV_PARAM: arg_in(zmarg, "u16 = maxlev + maxsuflen");
 	{
+		Shared *root = zmRootData(Shared);
 		int levparam = arg_u16(zmarg);
 
-		self->keybuffer = eaz_new(128);
 		self->maxlev = levparam & 0xFF;
 		self->maxsuflen = (levparam >> 8) & 0xFF;
 
-		DBG2 report("LEV '%.*s' %d %d", self->word->length,
-		            self->word->data, self->maxlev, self->maxsuflen);
+		if (self->flags & LEV_STREAM)
+			self->chunk = eaz_new(LEV_STREAM_SIZE + 1024);
+
+		/* LEV_TOPK: fetch k */
+		if (self->flags & LEV_TOPK)
+			zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT16)) |
+			                                  zmNEXT(PLEV_TOPK);
+
+		zmyield PLEV_CACHE;
+	}
+
+	zmstate PLEV_TOPK: arg_in(zmarg, "u16 = k");
+	{
+		self->topk = arg_u16(zmarg);
+
+		/* top 0: nothing to search */
+		if (!self->topk)
+			zmyield PLEV_RESULT;
+
+		zmpass;
+	}
+
+	zmstate PLEV_CACHE:
+	{
+		CacheEntry *e = NULL;
+
+		self->cachekey = cacheKey(self);
+		self->gen = mainwrites;
 
-		zmyield zmSU(tLevenshtein, self, NULL) | PLEV_RESULT;
+		if (self->cachekey)
+			e = cacheGet(self->cachekey);
+
+		if (e) {
+			DBG2 report("LEV '%.*s' %d %d (flags %d) cached",
+			            self->word->length, self->word->data,
+			            self->maxlev, self->maxsuflen, self->flags);
+
+			if (self->flags & LEV_STREAM)
+				zmresult = ARGZ("i>S>i", RESP_END,
+				                cacheDup(e->resp), e->count);
+			else
+				zmresult = ARGZ("i>S", RESP_LST,
+				                cacheDup(e->resp));
+
+			zmyield zmTERM;
+		}
+
+		zmpass;
+	}
+
+	zmstate PLEV_SEARCH:
+	{
+		Shared *root = zmRootData(Shared);
+		int parallel = false;
+
+		DBG2 report("LEV '%.*s' %d %d (flags %d)", self->word->length,
+		            self->word->data, self->maxlev, self->maxsuflen,
+		            self->flags);
+
+		self->shared = root;
+		self->process = zmRoot();
+
+		/* all the reader slots are used: wait for one */
+		if (!searchBegin(self)) {
+			searchWait(self);
+			root->wait = true;
+			root->stream = zmCurrent();
+			zmresult = ARGZ("i", RESP_WAIT);
+
+			zmyield zmCALLER | PLEV_SEARCH;
+		}
+
+		if (!mainsearch)
+			parallel = searchIsParallel(self);
+
+		/* a parallel search encodes the results of the workers, a
+		   search thread its results */
+		if ((parallel || mainsearch) && !self->chunk)
+			self->chunk = eaz_new(LEV_STREAM_SIZE + 1024);
+
+		/* stored results use the values of the trie until the
+		   response is encoded */
+		if ((!self->chunk || self->topk) && !(self->flags & LEV_KEYS))
+			self->pin = val_pin();
+
+		if (mainsearch) {
+			searchPush(self);
+			zmyield PLEV_WAIT;
+		}
+
+		if (parallel) {
+			searchParallel(self);
+			zmyield PLEV_RESULT;
+		}
+
+		self->task = zmNewSu(tLevenshtein, self);
+
+		zmyield zmSUB(self->task, NULL) | PLEV_RESULT;
+	}
+
+	zmstate PLEV_WAIT:
+	{
+		Shared *root = zmRootData(Shared);
+
+		if (!self->running)
+			zmyield PLEV_RESULT;
+
+		/* woken by lev_done */
+		root->wait = true;
+		root->stream = zmCurrent();
+		zmresult = ARGZ("i", RESP_WAIT);
+
+		zmyield zmCALLER | PLEV_RESULT;
 	}
 
 	zmstate PLEV_RESULT:
 	{
 		eak_Element *item;
 		eaz_String *s;
+		uint32_t count;
 		int size = 4;
 
+		if (self->more) {
+			/* send a chunk, the search goes on in PLEV_MORE */
+			self->more = false;
+			self->sent = true;
+			self->sending = true;
+
+			zmresult = ARGZ("i>S", RESP_CHUNK, self->chunk);
+			zmRootData(Shared)->stream = zmCurrent();
+			self->chunk = eaz_new(LEV_STREAM_SIZE + 1024);
+
+			/* the search thread goes on while the chunk is sent
+			   (to the end with an old view) */
+			if (mainsearch) {
+				self->draining = searchOld(self, time(NULL));
+				searchPush(self);
+			} else {
+				/* the event loop search waits for the send */
+				searchStall(self);
+			}
+
+			zmyield zmCALLER | PLEV_MORE;
+		}
+
+		/* the results left use the pinned values */
+		searchClose(vm, self);
+
+		if (self->chunk) {
+			/* the top-k results after the others */
+			while (eak_isntEmpty(self->results)) {
+				Result* r = resPop(self);
+
+				resEncode(self, self->chunk, r->key, r->value,
+				          r->dist, r->suffix);
+				resFree(r);
+			}
+
+			/* parallel search: a list of the encoded results */
+			if (!(self->flags & LEV_STREAM)) {
+				s = eaz_new(4 + self->chunk->length);
+				eaz_addU32(s, self->count, true);
+
+				if (self->count)
+					eaz_add(s, self->chunk);
+
+				cachePut(self, s, self->count);
+
+				zmresult = ARGZ("i>S", RESP_LST, s);
+				zmyield zmTERM;
+			}
+
+			DBG3 report("streamed %u results", self->count);
+
+			/* the response is a single chunk */
+			if (!self->sent)
+				cachePut(self, self->chunk, self->count);
+
+			zmresult = ARGZ("i>S>i", RESP_END, self->chunk,
+			                self->count);
+			self->chunk = NULL;
+
+			zmyield zmTERM;
+		}
+
 		DBG3 report("found %d results", eak_size(self->results));
 
 		item = self->results->head;
 
 		while(item) {
 			Result* r = item->data.p;
-			size += 10 + r->key->length + r->value->length;
+			size += resSize(self, r->key, r->value);
 			item = item->next;
 		}
 
+		count = eak_size(self->results);
 		s = eaz_new(size);
-		eaz_addU32(s, eak_size(self->results), true);
+		eaz_addU32(s, count, true);
 
 		while(eak_isntEmpty(self->results)) {
 			Result* r = resPop(self);
 
-			eaz_addU8(s, r->dist);
-			eaz_addU8(s, r->suffix);
-
-			eaz_addU32(s, r->key->length, true);
-			eaz_add(s, r->key);
-
-			eaz_addU32(s, r->value->length, true);
-			eaz_add(s, r->value);
-
+			resEncode(self, s, r->key, r->value, r->dist,
+			          r->suffix);
 			resFree(r);
 		}
 
+		cachePut(self, s, count);
+
 		zmresult = ARGZ("i>S", RESP_LST, s);
 
 		zmyield zmTERM;
 	}
 
-	zmstate ZM_TERM:
-		if (self->keybuffer)
-			eaz_free(self->keybuffer);
+	zmstate PLEV_MORE:
+	{
+		self->sending = false;
 
-		if (self->word)
-			eaz_free(self->word);
+		if (self->stalled)
+			searchUnstall(self);
 
-		while(eak_isntEmpty(self->results)) {
-			resFree(eak_pop(self->results).p);
-		}
+		if (mainsearch)
+			zmyield PLEV_WAIT;
 
-		eak_free(self->results);
+		zmyield zmSUB(self->task, NULL) | PLEV_RESULT;
+	}
+
+	zmstate ZM_TERM:
+		/* a search thread still uses it: lev_done frees it */
+		if (self->running) {
+			self->orphan = true;
+			zmyield zmEND;
+		}
 
-		ea_free(Search, self);
+		searchDestroy(vm, self);
 ZMEND }
 
 
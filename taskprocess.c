@@ -46,6 +46,14 @@
 #define CMD_SET 1
 #define CMD_GET 2
 #define CMD_LEV 3
+#define CMD_SCAN 4
+#define CMD_COUNT 5
+#define CMD_RANK 6
+#define CMD_SELECT 7
+#define CMD_DEFRAG 8
+#define CMD_FLUSHALL 9
+#define CMD_LEVX 10
+#define CMD_STATS 11
 
 /*
  * every string (eaz_String) passed as argument in levin must be a
@@ -67,7 +75,7 @@ ZMTASKDEF( tFetchIter )
 		int extracted;
 
 		union {
-			char b32[4];
+			uint8_t b32[4];
 			char *ptr;
 		} data;
 
@@ -129,7 +137,7 @@ ZMTASKDEF( tFetchIter )
 
 		DBG4 report("READ");
 
-		b = ((self->integer) ? (self->data.b32) : (self->data.ptr));
+		b = ((self->integer) ? (char*)(self->data.b32) : (self->data.ptr));
 		b += self->extracted;
 
 		DBG4 report("%d/%d", self->extracted, self->size);
@@ -190,7 +198,7 @@ ZMTASKDEF( tFetchIter )
 			arg_set(ar, "u16", r);
 			break;
 		case FETCH_INT32:
-			r = (self->data.b32[0] << 24);
+			r = ((uint32_t)self->data.b32[0] << 24);
 			r += (self->data.b32[1] << 16);
 			r += (self->data.b32[2] << 8);
 			r += self->data.b32[3];
@@ -228,7 +236,7 @@ ZMTASKDEF( tRequest )
 {
 	Shared *self = zmdata;
 
-	enum {REQ = 1, VER, CMD, RES};
+	enum {REQ = 1, VER, CMD, RES, MORE};
 
 	ZMSTATES
 
@@ -283,6 +291,47 @@ ZMTASKDEF( tRequest )
 			s = zmNewSu(tProcessLev, NULL);
 			zmyield zmSUB(s, NULL) | RES;
 
+		case CMD_LEVX:
+			/* LEV with a flags byte before the key */
+			DBG4 report("process LEVX");
+			s = zmNewSu(tProcessLev, NULL);
+			zmyield zmSUB(s, ARGZ("i", 1)) | RES;
+
+		case CMD_SCAN:
+			DBG4 report("process SCAN");
+			s = zmNewSu(tProcessScan, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_COUNT:
+			DBG4 report("process COUNT");
+			s = zmNewSu(tProcessCount, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_RANK:
+			DBG4 report("process RANK");
+			s = zmNewSu(tProcessRank, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_SELECT:
+			DBG4 report("process SELECT");
+			s = zmNewSu(tProcessSelect, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_DEFRAG:
+			DBG4 report("process DEFRAG");
+			s = zmNewSu(tProcessDefrag, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_FLUSHALL:
+			DBG4 report("process FLUSHALL");
+			s = zmNewSu(tProcessFlush, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
+		case CMD_STATS:
+			DBG4 report("process STATS");
+			s = zmNewSu(tProcessStats, NULL);
+			zmyield zmSUB(s, NULL) | RES;
+
 		default:
 			zmraise zmABORT(ERR_RUN, "unknow command kind", NULL);
 		}
@@ -292,9 +341,24 @@ ZMTASKDEF( tRequest )
 	{
 		DBG4 report("zmyield to parent for response");
 		zmresult = zmarg;
+
+		/* a chunk of a streamed response: the command goes on
+		   after the send */
+		if (self->stream)
+			zmyield zmCALLER | MORE;
+
 		zmyield zmCALLER | REQ;
 	}
 
+	zmstate MORE:
+	{
+		zm_State *s = self->stream;
+
+		self->stream = NULL;
+
+		zmyield zmSUB(s, NULL) | RES;
+	}
+
 ZMEND }
 
 
@@ -313,6 +377,8 @@ ZMTASKDEF( tProcess )
 		eab_Note *req;
 		eab_Note *res;
 		zm_State *process;
+		/* a streamed response header is sent */
+		int streaming;
 	} *self = zmdata;
 
 	enum {
@@ -320,6 +386,7 @@ ZMTASKDEF( tProcess )
 		RESP,
 		FILL,
 		SEND,
+		WAIT,
 		QUIT,
 	};
 
@@ -335,6 +402,9 @@ ZMTASKDEF( tProcess )
 		zmdata = self = ea_alloc(struct Data);
 		self->shared.argz = arg_new();
 		self->shared.ifetch = NULL;
+		self->shared.stream = NULL;
+		self->shared.wait = false;
+		self->streaming = false;
 		self->fd = *socket;
 		self->req = eab_new();
 		self->res = eab_new();
@@ -435,6 +505,49 @@ ZMTASKDEF( tProcess )
 			DBG4 report("!set response: %s", data);
 			break;
 
+		case RESP_CHUNK:
+		case RESP_END:
+			DBG4 report("RESP - CHUNK,END");
+			instr = arg_S(zmarg);
+			len = (self->streaming) ? 0 : 1;
+			len += (instr->length) ? (4 + instr->length) : 0;
+			len += (kind == RESP_END) ? 8 : 0;
+			out = eaz_new(len);
+
+			/*
+			 * streamed response: kind 2 then the chunks (u32
+			 * length + data), a zero length and the u32 count
+			 */
+			if (!self->streaming) {
+				eaz_addU8(out, 2);
+				self->streaming = true;
+			}
+
+			if (instr->length) {
+				eaz_addU32(out, instr->length, true);
+				eaz_add(out, instr);
+			}
+
+			if (kind == RESP_END) {
+				eaz_addU32(out, 0, true);
+				eaz_addU32(out, arg_i(zmarg), true);
+				self->streaming = false;
+			}
+
+			DBG3 report("send response chunk (%d bytes)",
+			            out->length);
+
+			eaz_free(instr);
+			eaz_toLnk(out);
+			data = eaz_lnkFree(out, &len);
+			eab_push(self->res, data, len, false);
+
+			zmyield SEND;
+
+		case RESP_WAIT:
+			DBG4 report("RESP - WAIT");
+			zmyield WAIT;
+
 		default:
 			ea_fatal("resp_new: unknow response kind %d", kind);
 			zmyield zmTERM;
@@ -468,15 +581,12 @@ ZMTASKDEF( tProcess )
 	zmstate SEND:
 	{
 		eab_Note *res = self->res;
-		int size, len, trunc = false;
+		int size, len, total;
 		char *msg;
 
-		msg = eab_stickGet(res, &size);
+		msg = eab_stickGet(res, &total);
 
-		if (size > WRITE_BUFFER_LEN) {
-			trunc = true;
-			size = WRITE_BUFFER_LEN;
-		}
+		size = (total > WRITE_BUFFER_LEN) ? WRITE_BUFFER_LEN : total;
 
 
 		DBG4 {
@@ -501,18 +611,35 @@ ZMTASKDEF( tProcess )
 
 		DBG3 report("sended %d / %d / tot %d",len, size, eab_len(res));
 
-		if (trunc)
-			eab_stickShift(res, WRITE_BUFFER_LEN);
+		/* a short write keeps the rest of the stick */
+		if (len < total)
+			eab_stickShift(res, len);
 		else
 			eab_stickPop(res);
 
 
-		if (eab_isEmpty(res))
+		if (eab_isEmpty(res)) {
+			/* streamed response: resume the command */
+			if (self->shared.stream)
+				zmyield zmSSUB(self->process, NULL) | QUIT |
+				                 zmNEXT(RESP) | zmCATCH(FILL);
+
 			zmyield READ;
+		}
 
 		zmyield SEND;
 	}
 
+	zmstate WAIT:
+	{
+		/* resumed by lev_done, or by an event of the socket */
+		if (self->shared.wait)
+			zmyield zmSUSPEND | WAIT;
+
+		zmyield zmSSUB(self->process, NULL) | QUIT | zmNEXT(RESP) |
+		                                             zmCATCH(FILL);
+	}
+
 	zmstate QUIT:
 	{
 		DBG3 report("request close connection");
@@ -45,10 +45,21 @@
 #define ERR_USR     3            /* user error */
 #define EXCEPT_CLO  4            /* connection close exception */
 
+/*
+ * RESP_CHUNK and RESP_END are the parts of a streamed response: a chunk
+ * is sent while the command goes on (Shared.stream is resumed after the
+ * send), RESP_END carries the last chunk and the records count.
+ *
+ * RESP_WAIT sends nothing: the command waits a search thread and
+ * Shared.stream is resumed when Shared.wait is cleared (see lev_done).
+ */
 enum {
 	RESP_LST,
 	RESP_STR,
 	RESP_MSG,
+	RESP_CHUNK,
+	RESP_END,
+	RESP_WAIT,
 };
 
 enum {
@@ -61,6 +72,8 @@ enum {
 typedef struct {
 	zm_State *ifetch;
 	arg_Arg *argz;
+	zm_State *stream;
+	int wait;
 } Shared;
 
 
@@ -69,12 +82,55 @@ zm_Machine* tProcess;
 zm_Machine* tProcessSet;
 zm_Machine* tProcessGet;
 zm_Machine* tProcessLev;
+zm_Machine* tProcessScan;
+zm_Machine* tProcessCount;
+zm_Machine* tProcessRank;
+zm_Machine* tProcessSelect;
+zm_Machine* tProcessDefrag;
+zm_Machine* tProcessFlush;
+zm_Machine* tProcessStats;
 
 zm_Machine* tKeyStr;
+zm_Machine* tOptKeyStr;
 zm_Machine* tLookup;
 
 eaz_String* resp_new(uint8_t kind, void *replydata);
 
+/* the server stops: don't wake the searches waiting for a view */
+void lev_stop();
+
+/* wake the tasks of the finished searches (see mainsearch) */
+void lev_done(zm_VM *vm);
+
+/* drain the searches with an old view and a stalled send, return the
+   milliseconds to the next check (-1: none) */
+int lev_stalls(zm_VM *vm);
+
+/* LEV cache of at most `max` bytes (0: no cache) */
+void lev_cacheInit(size_t max);
+void lev_cacheFree();
+
+
+/*
+ * Stored values: a value up to VAL_INLINE bytes is encoded in the trie
+ * value pointer itself (low bit set, length in the low byte, data in the
+ * other bytes), a longer value is an eaz_String. Values of a snapshot trie
+ * are records of the mapped image (see ab_snapValue).
+ */
+#define VAL_INLINE ((int)sizeof(void*) - 1)
+
+void* val_new(eaz_String *s);
+void* val_newFrom(char *data, int len);
+void val_free(void *v);
+int val_len(void *v);
+void val_add(eaz_String *dest, void *v);
+char* val_data(void *v, int *len, char *tmp);
+
+/* keep the values of the trie valid while a search uses them */
+uint64_t val_pin();
+void val_unpin(uint64_t gen);
+void val_retire(void *v);
+
 #define ARGZ(...) arg_set(zmRootData(Shared)->argz, __VA_ARGS__)
 
 #endif
@@ -33,10 +33,245 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <assert.h>
 
 #include "taskprocess.h"
 
 
+
+/*
+ * Values
+ */
+#define VAL_TAG 1
+
+static int val_isInline(void *v)
+{
+	return ((uintptr_t)v & VAL_TAG) != 0;
+}
+
+/* a value holding a copy of `data` */
+void* val_newFrom(char *data, int len)
+{
+	uintptr_t u;
+	int i;
+
+	if (len > VAL_INLINE) {
+		eaz_String *s = eaz_new(len);
+		eaz_addData(s, data, len);
+		return s;
+	}
+
+	u = VAL_TAG | (len << 1);
+
+	for (i = 0; i < len; i++)
+		u |= (uintptr_t)(uint8_t)data[i] << (8 * (i + 1));
+
+	return (void*)u;
+}
+
+/* take ownership of `s`: the string is freed if the value is inlined */
+void* val_new(eaz_String *s)
+{
+	void *v;
+
+	if (s->length > VAL_INLINE)
+		return s;
+
+	v = val_newFrom(s->data, s->length);
+
+	eaz_free(s);
+
+	return v;
+}
+
+void val_free(void *v)
+{
+	if (!val_isInline(v) && !ab_isSnapValue(v))
+		eaz_free((eaz_String*)v);
+}
+
+int val_len(void *v)
+{
+	int len;
+
+	if (val_isInline(v))
+		return ((uintptr_t)v & 0xff) >> 1;
+
+	if (ab_isSnapValue(v)) {
+		ab_snapValue(v, &len);
+		return len;
+	}
+
+	return ((eaz_String*)v)->length;
+}
+
+/* data of the value (an inline value is decoded in `tmp`) */
+char* val_data(void *v, int *len, char *tmp)
+{
+	int i;
+
+	if (ab_isSnapValue(v))
+		return ab_snapValue(v, len);
+
+	if (!val_isInline(v)) {
+		*len = ((eaz_String*)v)->length;
+		return ((eaz_String*)v)->data;
+	}
+
+	*len = val_len(v);
+
+	for (i = 0; i < *len; i++)
+		tmp[i] = ((uintptr_t)v >> (8 * (i + 1))) & 0xff;
+
+	return tmp;
+}
+
+void val_add(eaz_String *dest, void *v)
+{
+	char buf[sizeof(void*)];
+	char *data;
+	int len;
+
+	if (!val_isInline(v) && !ab_isSnapValue(v)) {
+		eaz_add(dest, (eaz_String*)v);
+		return;
+	}
+
+	data = val_data(v, &len, buf);
+
+	if (len == 0)
+		return;
+
+	eaz_addData(dest, data, len);
+}
+
+/*
+ * Value pins: a LEV search keeps the value pointers of its results (no
+ * copy) until the response is encoded. A search pins the current
+ * generation; a value replaced or removed (val_retire) while there are
+ * pins is freed only when every pin of its generation or older is gone.
+ */
+typedef struct {
+	uint64_t gen;
+	int count;
+} ValPin;
+
+typedef struct {
+	uint64_t gen;
+	void *value;
+} ValRetired;
+
+static uint64_t valgen = 1;
+
+/* pins[pinhead..npins) by generation */
+static ValPin *pins = NULL;
+static int pinhead = 0;
+static int npins = 0;
+static int pinsize = 0;
+
+/* retired[rethead..nretired) in generation order */
+static ValRetired *retired = NULL;
+static int rethead = 0;
+static int nretired = 0;
+static int retsize = 0;
+
+static void val_reclaim()
+{
+	while (rethead < nretired) {
+		ValRetired *r = retired + rethead;
+
+		if ((pinhead < npins) && (r->gen >= pins[pinhead].gen))
+			break;
+
+		val_free(r->value);
+		rethead++;
+	}
+
+	if (rethead == nretired)
+		rethead = nretired = 0;
+}
+
+uint64_t val_pin()
+{
+	if ((pinhead < npins) && (pins[npins - 1].gen == valgen)) {
+		pins[npins - 1].count++;
+		return valgen;
+	}
+
+	if (npins == pinsize) {
+		if (pinhead > 0) {
+			npins -= pinhead;
+			memmove(pins, pins + pinhead, npins * sizeof(ValPin));
+			pinhead = 0;
+		} else {
+			int size = (pinsize) ? pinsize * 2 : 16;
+			pins = ea_resizeArray(ValPin, pinsize, size, pins);
+			pinsize = size;
+		}
+	}
+
+	pins[npins].gen = valgen;
+	pins[npins].count = 1;
+	npins++;
+
+	return valgen;
+}
+
+void val_unpin(uint64_t gen)
+{
+	int i;
+
+	for (i = pinhead; i < npins; i++) {
+		if (pins[i].gen == gen) {
+			assert(pins[i].count > 0);
+			pins[i].count--;
+			break;
+		}
+	}
+
+	assert(i < npins);
+
+	while ((pinhead < npins) && (pins[pinhead].count == 0))
+		pinhead++;
+
+	if (pinhead == npins)
+		pinhead = npins = 0;
+
+	val_reclaim();
+}
+
+/* free the value of a changed key when no search can use it */
+void val_retire(void *v)
+{
+	if (pinhead == npins) {
+		val_free(v);
+		return;
+	}
+
+	if (nretired == retsize) {
+		if (rethead > 0) {
+			nretired -= rethead;
+			memmove(retired, retired + rethead,
+			        nretired * sizeof(ValRetired));
+			rethead = 0;
+		} else {
+			int size = (retsize) ? retsize * 2 : 256;
+			retired = ea_resizeArray(ValRetired, retsize, size,
+			                         retired);
+			retsize = size;
+		}
+	}
+
+	retired[nretired].gen = valgen;
+	retired[nretired].value = v;
+	nretired++;
+
+	/* searches pinned from now on don't see `v` */
+	valgen++;
+}
+
+
+
 /*
  * Get Key
  */
@@ -99,6 +334,55 @@ ZMTASKDEF( tKeyStr )
 
 
 
+/*
+ * Get an optional key (an empty key is allowed)
+ */
+ZMTASKDEF( tOptKeyStr )
+{
+	enum {START = 1, GETLEN, GETKEY};
+
+	Shared *root = zmdata;
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		zmdata = root = zmRootData(Shared);
+
+		zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT32)) |
+		                                      zmNEXT(GETLEN);
+	}
+
+	zmstate GETLEN: arg_in(zmarg, "u32 = keylen");
+	{
+		uint32_t len = arg_u32(zmarg);
+
+		if (len > 1024)
+			zmraise zmABORT(ERR_RUN, "key len > 1024", NULL);
+
+		if (len == 0) {
+			zmresult = ARGZ("S", eaz_new(1));
+			zmyield zmTERM;
+		}
+
+		zmyield zmSUB(root->ifetch, ARGZ("i>i", FETCH_STR, len)) |
+		                                           zmNEXT(GETKEY);
+	}
+
+	zmstate GETKEY: arg_in(zmarg, "S = eaz_String* key");
+	{
+		zmresult = ARGZ("S", arg_S(zmarg));
+
+		zmyield zmTERM;
+	}
+
+	ZMEND
+}
+
+
+
+
+
 /*
  * Process Get Command
  */
@@ -122,16 +406,15 @@ ZMTASKDEF( tProcessGet )
 	zmstate LKUP: arg_in(zmarg, "S = eaz_String* key");
 	{
 		eaz_String *k = arg_S(zmarg);
-		ab_Look lo;
+		void *val;
 
 		DBG2 report("GET '%.*s'", k->length, k->data);
 
-		if (ab_find(&lo, maintrie, k->data, k->length)) {
-			eaz_String *val = (eaz_String *)ab_get(&lo);
-			eaz_String *res = eaz_new(eaz_size(val) + 1);
+		if (ab_lookup(maintrie, k->data, k->length, &val)) {
+			eaz_String *res = eaz_new(val_len(val) + 1);
 
 			eaz_addChar(res, '@');
-			eaz_add(res, val);
+			val_add(res, val);
 
 			zmresult = ARGZ("i>S", RESP_STR, res);
 		} else {
@@ -218,16 +501,25 @@ ZMTASKDEF( tProcessSet )
 		DBG2 report("SET `%.*s` (value: %d bytes)", k->length,
 		            k->data, val->length);
 
+		if (ab_readOnly(maintrie)) {
+			eaz_free(k);
+			eaz_free(val);
+			zmresult = ARGZ("i>p", RESP_MSG, "!read only");
+			zmyield zmTERM;
+		}
+
 		ab_find(&lo, maintrie, k->data, k->length);
 
 		if (ab_found(&lo)) {
-			eaz_String *old = (eaz_String *)ab_get(&lo);
+			void *old = ab_get(&lo);
 
+			/* readers of a shared trie can still use the old value */
 			if (val) /* replace */
-				eaz_free(old);
+				ab_retire(maintrie, val_retire, old);
 		}
 
-		ab_set(&lo, val);
+		ab_set(&lo, val_new(val));
+		mainwrites++;
 
 		zmresult = ARGZ("i>p", RESP_MSG, "OK");
 
@@ -249,3 +541,452 @@ ZMTASKDEF( tProcessSet )
 }
 
 
+
+/*
+ * Scan
+ */
+#define SCAN_VALUES 1
+#define SCAN_PREFIX 2
+
+#define SCAN_DEFAULT_LIMIT 100
+
+typedef struct {
+	int flags;
+	eaz_String *from;
+	eaz_String *to;
+	int limit;
+
+	eaz_String *out;
+	eaz_String *last;
+	int count;
+	int more;
+} Scan;
+
+
+static void scanPutU32(eaz_String *s, int pos, uint32_t n)
+{
+	s->data[pos] = (n >> 24) & 0xFF;
+	s->data[pos + 1] = (n >> 16) & 0xFF;
+	s->data[pos + 2] = (n >> 8) & 0xFF;
+	s->data[pos + 3] = n & 0xFF;
+}
+
+
+static int scanCmp(char *a, int alen, char *b, int blen)
+{
+	int r = memcmp(a, b, (alen < blen) ? alen : blen);
+
+	if (r)
+		return r;
+
+	return alen - blen;
+}
+
+
+/* ab_scan callback: add a key to the page */
+static int scanKey(void *data, char *key, int len, void *value)
+{
+	Scan *self = data;
+
+	if (self->flags & SCAN_PREFIX) {
+		eaz_String *p = self->from;
+
+		if ((len < p->length) || memcmp(key, p->data, p->length))
+			return false;
+
+	} else if (self->to->length) {
+		if (scanCmp(key, len, self->to->data, self->to->length) >= 0)
+			return false;
+	}
+
+	if (self->count == self->limit) {
+		self->more = true;
+		return false;
+	}
+
+	eaz_addU32(self->out, len, true);
+	eaz_addData(self->out, key, len);
+
+	if (self->flags & SCAN_VALUES) {
+		eaz_addU32(self->out, val_len(value), true);
+		val_add(self->out, value);
+	}
+
+	eaz_let(self->last, key, len);
+	self->count++;
+
+	return true;
+}
+
+
+/*
+ * Process Scan Command
+ *
+ * request: u8 flags, str from (or prefix), str to, u16 limit, str token
+ * response: u32 count, count * (str key [str value]), str token
+ *
+ * Keys are in [from, to) (an empty `to` is unbounded) or start with the
+ * prefix. A page is at most `limit` keys: to get the next page repeat the
+ * request with the returned token (an empty token means no more keys).
+ */
+ZMTASKDEF( tProcessScan )
+{
+	enum {START = 1, FLAGS, FROM, TO, LIMIT, TOKEN};
+
+	ZMSELF(Scan);
+
+	ZMSTATES
+
+	zmstate ZM_INIT:
+	{
+		zmdata = self = ea_alloc(Scan);
+		self->from = NULL;
+		self->to = NULL;
+		self->out = NULL;
+		self->last = NULL;
+		zmyield zmDONE;
+	}
+
+	zmstate START:
+	{
+		Shared *root = zmRootData(Shared);
+
+		zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT8)) |
+		                                      zmNEXT(FLAGS);
+	}
+
+	zmstate FLAGS: arg_in(zmarg, "u8 = flags");
+	{
+		self->flags = arg_u8(zmarg);
+		zmyield zmSU(tOptKeyStr, NULL, NULL) | FROM;
+	}
+
+	zmstate FROM: arg_in(zmarg, "S = eaz_String* from");
+	{
+		self->from = arg_S(zmarg);
+		zmyield zmSU(tOptKeyStr, NULL, NULL) | TO;
+	}
+
+	zmstate TO: arg_in(zmarg, "S = eaz_String* to");
+	{
+		Shared *root = zmRootData(Shared);
+
+		self->to = arg_S(zmarg);
+
+		zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT16)) |
+		                                      zmNEXT(LIMIT);
+	}
+
+	zmstate LIMIT: arg_in(zmarg, "u16 = limit");
+	{
+		self->limit = arg_u16(zmarg);
+
+		if (self->limit == 0)
+			self->limit = SCAN_DEFAULT_LIMIT;
+
+		zmyield zmSU(tOptKeyStr, NULL, NULL) | TOKEN;
+	}
+
+	zmstate TOKEN: arg_in(zmarg, "S = eaz_String* token");
+	{
+		eaz_String *token = arg_S(zmarg);
+		eaz_String *out;
+
+		DBG2 report("SCAN `%.*s` `%.*s` flags=%d limit=%d",
+		            self->from->length, self->from->data,
+		            self->to->length, self->to->data,
+		            self->flags, self->limit);
+
+		self->out = eaz_new(1024);
+		self->last = eaz_new(64);
+		self->count = 0;
+		self->more = false;
+
+		/* placeholder for count */
+		eaz_addU32(self->out, 0, true);
+
+		if (token->length)
+			ab_scan(maintrie, token->data, token->length, true,
+			        scanKey, self);
+		else
+			ab_scan(maintrie, self->from->data, self->from->length,
+			        false, scanKey, self);
+
+		eaz_free(token);
+
+		scanPutU32(self->out, 0, self->count);
+
+		/* token: the last key of the page */
+		if (self->more) {
+			eaz_addU32(self->out, self->last->length, true);
+			eaz_add(self->out, self->last);
+		} else {
+			eaz_addU32(self->out, 0, true);
+		}
+
+		DBG3 report("scan %d keys (more = %d)", self->count,
+		            self->more);
+
+		out = self->out;
+		self->out = NULL;
+
+		zmresult = ARGZ("i>S", RESP_LST, out);
+
+		zmyield zmTERM;
+	}
+
+	zmstate ZM_TERM:
+		if (!self)
+			zmyield zmEND;
+
+		if (self->from)
+			eaz_free(self->from);
+
+		if (self->to)
+			eaz_free(self->to);
+
+		if (self->out)
+			eaz_free(self->out);
+
+		if (self->last)
+			eaz_free(self->last);
+
+		ea_free(Scan, self);
+	ZMEND
+}
+
+
+
+/*
+ * Counts
+ */
+static eaz_String* countResp(uint32_t n)
+{
+	eaz_String *res = eaz_new(4);
+
+	eaz_addU32(res, n, true);
+
+	return res;
+}
+
+
+/*
+ * Process Count Command: number of keys starting with a prefix (an empty
+ * prefix count all keys)
+ */
+ZMTASKDEF( tProcessCount )
+{
+	enum {START = 1, COUNT};
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		zmyield zmSU(tOptKeyStr, NULL, NULL) | COUNT;
+	}
+
+	zmstate COUNT: arg_in(zmarg, "S = eaz_String* prefix");
+	{
+		eaz_String *p = arg_S(zmarg);
+		uint32_t n = ab_countPrefix(maintrie, p->data, p->length);
+
+		DBG2 report("COUNT `%.*s` = %u", p->length, p->data, n);
+
+		eaz_free(p);
+
+		zmresult = ARGZ("i>S", RESP_STR, countResp(n));
+
+		zmyield zmTERM;
+	}
+
+	ZMEND
+}
+
+
+/*
+ * Process Rank Command: number of keys lower than a key
+ */
+ZMTASKDEF( tProcessRank )
+{
+	enum {START = 1, RANK};
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		zmyield zmSU(tKeyStr, NULL, NULL) | RANK;
+	}
+
+	zmstate RANK: arg_in(zmarg, "S = eaz_String* key");
+	{
+		eaz_String *k = arg_S(zmarg);
+		uint32_t n = ab_rank(maintrie, k->data, k->length);
+
+		DBG2 report("RANK `%.*s` = %u", k->length, k->data, n);
+
+		eaz_free(k);
+
+		zmresult = ARGZ("i>S", RESP_STR, countResp(n));
+
+		zmyield zmTERM;
+	}
+
+	ZMEND
+}
+
+
+/*
+ * Process Select Command: the n-th (from 0) key starting with a prefix
+ *
+ * request: str prefix, u32 n
+ * response: '@' + str key + value or a '!' message
+ */
+ZMTASKDEF( tProcessSelect )
+{
+	enum {START = 1, INDEX, SELECT};
+
+	struct Data {
+		eaz_String *prefix;
+	} *self = zmdata;
+
+	ZMSTATES
+
+	zmstate ZM_INIT:
+	{
+		zmdata = self = ea_alloc(struct Data);
+		self->prefix = NULL;
+		zmyield zmDONE;
+	}
+
+	zmstate START:
+	{
+		zmyield zmSU(tOptKeyStr, NULL, NULL) | INDEX;
+	}
+
+	zmstate INDEX: arg_in(zmarg, "S = eaz_String* prefix");
+	{
+		Shared *root = zmRootData(Shared);
+
+		self->prefix = arg_S(zmarg);
+
+		zmyield zmSUB(root->ifetch, ARGZ("i", FETCH_INT32)) |
+		                                     zmNEXT(SELECT);
+	}
+
+	zmstate SELECT: arg_in(zmarg, "u32 = n");
+	{
+		eaz_String *p = self->prefix;
+		uint32_t n = arg_u32(zmarg);
+		char key[1024];
+		void *val;
+		int len;
+
+		DBG2 report("SELECT `%.*s` %u", p->length, p->data, n);
+
+		len = ab_select(maintrie, p->data, p->length, n, key,
+		                sizeof(key), &val);
+
+		if (len == -1) {
+			zmresult = ARGZ("i>p", RESP_MSG, "!index out of range");
+		} else {
+			eaz_String *res;
+
+			/* keys are never longer than 1024 (see tKeyStr) */
+			assert(len <= (int)sizeof(key));
+
+			res = eaz_new(len + val_len(val) + 5);
+
+			eaz_addChar(res, '@');
+			eaz_addU32(res, len, true);
+			eaz_addData(res, key, len);
+			val_add(res, val);
+
+			zmresult = ARGZ("i>S", RESP_STR, res);
+		}
+
+		zmyield zmTERM;
+	}
+
+	zmstate ZM_TERM:
+		if (!self)
+			zmyield zmEND;
+
+		if (self->prefix)
+			eaz_free(self->prefix);
+
+		ea_free(struct Data, self);
+	ZMEND
+}
+
+
+
+/*
+ * Process Defrag Command: start a defragmentation pass of the trie (the
+ * main loop moves a slice of the trie when there are no tasks to run)
+ */
+ZMTASKDEF( tProcessDefrag )
+{
+	enum {START = 1};
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		char *msg = "OK";
+
+		DBG2 report("DEFRAG");
+
+		if (ab_readOnly(maintrie)) {
+			msg = "!read only";
+		} else if (maindefrag) {
+			msg = "!defrag running";
+		} else {
+			maindefrag = ea_alloc(ab_Defrag);
+			ab_defragStart(maindefrag, maintrie);
+		}
+
+		zmresult = ARGZ("i>p", RESP_MSG, msg);
+
+		zmyield zmTERM;
+	}
+
+	ZMEND
+}
+
+
+
+/*
+ * Process Flushall Command: remove every key at once (the detached keys
+ * are freed by the main loop when there are no tasks to run, a flush
+ * during a running one adds its keys to it)
+ */
+ZMTASKDEF( tProcessFlush )
+{
+	enum {START = 1};
+
+	ZMSTATES
+
+	zmstate START:
+	{
+		char *msg = "OK";
+
+		DBG2 report("FLUSHALL");
+
+		if (ab_readOnly(maintrie)) {
+			msg = "!read only";
+		} else if (mainflush) {
+			ab_clearAdd(mainflush);
+			mainwrites++;
+		} else {
+			mainflush = ea_alloc(ab_Clear);
+			ab_clearStart(mainflush, maintrie, val_retire);
+			mainwrites++;
+		}
+
+		zmresult = ARGZ("i>p", RESP_MSG, msg);
+
+		zmyield zmTERM;
+	}
+
+	ZMEND
+}
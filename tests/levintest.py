@@ -0,0 +1,78 @@
+"""
+Helpers of the regression tests: start a levin-server (./levin or the
+binary in $LEVIN) with some options, connect clients, stop it at the end.
+A test fails with an exception, or if the server doesn't exit cleanly
+(a sanitizer build exits with an error code).
+"""
+
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, '..', 'client'))
+
+import levin
+
+
+class Server:
+    def __init__(self, *args):
+        self.args = [str(a) for a in args]
+        self.proc = None
+
+    def __enter__(self):
+        binary = os.environ.get('LEVIN', os.path.join(HERE, '..', 'levin'))
+        self.log = tempfile.TemporaryFile()
+        self.proc = subprocess.Popen([binary] + self.args, stdout = self.log,
+                                     stderr = subprocess.STDOUT)
+
+        # wait for the listen socket (a dump is loaded before)
+        deadline = time.time() + 120
+        while True:
+            try:
+                c = levin.Client()
+                c.connect()
+                c.logout()
+                return self
+            except Exception:
+                if self.proc.poll() is not None or time.time() > deadline:
+                    raise RuntimeError('server not started:\n' + self.output())
+                time.sleep(0.05)
+
+    def __exit__(self, kind, value, tb):
+        self.proc.send_signal(signal.SIGINT)
+        code = self.proc.wait(120)
+
+        if kind is not None:
+            sys.stderr.write(self.output())
+        elif code != 0:
+            raise RuntimeError('server exit code %d:\n%s' % (code,
+                                                             self.output()))
+        return False
+
+    def output(self):
+        self.log.seek(0)
+        return self.log.read().decode('latin1')
+
+    def client(self, timeout = 60):
+        c = levin.Client()
+        c.connect(timeout)
+        return c
+
+
+def dump(records):
+    """ a sorted dump of (key, value) records for -l """
+    f = tempfile.NamedTemporaryFile('wb', suffix = '.tsv', delete = False)
+    for k, v in sorted(records):
+        f.write(k.encode('latin1') + b'\t' + v.encode('latin1') + b'\n')
+    f.close()
+    return f.name
+
+
+def run(*tests):
+    for t in tests:
+        t()
+        print('%s: %s ok' % (os.path.basename(sys.argv[0]), t.__name__))
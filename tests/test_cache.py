@@ -0,0 +1,113 @@
+"""
+LEV cache: a repeated search is a hit with the same response, a SET or a
+FLUSHALL invalidates it, the cache stays under its size (-c) evicting
+the oldest responses.
+"""
+
+import random
+
+from levintest import Server, run
+
+
+def words(n, seed = 1):
+    rnd = random.Random(seed)
+    return sorted(set(''.join(rnd.choice('abc')
+                              for _ in range(rnd.randint(1, 8)))
+                      for _ in range(n)))
+
+
+def results(c, word, **opts):
+    res = c.lev(word, 2, 2, **opts)
+    return sorted((bytes(r['word']), r['lev'], r['suffix'],
+                   r['data'] and bytes(r['data'])) for r in res)
+
+
+VARIANTS = (dict(), dict(stream = False), dict(values = False),
+            dict(top = 5), dict(top = 5, stream = False))
+
+
+def test_hits():
+    with Server() as srv:
+        c = srv.client()
+        for k in words(3000):
+            c.set(k, 'v')
+
+        for opts in VARIANTS:
+            before = c.stats()
+            first = results(c, 'abca', **opts)
+            second = results(c, 'abca', **opts)
+            after = c.stats()
+
+            assert first == second, opts
+            assert after['misses'] == before['misses'] + 1, opts
+            assert after['hits'] == before['hits'] + 1, opts
+
+        # same response with the automaton or threads: same entry
+        hits = c.stats()['hits']
+        assert results(c, 'abca', dfa = True) == results(c, 'abca')
+        assert results(c, 'abca', parallel = True) == results(c, 'abca')
+        assert c.stats()['hits'] == hits + 4
+
+        assert c.stats()['entries'] == len(VARIANTS)
+
+
+def test_invalidation():
+    with Server() as srv:
+        c = srv.client()
+        for k in words(3000):
+            c.set(k, 'v')
+
+        for n, opts in enumerate(VARIANTS):
+            results(c, 'abca', **opts)
+
+            # a SET changes the next response (a new value of a result)
+            value = ('new%d' % n).encode()
+            c.set('abcb', value)
+            hits = c.stats()['hits']
+            res = results(c, 'abca', **opts)
+
+            assert c.stats()['hits'] == hits, opts
+            if not opts.get('top'):
+                data = None if opts.get('values') is False else value
+                assert (b'abcb', 1, 0, data) in res, opts
+
+        results(c, 'abca')
+        assert bytes(c.flushall()) == b'OK'
+        assert results(c, 'abca') == []
+
+        c.set('abca', 'x')
+        assert results(c, 'abca') == [(b'abca', 0, 0, b'x')]
+
+
+def test_eviction():
+    with Server('-c', 1) as srv:
+        c = srv.client()
+        rnd = random.Random(2)
+        for k in words(20000, 3):
+            c.set(k, 'v' * rnd.randint(10, 60))
+
+        ws = words(2000, 4)
+        for w in ws:
+            c.lev(w, 1, 1)
+
+        st = c.stats()
+        assert st['evicts'] > 0 and st['bytes'] <= 1 << 20, st
+
+        # the last searches are still cached
+        hits = st['hits']
+        for w in ws[-5:]:
+            c.lev(w, 1, 1)
+        assert c.stats()['hits'] == hits + 5
+
+
+def test_disabled():
+    with Server('-c', 0) as srv:
+        c = srv.client()
+        for k in words(500):
+            c.set(k, 'v')
+
+        assert results(c, 'abca') == results(c, 'abca')
+        assert c.stats()['hits'] == 0
+
+
+run(test_hits, test_invalidation, test_eviction, test_disabled)
@@ -0,0 +1,60 @@
+"""
+FLUSHALL while the keys of a previous FLUSHALL are still freed in
+background (a stream not read holds its read view, so the old trie can't
+be freed): every FLUSHALL must empty the trie.
+"""
+
+import os
+import random
+
+from levintest import Server, dump, run
+
+
+def words(n, seed = 1):
+    rnd = random.Random(seed)
+    return set(''.join(rnd.choice('abcdefgh')
+                       for _ in range(rnd.randint(3, 12)))
+               for _ in range(n))
+
+
+def flush_rounds(*args):
+    keys = words(60000)
+    name = dump((k, 'v' * 40) for k in keys)
+
+    with Server('-l', name, *args) as srv:
+        # a stream of every key left unread
+        s = srv.client()
+        s.sock.sendall(s.lev_request('ab', 2, 12, False, None, True).stream)
+        s.sock.recv(100)
+
+        c = srv.client()
+        for rnd in range(3):
+            assert bytes(c.flushall()) == b'OK'
+            assert c.count('') == 0
+            assert not c.get('abc')[0]
+
+            for i in range(200):
+                c.set('zz%d' % i, 'v' * 50)
+            assert c.get('zz5')[0]
+            assert c.count('') == 200
+
+        assert bytes(c.flushall()) == b'OK'
+        assert c.count('') == 0 and not c.get('zz5')[0]
+
+        s.sock.close()
+        c.set('a', 'b')
+        assert c.count('') == 1
+        assert c.get('a')[0]
+
+    os.unlink(name)
+
+
+def test_flush_during_flush():
+    flush_rounds()
+
+
+def test_flush_during_flush_index():
+    flush_rounds('-i')
+
+
+run(test_flush_during_flush, test_flush_during_flush_index)
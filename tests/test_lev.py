@@ -0,0 +1,153 @@
+"""
+LEV of long words (byte rows, by chunks of 16 or 32 cells). Top-k LEV
+with many keys at the k-th distance: the first keys by distance and
+key bytes, also split across threads. LEV while
+other clients SET: a search reads the trie as it was when it began (SET
+copies the nodes it changes), also in the event loop (-s 0), where it
+pauses every few levels.
+"""
+
+import itertools
+import os
+import random
+import select
+
+from levintest import Server, dump, run
+
+
+def words(n, seed = 1):
+    rnd = random.Random(seed)
+    return sorted(set(''.join(rnd.choice('abcdefgh')
+                              for _ in range(rnd.randint(3, 12)))
+                      for _ in range(n)))
+
+
+def distance(a, b):
+    prev = list(range(len(b) + 1))
+    for i, ca in enumerate(a):
+        row = [i + 1]
+        for j, cb in enumerate(b):
+            row.append(min(row[j] + 1, prev[j + 1] + 1,
+                           prev[j] + (ca != cb)))
+        prev = row
+    return prev[-1]
+
+
+def check(results, pattern, maxlev, old):
+    """ the keys found are right and include the keys of the dump """
+    found = set()
+    for r in results:
+        k = bytes(r['word']).decode()
+        assert r['lev'] == distance(k, pattern) <= maxlev, k
+        assert bytes(r['data']).decode() in ('old', 'new'), k
+        found.add(k)
+
+    assert len(found) == len(results)
+    assert old <= found
+
+
+def test_long_words():
+    rnd = random.Random(3)
+    keys = sorted(set(''.join(rnd.choice('abc')
+                              for _ in range(rnd.randint(65, 100)))
+                      for _ in range(200)))
+
+    with Server('-c', 0) as srv:
+        c = srv.client()
+        for k in keys:
+            c.set(k, 'old')
+
+        for maxlev in (3, 20, 40):
+            p = list(rnd.choice(keys))
+            for i in range(maxlev // 2):
+                p[rnd.randrange(len(p))] = rnd.choice('abc')
+            p = ''.join(p)
+
+            expect = set(k for k in keys if distance(k, p) <= maxlev)
+            for dfa in (False, True):
+                res = c.lev(p, maxlev, stream = False, dfa = dfa)
+                check(res, p, maxlev, expect)
+                assert len(res) == len(expect)
+
+
+def test_topk_ties():
+    rnd = random.Random(4)
+    keys = sorted(set(''.join(rnd.choice('ab')
+                              for _ in range(rnd.randint(3, 9)))
+                      for _ in range(600)))
+
+    with Server('-t', 4, '-c', 0) as srv:
+        c = srv.client()
+        for k in keys:
+            c.set(k, 'v')
+
+        for p in ('abab', 'bbbbba', 'aab', 'abbabbab'):
+            found = c.lev(p, 3, stream = False)
+            ranked = sorted((r['lev'], bytes(r['word'])) for r in found)
+
+            for k in (1, 5, 17, 60):
+                want = ranked[:k]
+                for par in (False, True):
+                    for dfa in (False, True):
+                        res = c.lev(p, 3, top = k, parallel = par,
+                                    dfa = dfa, stream = False)
+                        got = [(r['lev'], bytes(r['word'])) for r in res]
+                        assert sorted(got) == want, (p, k, par, dfa)
+
+
+def prefixes():
+    """ the root and the nodes of the first two levels """
+    for n in (0, 1, 2):
+        for pre in itertools.product('abcdefgh', repeat = n):
+            yield ''.join(pre)
+
+
+def lev_during_set(*args, **opts):
+    """ the top nodes of the trie have 16 children (a .. p), a SET that
+    adds the letter q to one makes it grow to a bigger node (the old one
+    is freed) while LEV runs, a search long enough to pause many times;
+    the keys with i .. q are too short to match the pattern """
+    keys = words(200000)
+    keys += [p + x for p in prefixes() for x in 'ijklmnop']
+    name = dump((k, 'old') for k in keys)
+    pattern = 'abcdefghabcd'
+    dfa = opts.get('dfa', False)
+    nset = 0
+
+    with Server('-l', name, '-c', 0, *args) as srv:
+        a = srv.client()
+        b = srv.client()
+        old = set(bytes(r['word']).decode()
+                  for r in a.lev(pattern, 6, stream = False, dfa = dfa))
+
+        # SET until the search ends
+        a.sock.sendall(a.lev_request(pattern, 6, 0, dfa, None,
+                                     False).stream)
+        for p in prefixes():
+            assert bytes(b.set(p + 'q', 'new')) == b'OK'
+            nset += 1
+
+            if select.select([a.sock], [], [], 0)[0]:
+                break
+
+        check(a.read_response(), pattern, 6, old)
+        assert nset > 1
+        assert b.count('') == len(keys) + nset
+
+    os.unlink(name)
+
+
+def test_loop_lev_during_set():
+    lev_during_set('-s', 0)
+
+
+def test_loop_dfa_during_set():
+    lev_during_set('-s', 0, dfa = True)
+
+
+def test_thread_lev_during_set():
+    lev_during_set('-s', 1)
+
+
+run(test_long_words, test_topk_ties, test_loop_lev_during_set, test_loop_dfa_during_set,
+    test_thread_lev_during_set)
@@ -0,0 +1,34 @@
+"""
+SCAN: pages of keys longer than the token buffer (64 bytes) after
+shorter keys.
+"""
+
+import random
+
+from levintest import Server, run
+
+
+def test_long_keys():
+    random.seed(7)
+    keys = set()
+    while len(keys) < 600:
+        n = random.choice([1, 5, 30, 63, 64, 65, 100, 300, 1000])
+        keys.add(''.join(random.choice('abc') for _ in range(n)))
+
+    with Server('-s', 0) as srv:
+        c = srv.client()
+        for k in keys:
+            c.set(k, 'v' + k[:10])
+
+        for limit in (1, 7, 100):
+            got = list(c.scan_all(limit = limit, values = True))
+            assert [bytes(k).decode() for k, _ in got] == sorted(keys)
+            assert all(bytes(v).decode() == 'v' + bytes(k).decode()[:10]
+                       for k, v in got)
+
+        got = [bytes(k).decode() for k in c.scan_all('a', limit = 3,
+                                                     prefix = True)]
+        assert got == sorted(k for k in keys if k.startswith('a'))
+
+
+run(test_long_keys)
@@ -0,0 +1,77 @@
+"""
+A streamed LEV that the client doesn't read: its read view ends after
+LEV_VIEW_TIME (the rest of the results wait in memory), so DEFRAG and
+FLUSHALL go on, and the stream is complete when the client reads it.
+"""
+
+import itertools
+import os
+import random
+import time
+
+from levintest import Server, dump, run
+
+
+def words(n, seed = 1):
+    rnd = random.Random(seed)
+    return sorted(set(''.join(rnd.choice('abcdefgh')
+                              for _ in range(rnd.randint(3, 12)))
+                      for _ in range(n)))
+
+
+def prefixes():
+    """ the root and the nodes of the first two levels """
+    for n in (0, 1, 2):
+        for pre in itertools.product('abcdefgh', repeat = n):
+            yield ''.join(pre)
+
+
+def wait_log(srv, text, timeout = 30):
+    deadline = time.time() + timeout
+    while text not in srv.output():
+        assert time.time() < deadline, 'no "%s" in the log' % text
+        time.sleep(0.1)
+
+
+def stalled_stream(*args):
+    """ the top nodes have 16 children (a .. p): a SET of the letter q
+    makes one grow (the old node is freed) under the stalled search """
+    keys = words(20000)
+    keys += [p + x for p in prefixes() for x in 'ijklmnop']
+    name = dump((k, 'v' * 1000) for k in keys)
+
+    with Server('-l', name, *args) as srv:
+        b = srv.client()
+        want = sorted(bytes(r['word'])
+                      for r in b.lev('abcabc', 6, stream = False))
+
+        s = srv.client()
+        it = s.lev_iter('abcabc', 6)
+        got = [bytes(next(it)['word'])]
+
+        for p in prefixes():
+            assert bytes(b.set(p + 'q', 'new')) == b'OK'
+
+        # the view ends: DEFRAG can move the trie
+        time.sleep(2.5)
+        assert bytes(b.defrag()) == b'OK'
+        wait_log(srv, 'defrag: moved')
+
+        got += [bytes(r['word']) for r in it]
+        assert sorted(got) == want, (len(got), len(want))
+
+        assert bytes(b.flushall()) == b'OK'
+        assert b.count('') == 0
+
+    os.unlink(name)
+
+
+def test_loop_stream_during_set():
+    stalled_stream('-s', 0)
+
+
+def test_thread_stream_during_set():
+    stalled_stream('-s', 1)
+
+
+run(test_loop_stream_during_set, test_thread_stream_during_set)